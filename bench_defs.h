@@ -0,0 +1,145 @@
+// bench_defs.h
+#ifndef BENCH_DEFS_H
+#define BENCH_DEFS_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "memory_manager.h"
+
+// Allocator under test, the memory manager or glibc malloc
+typedef struct
+{
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*free)(void *block);
+    void *(*resize)(void *block, size_t size);
+    enum MemLockPolicy lock_policy; // Lock policy of the pool, unused for glibc
+    enum MemPlacement placement;    // Placement policy of the pool, unused for glibc
+} allocator_t;
+
+static void *glibc_alloc(size_t size) { return malloc(size); }
+static void glibc_free(void *block) { free(block); }
+static void *glibc_resize(void *block, size_t size) { return realloc(block, size); }
+
+static const allocator_t pool_allocator = {"mem_alloc", mem_alloc, mem_free, mem_resize, MEM_LOCK_DEFAULT};
+static const allocator_t glibc_allocator = {"glibc", glibc_alloc, glibc_free, glibc_resize, MEM_LOCK_DEFAULT};
+
+// The memory manager with each lock policy, for comparing the policies
+static const allocator_t pool_lock_allocators[] = {
+    {"mem_alloc/mutex", mem_alloc, mem_free, mem_resize, MEM_LOCK_MUTEX},
+    {"mem_alloc/spin", mem_alloc, mem_free, mem_resize, MEM_LOCK_SPIN},
+    {"mem_alloc/futex", mem_alloc, mem_free, mem_resize, MEM_LOCK_FUTEX},
+    {"mem_alloc/none", mem_alloc, mem_free, mem_resize, MEM_LOCK_NONE},
+};
+
+// The memory manager with each placement policy, for comparing the policies
+static const allocator_t pool_fit_allocators[] = {
+    {"mem_alloc/first", mem_alloc, mem_free, mem_resize, MEM_LOCK_DEFAULT, MEM_FIT_FIRST},
+    {"mem_alloc/next", mem_alloc, mem_free, mem_resize, MEM_LOCK_DEFAULT, MEM_FIT_NEXT},
+    {"mem_alloc/best", mem_alloc, mem_free, mem_resize, MEM_LOCK_DEFAULT, MEM_FIT_BEST},
+    {"mem_alloc/worst", mem_alloc, mem_free, mem_resize, MEM_LOCK_DEFAULT, MEM_FIT_WORST},
+};
+
+static inline bool bench_is_pool(const allocator_t *a)
+{
+    return a->alloc == mem_alloc;
+}
+
+// bench_pool_init creates the memory pool for a memory manager allocator
+static inline void bench_pool_init(const allocator_t *a, size_t size)
+{
+    if (bench_is_pool(a))
+    {
+        struct MemConfig config = {size, a->lock_policy};
+        config.placement = a->placement;
+        mem_init_config(&config);
+    }
+}
+
+static inline void bench_pool_deinit(const allocator_t *a)
+{
+    if (bench_is_pool(a))
+        mem_deinit();
+}
+
+// Monotonic time in seconds
+static inline double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Pins the calling thread to a cpu, threads beyond the number of cpus wrap around
+static inline void bench_pin_thread(int index)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % (cpus > 0 ? cpus : 1), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Small per-thread random number generator (xorshift64)
+static inline uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Summary of repeated trials
+typedef struct
+{
+    double mean;
+    double stddev;
+    double ci95; // Half width of the 95% confidence interval of the mean
+    double min;
+    double max;
+} bench_summary_t;
+
+// Two sided 97.5% quantiles of Student's t distribution for 1..30 degrees of freedom
+static const double bench_t975[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+
+static inline bench_summary_t bench_summarize(const double *values, int n)
+{
+    bench_summary_t s = {0};
+    if (n <= 0)
+        return s;
+
+    s.min = s.max = values[0];
+    for (int i = 0; i < n; i++)
+    {
+        s.mean += values[i];
+        if (values[i] < s.min)
+            s.min = values[i];
+        if (values[i] > s.max)
+            s.max = values[i];
+    }
+    s.mean /= n;
+
+    if (n > 1)
+    {
+        double sq = 0;
+        for (int i = 0; i < n; i++)
+            sq += (values[i] - s.mean) * (values[i] - s.mean);
+        s.stddev = sqrt(sq / (n - 1));
+        double t = n - 1 <= 30 ? bench_t975[n - 2] : 1.96;
+        s.ci95 = t * s.stddev / sqrt(n);
+    }
+    return s;
+}
+
+#endif // BENCH_DEFS_H
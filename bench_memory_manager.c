@@ -0,0 +1,523 @@
+// bench_memory_manager.c
+// Allocator microbenchmarks, each workload runs against the memory manager
+// and against glibc malloc and reports ops/sec as CSV or JSON.
+#include "bench_defs.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "common_defs.h"
+#include "linked_list.h"
+#include "perf_counters.h"
+
+#define RING_SIZE 256
+
+// Bounded single producer, single consumer queue for the producer/consumer workload
+typedef struct
+{
+    void *items[RING_SIZE];
+    size_t head; // Next item to pop, written by the consumer
+    size_t tail; // Next free position, written by the producer
+} ring_t;
+
+// Per-thread state, the slots survive between Larson rounds
+typedef struct
+{
+    int thread_id;
+    long ops;              // Operations to perform
+    long done;             // Allocations and frees performed
+    long allocs;           // Allocations that succeeded
+    long failures;         // Allocations that returned NULL
+    uint64_t seed;         // Random state
+    void **slots;          // Live blocks owned by the thread
+    int num_slots;         // Number of slots
+    ring_t *ring;          // Shared with the partner thread in the producer/consumer workload
+    const allocator_t *a;  // Allocator under test
+    double start;          // Time the thread started working in the current round
+    double end;            // Time the thread finished the current round
+} bench_thread_t;
+
+typedef struct
+{
+    const char *name;
+    void (*run)(bench_thread_t *t);
+    int num_slots;         // Live blocks per thread
+    size_t max_size;       // Largest block the workload allocates
+    int rounds;            // Rounds of fresh threads, blocks are handed over between rounds
+    bool paired;           // Threads work in producer/consumer pairs
+    bool pool_only;        // The workload can only run on the memory manager
+    size_t pool_size;      // Pool bytes per thread, 0 for twice the live blocks at their largest
+} workload_t;
+
+typedef struct
+{
+    int num_threads;
+    long ops;
+    int trials;
+    int warmups;
+    bool json;
+    bool perf;             // Collect hardware performance counters
+    bool locks;            // Run the memory manager with every lock policy
+    bool fits;             // Run the memory manager with every placement policy
+    const char *only;
+} bench_config_t;
+
+// Outcome of one trial
+typedef struct
+{
+    double ops_per_sec;
+    long ops;
+    long allocs;
+    long failures;
+    double counts[PERF_NUM_EVENTS]; // Performance counter totals, -1 if not available
+    double meta_bytes;              // Bytes of block metadata per block at the peak, -1 for glibc
+} trial_result_t;
+
+static my_barrier_t barrier;
+static perf_counters_t counters;
+static Node *list_head;
+
+// ********* Workloads *********
+
+static void *bench_alloc(bench_thread_t *t, size_t size)
+{
+    void *block = t->a->alloc(size);
+    if (block)
+    {
+        t->done++;
+        t->allocs++;
+    }
+    else
+        t->failures++;
+    return block;
+}
+
+static void bench_free(bench_thread_t *t, void *block)
+{
+    if (!block)
+        return;
+    t->a->free(block);
+    t->done++;
+}
+
+// Single thread churn, allocate a batch of small blocks and free them in reverse order
+static void run_churn(bench_thread_t *t)
+{
+    while (t->done + t->failures < t->ops)
+    {
+        for (int i = 0; i < t->num_slots; i++)
+            t->slots[i] = bench_alloc(t, 64);
+        for (int i = t->num_slots - 1; i >= 0; i--)
+        {
+            bench_free(t, t->slots[i]);
+            t->slots[i] = NULL;
+        }
+    }
+}
+
+// Larson server simulation, replace random blocks with random sizes, the
+// blocks left over at the end of a round are freed by the next round's thread
+static void run_larson(bench_thread_t *t)
+{
+    long target = t->done + t->failures + t->ops;
+    while (t->done + t->failures < target)
+    {
+        int i = bench_rand(&t->seed) % t->num_slots;
+        bench_free(t, t->slots[i]);
+        t->slots[i] = bench_alloc(t, 16 + bench_rand(&t->seed) % 241);
+    }
+}
+
+// Producer/consumer, even threads allocate and odd threads free the blocks
+static void run_prodcons(bench_thread_t *t)
+{
+    ring_t *ring = t->ring;
+    long items = t->ops / 2;
+
+    for (long n = 0; n < items; n++)
+    {
+        if (t->thread_id % 2 == 0)
+        {
+            void *block = bench_alloc(t, 64);
+            while (__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SIZE)
+                sched_yield();
+            ring->items[ring->tail % RING_SIZE] = block;
+            __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&ring->head, __ATOMIC_RELAXED))
+                sched_yield();
+            bench_free(t, ring->items[ring->head % RING_SIZE]);
+            __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// Hoard threadtest, every thread allocates a batch and frees all of it
+static void run_threadtest(bench_thread_t *t)
+{
+    while (t->done + t->failures < t->ops)
+    {
+        for (int i = 0; i < t->num_slots; i++)
+            t->slots[i] = bench_alloc(t, 64);
+        for (int i = 0; i < t->num_slots; i++)
+        {
+            bench_free(t, t->slots[i]);
+            t->slots[i] = NULL;
+        }
+    }
+}
+
+// Random sizes, flip a coin between allocating into and freeing a random slot
+static void run_random(bench_thread_t *t)
+{
+    while (t->done + t->failures < t->ops)
+    {
+        int i = bench_rand(&t->seed) % t->num_slots;
+        if (t->slots[i])
+        {
+            bench_free(t, t->slots[i]);
+            t->slots[i] = NULL;
+        }
+        else
+        {
+            t->slots[i] = bench_alloc(t, 1 + bench_rand(&t->seed) % 1024);
+        }
+    }
+    for (int i = 0; i < t->num_slots; i++)
+    {
+        bench_free(t, t->slots[i]);
+        t->slots[i] = NULL;
+    }
+}
+
+// Fragmentation, replace random blocks in a pool that is about two thirds
+// full, mostly small blocks with some large ones that need a big enough gap
+static void run_fragment(bench_thread_t *t)
+{
+    long target = t->done + t->failures + t->ops;
+    while (t->done + t->failures < target)
+    {
+        int i = bench_rand(&t->seed) % t->num_slots;
+        bench_free(t, t->slots[i]);
+        size_t size = bench_rand(&t->seed) % 8 ? 16 + bench_rand(&t->seed) % 241 : 1024 + bench_rand(&t->seed) % 3073;
+        t->slots[i] = bench_alloc(t, size);
+    }
+}
+
+// Linked list, every thread inserts its own values into a shared list, looks them up and deletes them
+static void run_list(bench_thread_t *t)
+{
+    uint16_t base = t->thread_id * t->num_slots;
+    while (t->done < t->ops)
+    {
+        for (int i = 0; i < t->num_slots; i++, t->done++)
+            list_insert(&list_head, base + i);
+        for (int i = 0; i < t->num_slots; i++, t->done++)
+            list_search(&list_head, base + i);
+        for (int i = 0; i < t->num_slots; i++, t->done++)
+            list_delete(&list_head, base + i);
+    }
+}
+
+static const workload_t workloads[] = {
+    {"churn", run_churn, 64, 64, 1, false, false},
+    {"larson", run_larson, 256, 256, 4, false, false},
+    {"prodcons", run_prodcons, 0, 64, 1, true, false},
+    {"threadtest", run_threadtest, 100, 64, 1, false, false},
+    {"random", run_random, 256, 1024, 1, false, false},
+    {"list", run_list, 32, sizeof(Node), 1, false, true},
+    {"fragment", run_fragment, 512, 4096, 1, false, false, 512 * 640},
+};
+
+// ********* Harness *********
+
+typedef struct
+{
+    bench_thread_t *t;
+    const workload_t *w;
+} bench_start_t;
+
+static void *bench_start(void *arg)
+{
+    bench_start_t *s = (bench_start_t *)arg;
+    bench_pin_thread(s->t->thread_id);
+    my_barrier_wait(&barrier);
+    s->t->start = bench_now();
+    s->w->run(s->t);
+    s->t->end = bench_now();
+    return NULL;
+}
+
+// run_trial runs one timed trial, the performance counters cover the rounds including thread start up
+static trial_result_t run_trial(const workload_t *w, const allocator_t *a, int num_threads, long ops)
+{
+    trial_result_t result = {0};
+    bench_thread_t t[num_threads];
+    bench_start_t start[num_threads];
+    pthread_t threads[num_threads];
+    ring_t rings[num_threads / 2 + 1];
+
+    bench_pool_init(a, num_threads * (w->pool_size ? w->pool_size : w->max_size * (w->num_slots ? w->num_slots : RING_SIZE) * 2));
+
+    memset(rings, 0, sizeof(rings));
+    for (int i = 0; i < num_threads; i++)
+    {
+        t[i] = (bench_thread_t){.thread_id = i, .ops = ops, .seed = 0x9E3779B97F4A7C15ull * (i + 1),
+                                .num_slots = w->num_slots, .ring = &rings[i / 2], .a = a};
+        t[i].slots = w->num_slots ? calloc(w->num_slots, sizeof(void *)) : NULL;
+        start[i] = (bench_start_t){.t = &t[i], .w = w};
+    }
+
+    // A round lasts from the first thread starting to the last thread finishing
+    double seconds = 0;
+    perf_counters_start(&counters);
+    for (int round = 0; round < w->rounds; round++)
+    {
+        my_barrier_init(&barrier, num_threads + 1);
+        for (int i = 0; i < num_threads; i++)
+        {
+            if (pthread_create(&threads[i], NULL, bench_start, &start[i]) != 0)
+            {
+                perror("Failed to create thread");
+                exit(EXIT_FAILURE);
+            }
+        }
+        my_barrier_wait(&barrier);
+
+        double first = 0, last = 0;
+        for (int i = 0; i < num_threads; i++)
+        {
+            pthread_join(threads[i], NULL);
+            if (i == 0 || t[i].start < first)
+                first = t[i].start;
+            if (t[i].end > last)
+                last = t[i].end;
+        }
+        seconds += last - first;
+        my_barrier_destroy(&barrier);
+    }
+    perf_counters_stop(&counters);
+    perf_counters_read(&counters, result.counts);
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        for (int j = 0; j < t[i].num_slots; j++)
+            if (t[i].slots[j])
+                a->free(t[i].slots[j]);
+        free(t[i].slots);
+        result.ops += t[i].done;
+        result.allocs += t[i].allocs;
+        result.failures += t[i].failures;
+    }
+
+    // The block table keeps its size after the blocks are freed
+    result.meta_bytes = -1;
+    if (bench_is_pool(a))
+    {
+        struct MemStats stats;
+        mem_stats(&stats);
+        result.meta_bytes = stats.peak_blocks ? (double)stats.metadata_bytes / stats.peak_blocks : 0;
+    }
+
+    bench_pool_deinit(a);
+
+    result.ops_per_sec = seconds > 0 ? result.ops / seconds : 0;
+    return result;
+}
+
+static void report(const bench_config_t *cfg, const workload_t *w, const allocator_t *a, int num_threads,
+                   bench_summary_t *s, trial_result_t *total, double glibc_mean, bool *first)
+{
+    // Pool only workloads have no glibc run to compare against
+    double relative = glibc_mean > 0 ? s->mean / glibc_mean : -1;
+    double failure_rate = total->allocs + total->failures ? (double)total->failures / (total->allocs + total->failures) : 0;
+    if (cfg->json)
+    {
+        printf("%s\n  {\"workload\": \"%s\", \"allocator\": \"%s\", \"threads\": %d, \"trials\": %d, "
+               "\"ops_per_thread\": %ld, \"ops_per_sec\": %.1f, \"ci95\": %.1f, \"stddev\": %.1f, "
+               "\"min\": %.1f, \"max\": %.1f, \"failures\": %ld, \"failure_rate\": %.6f",
+               *first ? "[" : ",", w->name, a->name, num_threads, cfg->trials, cfg->ops,
+               s->mean, s->ci95, s->stddev, s->min, s->max, total->failures, failure_rate);
+        if (relative < 0)
+            printf(", \"relative_to_glibc\": null");
+        else
+            printf(", \"relative_to_glibc\": %.4f", relative);
+        if (total->meta_bytes < 0)
+            printf(", \"meta_bytes_per_block\": null");
+        else
+            printf(", \"meta_bytes_per_block\": %.2f", total->meta_bytes);
+        for (int i = 0; cfg->perf && i < PERF_NUM_EVENTS; i++)
+        {
+            if (total->counts[i] < 0)
+                printf(", \"%s_per_op\": null", perf_event_names[i]);
+            else
+                printf(", \"%s_per_op\": %.4f", perf_event_names[i], total->counts[i] / total->ops);
+        }
+        printf("}");
+    }
+    else
+    {
+        if (*first)
+        {
+            printf("workload,allocator,threads,trials,ops_per_thread,ops_per_sec,ci95,stddev,min,max,failures,failure_rate,relative_to_glibc,"
+                   "meta_bytes_per_block");
+            for (int i = 0; cfg->perf && i < PERF_NUM_EVENTS; i++)
+                printf(",%s_per_op", perf_event_names[i]);
+            printf("\n");
+        }
+        printf("%s,%s,%d,%d,%ld,%.1f,%.1f,%.1f,%.1f,%.1f,%ld,%.6f", w->name, a->name, num_threads, cfg->trials,
+               cfg->ops, s->mean, s->ci95, s->stddev, s->min, s->max, total->failures, failure_rate);
+        if (relative < 0)
+            printf(",NA");
+        else
+            printf(",%.4f", relative);
+        if (total->meta_bytes < 0)
+            printf(",NA");
+        else
+            printf(",%.2f", total->meta_bytes);
+        for (int i = 0; cfg->perf && i < PERF_NUM_EVENTS; i++)
+        {
+            if (total->counts[i] < 0)
+                printf(",NA");
+            else
+                printf(",%.4f", total->counts[i] / total->ops);
+        }
+        printf("\n");
+    }
+    *first = false;
+}
+
+static void run_workload(const bench_config_t *cfg, const workload_t *w, bool *first)
+{
+    const allocator_t *allocators[6] = {&glibc_allocator, &pool_allocator};
+    int num_allocators = 2;
+    double results[cfg->trials];
+    double glibc_mean = 0;
+
+    // The churn workload is single threaded, the pairs need an even thread count
+    int num_threads = cfg->num_threads;
+    if (w->run == run_churn)
+        num_threads = 1;
+    if (w->paired)
+        num_threads = num_threads < 2 ? 2 : num_threads & ~1;
+
+    // Without a lock the pool is only safe for a single thread
+    if (cfg->locks)
+    {
+        num_allocators = 1;
+        for (int i = 0; i < sizeof(pool_lock_allocators) / sizeof(pool_lock_allocators[0]); i++)
+        {
+            if (pool_lock_allocators[i].lock_policy != MEM_LOCK_NONE || num_threads == 1)
+                allocators[num_allocators++] = &pool_lock_allocators[i];
+        }
+    }
+    else if (cfg->fits)
+    {
+        num_allocators = 1;
+        for (int i = 0; i < sizeof(pool_fit_allocators) / sizeof(pool_fit_allocators[0]); i++)
+            allocators[num_allocators++] = &pool_fit_allocators[i];
+    }
+
+    long ops = cfg->ops / w->rounds;
+    for (int i = w->pool_only ? 1 : 0; i < num_allocators; i++)
+    {
+        for (int j = 0; j < cfg->warmups; j++)
+            run_trial(w, allocators[i], num_threads, ops);
+
+        // Counters are summed over the trials, an event missing in any trial is reported as missing
+        trial_result_t total = {0};
+        for (int j = 0; j < cfg->trials; j++)
+        {
+            trial_result_t result = run_trial(w, allocators[i], num_threads, ops);
+            results[j] = result.ops_per_sec;
+            total.ops += result.ops;
+            total.allocs += result.allocs;
+            total.failures += result.failures;
+            total.meta_bytes = result.meta_bytes;
+            for (int k = 0; k < PERF_NUM_EVENTS; k++)
+                total.counts[k] = total.counts[k] < 0 || result.counts[k] < 0 ? -1 : total.counts[k] + result.counts[k];
+        }
+
+        bench_summary_t s = bench_summarize(results, cfg->trials);
+        if (i == 0)
+            glibc_mean = s.mean;
+        report(cfg, w, allocators[i], num_threads, &s, &total, glibc_mean, first);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config_t cfg = {.num_threads = 4, .ops = 100000, .trials = 5, .warmups = 1};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:r:w:b:jplfh")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            cfg.num_threads = atoi(optarg);
+            break;
+        case 'n':
+            cfg.ops = atol(optarg);
+            break;
+        case 'r':
+            cfg.trials = atoi(optarg);
+            break;
+        case 'w':
+            cfg.warmups = atoi(optarg);
+            break;
+        case 'b':
+            cfg.only = optarg;
+            break;
+        case 'j':
+            cfg.json = true;
+            break;
+        case 'p':
+            cfg.perf = true;
+            break;
+        case 'l':
+            cfg.locks = true;
+            break;
+        case 'f':
+            cfg.fits = true;
+            break;
+        default:
+            printf("Usage: %s [-t threads] [-n ops per thread] [-r trials] [-w warmups] [-b workload] [-j] [-p] [-l] [-f]\n", argv[0]);
+            printf("  Workloads:");
+            for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+                printf(" %s", workloads[i].name);
+            printf("\n  Results are printed as CSV, or as JSON with -j.\n");
+            printf("  -p adds hardware performance counters per operation, where perf_event_open is permitted.\n");
+            printf("  -l compares the lock policies of the memory manager (none only for single thread workloads).\n");
+            printf("  -f compares the placement policies of the memory manager, e.g. -f -b fragment.\n");
+            return 1;
+        }
+    }
+
+    if (cfg.num_threads < 1 || cfg.ops < 1 || cfg.trials < 1 || cfg.warmups < 0)
+    {
+        fprintf(stderr, "bench_memory_manager: invalid arguments\n");
+        return 1;
+    }
+
+    // Without -p, or when no counter can be opened, every event reads as not available
+    for (int i = 0; i < PERF_NUM_EVENTS; i++)
+        counters.fds[i] = -1;
+    if (cfg.perf && perf_counters_open(&counters) == 0)
+        fprintf(stderr, "bench_memory_manager: performance counters are not available, check perf_event_paranoid\n");
+
+    bool first = true;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        if (cfg.only && strcmp(cfg.only, workloads[i].name) != 0)
+            continue;
+        run_workload(&cfg, &workloads[i], &first);
+        fflush(stdout);
+    }
+    if (cfg.json && !first)
+        printf("\n]\n");
+
+    perf_counters_close(&counters);
+    return 0;
+}
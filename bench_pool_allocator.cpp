@@ -0,0 +1,337 @@
+// bench_pool_allocator.cpp
+// Container benchmarks for mm::pool_allocator, the mm std::pmr resources and
+// mm::static_pool,
+// each workload runs with the pool and with the standard allocator or
+// new_delete_resource and reports ops/sec as CSV or JSON.
+#include "bench_defs.h"
+#include "mm_pmr.hpp"
+#include "mm_static_pool.hpp"
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+struct bench_config
+{
+    long ops = 100000; // Elements inserted and removed per trial
+    int trials = 10;
+    int warmups = 2;
+    bool json = false;
+    const char *only = nullptr;
+};
+
+// Each workload inserts ops elements, then removes them, and returns a checksum
+// of the elements so that the work can not be optimized away
+
+template <template <typename> class Alloc>
+static long run_list(long ops, uint64_t seed)
+{
+    std::list<long, Alloc<long>> list;
+    for (long i = 0; i < ops; i++)
+        list.push_back(bench_rand(&seed) % 1000);
+
+    long sum = 0;
+    while (!list.empty())
+    {
+        sum += list.front();
+        list.pop_front();
+    }
+    return sum;
+}
+
+template <template <typename> class Alloc>
+static long run_map(long ops, uint64_t seed)
+{
+    using value = std::pair<const long, long>;
+    std::map<long, long, std::less<long>, Alloc<value>> map;
+    for (long i = 0; i < ops; i++)
+        map[bench_rand(&seed) % (ops * 4)] = i;
+
+    long sum = 0;
+    for (auto it = map.begin(); it != map.end(); it = map.erase(it))
+        sum += it->second;
+    return sum;
+}
+
+template <template <typename> class Alloc>
+static long run_unordered_map(long ops, uint64_t seed)
+{
+    using value = std::pair<const long, long>;
+    std::unordered_map<long, long, std::hash<long>, std::equal_to<long>, Alloc<value>> map;
+    for (long i = 0; i < ops; i++)
+        map[bench_rand(&seed) % (ops * 4)] = i;
+
+    long sum = 0;
+    for (auto it = map.begin(); it != map.end(); it = map.erase(it))
+        sum += it->second;
+    return sum;
+}
+
+template <template <typename> class Alloc>
+static long run_vector(long ops, uint64_t seed)
+{
+    std::vector<long, Alloc<long>> vector;
+    for (long i = 0; i < ops; i++)
+        vector.push_back(bench_rand(&seed) % 1000);
+
+    long sum = 0;
+    while (!vector.empty())
+    {
+        sum += vector.back();
+        vector.pop_back();
+    }
+    return sum;
+}
+
+// std::pmr::new_delete_resource as a type, so that it fits the pmr workloads
+class new_delete_resource : public std::pmr::memory_resource
+{
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t align) override
+    {
+        std::pmr::new_delete_resource()->deallocate(ptr, bytes, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+// The pmr workloads build the same containers on a resource of their own
+template <typename Resource>
+static long run_pmr_list(long ops, uint64_t seed)
+{
+    Resource resource;
+    std::pmr::list<long> list(&resource);
+    for (long i = 0; i < ops; i++)
+        list.push_back(bench_rand(&seed) % 1000);
+
+    long sum = 0;
+    while (!list.empty())
+    {
+        sum += list.front();
+        list.pop_front();
+    }
+    return sum;
+}
+
+template <typename Resource>
+static long run_pmr_map(long ops, uint64_t seed)
+{
+    Resource resource;
+    std::pmr::map<long, long> map(&resource);
+    for (long i = 0; i < ops; i++)
+        map[bench_rand(&seed) % (ops * 4)] = i;
+
+    long sum = 0;
+    for (auto it = map.begin(); it != map.end(); it = map.erase(it))
+        sum += it->second;
+    return sum;
+}
+
+// Node churn with at most static_nodes nodes alive, the load a fixed-capacity pool is made for
+constexpr std::size_t static_nodes = 4096;
+
+struct static_node
+{
+    long value;
+    static_node *next;
+};
+
+// operator new and delete behind the interface of mm::static_pool
+struct new_delete_nodes
+{
+    void *allocate() { return ::operator new(sizeof(static_node)); }
+    void deallocate(void *node) noexcept { ::operator delete(node); }
+};
+
+template <typename Pool>
+static long run_static_nodes(long ops, uint64_t seed)
+{
+    static Pool pool;
+    static_node *live[static_nodes] = {};
+
+    long sum = 0;
+    for (long i = 0; i < ops; i++)
+    {
+        static_node *&node = live[bench_rand(&seed) % static_nodes];
+        if (node)
+        {
+            sum += node->value;
+            pool.deallocate(node);
+        }
+        node = static_cast<static_node *>(pool.allocate());
+        node->value = i;
+    }
+
+    for (static_node *node : live)
+    {
+        if (node)
+        {
+            sum += node->value;
+            pool.deallocate(node);
+        }
+    }
+    return sum;
+}
+
+struct workload
+{
+    const char *name;
+    const char *pool_name;
+    const char *std_name;
+    long (*pool_run)(long, uint64_t);
+    long (*std_run)(long, uint64_t);
+};
+
+static const workload workloads[] = {
+    {"list", "mm::pool_allocator", "std::allocator", run_list<mm::pool_allocator>, run_list<std::allocator>},
+    {"map", "mm::pool_allocator", "std::allocator", run_map<mm::pool_allocator>, run_map<std::allocator>},
+    {"unordered_map", "mm::pool_allocator", "std::allocator",
+     run_unordered_map<mm::pool_allocator>, run_unordered_map<std::allocator>},
+    {"vector", "mm::pool_allocator", "std::allocator", run_vector<mm::pool_allocator>, run_vector<std::allocator>},
+    {"pmr_list", "mm::pool_resource", "std::pmr::new_delete_resource",
+     run_pmr_list<mm::pool_resource>, run_pmr_list<new_delete_resource>},
+    {"pmr_list_unsync", "mm::unsynchronized_pool_resource", "std::pmr::new_delete_resource",
+     run_pmr_list<mm::unsynchronized_pool_resource>, run_pmr_list<new_delete_resource>},
+    {"pmr_list_monotonic", "mm::monotonic_resource", "std::pmr::new_delete_resource",
+     run_pmr_list<mm::monotonic_resource>, run_pmr_list<new_delete_resource>},
+    {"pmr_map", "mm::pool_resource", "std::pmr::new_delete_resource",
+     run_pmr_map<mm::pool_resource>, run_pmr_map<new_delete_resource>},
+    {"pmr_map_unsync", "mm::unsynchronized_pool_resource", "std::pmr::new_delete_resource",
+     run_pmr_map<mm::unsynchronized_pool_resource>, run_pmr_map<new_delete_resource>},
+    {"pmr_map_monotonic", "mm::monotonic_resource", "std::pmr::new_delete_resource",
+     run_pmr_map<mm::monotonic_resource>, run_pmr_map<new_delete_resource>},
+    {"static_nodes", "mm::static_pool", "operator new",
+     run_static_nodes<mm::static_pool<sizeof(static_node), static_nodes>>, run_static_nodes<new_delete_nodes>},
+};
+
+// Runs one trial and returns the elements inserted and removed per second
+static double run_trial(long (*run)(long, uint64_t), bool pool, long ops, long *checksum)
+{
+    double start = bench_now();
+    *checksum = run(ops, 88172645463325252ULL);
+    double seconds = bench_now() - start;
+
+    // Every trial starts from empty slabs, like std::allocator starts from a heap without nodes
+    if (pool)
+        mm::pool::global().release();
+    return 2 * ops / seconds;
+}
+
+static void report(const bench_config &cfg, const workload &w, const char *allocator,
+                   const bench_summary_t &s, double relative, bool *first)
+{
+    if (cfg.json)
+    {
+        printf("%s\n  {\"workload\": \"%s\", \"allocator\": \"%s\", \"trials\": %d, \"ops\": %ld, "
+               "\"ops_per_sec\": %.1f, \"ci95\": %.1f, \"stddev\": %.1f, \"min\": %.1f, \"max\": %.1f, "
+               "\"relative_to_std\": %.4f}",
+               *first ? "" : ",", w.name, allocator, cfg.trials, cfg.ops, s.mean, s.ci95, s.stddev, s.min, s.max, relative);
+    }
+    else
+    {
+        if (*first)
+            printf("workload,allocator,trials,ops,ops_per_sec,ci95,stddev,min,max,relative_to_std\n");
+        printf("%s,%s,%d,%ld,%.1f,%.1f,%.1f,%.1f,%.1f,%.4f\n", w.name, allocator, cfg.trials, cfg.ops,
+               s.mean, s.ci95, s.stddev, s.min, s.max, relative);
+    }
+    *first = false;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config cfg;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:w:b:jh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            cfg.ops = atol(optarg);
+            break;
+        case 'r':
+            cfg.trials = atoi(optarg);
+            break;
+        case 'w':
+            cfg.warmups = atoi(optarg);
+            break;
+        case 'b':
+            cfg.only = optarg;
+            break;
+        case 'j':
+            cfg.json = true;
+            break;
+        default:
+            printf("Usage: %s [-n elements] [-r trials] [-w warmups] [-b workload] [-j]\n", argv[0]);
+            printf("  Workloads:");
+            for (const workload &w : workloads)
+                printf(" %s", w.name);
+            printf("\n  Results are printed as CSV, or as JSON with -j.\n");
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (cfg.ops <= 0 || cfg.trials <= 0 || cfg.warmups < 0)
+    {
+        fprintf(stderr, "bench_pool_allocator: invalid arguments\n");
+        return 1;
+    }
+
+    bool first = true;
+    if (cfg.json)
+        printf("[");
+
+    for (const workload &w : workloads)
+    {
+        if (cfg.only && strcmp(cfg.only, w.name) != 0)
+            continue;
+
+        std::vector<double> pool_rates(cfg.trials), std_rates(cfg.trials);
+        long pool_sum = 0, std_sum = 0;
+
+        // Room for the nodes, the bucket arrays and the vector while it grows,
+        // the warmups touch the pages of the pool before the measured trials
+        mem_init(cfg.ops * 256);
+        for (int t = -cfg.warmups; t < cfg.trials; t++)
+        {
+            double pool_rate = run_trial(w.pool_run, true, cfg.ops, &pool_sum);
+            double std_rate = run_trial(w.std_run, false, cfg.ops, &std_sum);
+            if (t >= 0)
+            {
+                pool_rates[t] = pool_rate;
+                std_rates[t] = std_rate;
+            }
+        }
+
+        mem_deinit();
+
+        // Both allocators must have produced the same containers
+        if (pool_sum != std_sum)
+        {
+            fprintf(stderr, "bench_pool_allocator: %s checksums differ (%ld, %ld)\n", w.name, pool_sum, std_sum);
+            return 1;
+        }
+
+        bench_summary_t pool_s = bench_summarize(pool_rates.data(), cfg.trials);
+        bench_summary_t std_s = bench_summarize(std_rates.data(), cfg.trials);
+        report(cfg, w, w.pool_name, pool_s, pool_s.mean / std_s.mean, &first);
+        report(cfg, w, w.std_name, std_s, 1.0, &first);
+    }
+
+    if (cfg.json)
+        printf("\n]\n");
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 
 char tmpbuff[1024];
 unsigned long tmppos = 0;
@@ -67,8 +68,8 @@ void *malloc(size_t size){
   }
 
   void *ptr = myfn_malloc(size);
-  char buffer[50];
-  int len=sprintf(buffer,"rMALLOc (%ld) at %p\n",size,ptr);
+  char buffer[80];
+  int len=sprintf(buffer,"rMALLOc (%ld) at %p [%ld]\n",size,ptr,syscall(SYS_gettid));
   write(1,buffer,len);
   return ptr;
 }
@@ -83,14 +84,14 @@ void free(void *ptr){
   else
     myfn_free(ptr);
 
-  char buffer[50];
-  int len=sprintf(buffer,"rFREE at %p\n",ptr);
+  char buffer[80];
+  int len=sprintf(buffer,"rFREE at %p [%ld]\n",ptr,syscall(SYS_gettid));
   write(1,buffer,len);
 }
 
 void *realloc(void *ptr, size_t size)
 {
-  char buffer[70];
+  char buffer[100];
   int len=sprintf(buffer,"rREALLOC-> (%ld) at %p \n",size,ptr);
   write(1,buffer,len);
     if (myfn_malloc == NULL)
@@ -107,7 +108,7 @@ void *realloc(void *ptr, size_t size)
     void *nptr = myfn_realloc(ptr, size);
 
 
-    len=sprintf(buffer,"rREALLOC (%ld) at %p -> %p\n",size,ptr,nptr);
+    len=sprintf(buffer,"rREALLOC (%ld) at %p -> %p [%ld]\n",size,ptr,nptr,syscall(SYS_gettid));
     write(1,buffer,len);
     return nptr;
 }
@@ -124,8 +125,8 @@ void *calloc(size_t nmemb, size_t size)
 
     void *ptr = myfn_calloc(nmemb, size);
 
-    char buffer[70];
-    int len=sprintf(buffer,"rCALLOC (%ld,%ld) \n",nmemb, size);
+    char buffer[100];
+    int len=sprintf(buffer,"rCALLOC (%ld,%ld) at %p [%ld]\n",nmemb, size, ptr, syscall(SYS_gettid));
     write(1,buffer,len);
     
     return ptr;
@@ -135,8 +136,8 @@ void *memalign(size_t blocksize, size_t bytes)
 {
     void *ptr = myfn_memalign(blocksize, bytes);
 
-    char buffer[70];
-    int len=sprintf(buffer,"rMEMALING (%ld, %ld) @ %p\n",blocksize, bytes,ptr);
+    char buffer[100];
+    int len=sprintf(buffer,"rMEMALING (%ld, %ld) @ %p [%ld]\n",blocksize, bytes,ptr,syscall(SYS_gettid));
     write(1,buffer,len);
     
     return ptr;
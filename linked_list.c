@@ -185,7 +185,7 @@ void list_delete(Node** head, uint16_t data)
     pthread_mutex_unlock(&list_mutex);
     
     pthread_mutex_destroy(&current->lock);
-    mem_free(current);
+    mem_free_sized(current, sizeof(Node));
 };
 
 Node* list_search(Node** head, uint16_t data)
@@ -302,7 +302,7 @@ void list_cleanup(Node** head)
     {
         Node* next_node = cur_node->next;
         pthread_mutex_destroy(&cur_node->lock);
-        mem_free(cur_node);
+        mem_free_sized(cur_node, sizeof(Node));
         cur_node = next_node;
     }
     
@@ -0,0 +1,129 @@
+// mem_arena.c
+#include "mem_arena.h"
+#include <stdint.h>
+
+// Rounds up to the arena alignment
+#define arena_round(size) (((size) + MEM_ARENA_ALIGN - 1) & ~(size_t)(MEM_ARENA_ALIGN - 1))
+
+// Header at the start of every chunk, the blocks follow it
+struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    char *end;  // End of the chunk
+};
+
+struct MemArena
+{
+    struct ArenaChunk *first;    // The chunks in the order they are used
+    struct ArenaChunk *current;  // Chunk the blocks are taken from
+    char *top;                   // Next free byte of the current chunk
+    size_t chunk_size;
+};
+
+// chunk_new allocates a chunk with room for size bytes of blocks from the pool
+static struct ArenaChunk *chunk_new(size_t size)
+{
+    size_t length = sizeof(struct ArenaChunk) + size + MEM_ARENA_ALIGN - 1;
+    struct ArenaChunk *chunk = mem_alloc(length);
+    if (!chunk) return NULL;
+
+    // mem_alloc does not align, so the data starts at the next aligned address
+    chunk->next = NULL;
+    chunk->end = (char *)chunk + length;
+    return chunk;
+}
+
+// chunk_data returns the first aligned byte after the chunk header
+static char *chunk_data(struct ArenaChunk *chunk)
+{
+    uintptr_t data = (uintptr_t)(chunk + 1);
+    return (char *)arena_round(data);
+}
+
+// mem_arena_create creates an arena with one chunk
+struct MemArena *mem_arena_create(size_t chunk_size)
+{
+    // The chunk header and the alignment slack must not wrap the chunk length
+    if (chunk_size > SIZE_MAX - sizeof(struct ArenaChunk) - 2 * MEM_ARENA_ALIGN)
+    {
+        fprintf(stderr, "mem_arena_create failed, %zu bytes is too large.\n", chunk_size);
+        return NULL;
+    }
+
+    struct MemArena *arena = malloc(sizeof(struct MemArena));
+    if (!arena) return NULL;
+
+    arena->chunk_size = chunk_size;
+    arena->first = chunk_new(chunk_size);
+    if (!arena->first)
+    {
+        fprintf(stderr, "mem_arena_create failed, can not allocate a chunk of %zu bytes.\n", chunk_size);
+        free(arena);
+        return NULL;
+    }
+
+    mem_arena_reset(arena);
+    return arena;
+}
+
+// mem_arena_alloc bumps the top of the current chunk
+void *mem_arena_alloc(struct MemArena *arena, size_t size)
+{
+    // Rounding the size or adding the chunk header must not wrap
+    if (size > SIZE_MAX - sizeof(struct ArenaChunk) - 2 * MEM_ARENA_ALIGN)
+    {
+        fprintf(stderr, "mem_arena_alloc failed, %zu bytes is too large.\n", size);
+        return NULL;
+    }
+    size = arena_round(size);
+
+    // Fast path, the block fits in the current chunk
+    if (size <= (size_t)(arena->current->end - arena->top))
+    {
+        void *block = arena->top;
+        arena->top += size;
+        return block;
+    }
+
+    // Move on to the next kept chunk that fits, or add a new one after the
+    // current chunk. Kept chunks that are too small are used after a reset.
+    struct ArenaChunk *chunk = arena->current->next;
+    while (chunk && size > (size_t)(chunk->end - chunk_data(chunk)))
+    {
+        chunk = chunk->next;
+    }
+
+    if (!chunk)
+    {
+        chunk = chunk_new(size > arena->chunk_size ? size : arena->chunk_size);
+        if (!chunk) return NULL;
+        chunk->next = arena->current->next;
+        arena->current->next = chunk;
+    }
+
+    arena->current = chunk;
+    arena->top = chunk_data(chunk) + size;
+    return chunk_data(chunk);
+}
+
+// mem_arena_reset moves the top back to the start of the first chunk
+void mem_arena_reset(struct MemArena *arena)
+{
+    arena->current = arena->first;
+    arena->top = chunk_data(arena->first);
+}
+
+// mem_arena_destroy frees the chunks and the arena
+void mem_arena_destroy(struct MemArena *arena)
+{
+    if (!arena) return;
+
+    struct ArenaChunk *chunk = arena->first;
+    while (chunk)
+    {
+        struct ArenaChunk *next = chunk->next;
+        mem_free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
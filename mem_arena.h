@@ -0,0 +1,54 @@
+// mem_arena.h
+#ifndef MEM_ARENA_H
+#define MEM_ARENA_H
+
+#include "memory_manager.h"
+
+// Helps C++ compilers to handle C header files
+ #ifdef __cplusplus
+ extern "C"
+ {
+ #endif
+
+// Alignment of the blocks handed out by an arena
+#define MEM_ARENA_ALIGN 16
+
+// A bump-pointer region on top of the memory pool. The arena takes chunks
+// from mem_alloc and hands out blocks by moving a pointer, the blocks are
+// not freed one by one but all at once with mem_arena_reset or
+// mem_arena_destroy. An arena is not thread safe, use one per thread.
+struct MemArena;
+
+   /**
+      * Creates an arena whose first chunk is allocated from the pool right away.
+      *
+      * @param chunk_size The size of each chunk taken from the pool, larger
+      *                   blocks get a chunk of their own.
+      * @return The arena, or NULL if the pool has no room for the first chunk.
+      */
+     struct MemArena *mem_arena_create(size_t chunk_size);
+
+     /**
+      * Allocates a block from the arena, aligned to MEM_ARENA_ALIGN. Takes a
+      * new chunk from the pool when the current one is full.
+      *
+      * @return A pointer to the block, or NULL if the pool is out of memory.
+      */
+     void *mem_arena_alloc(struct MemArena *arena, size_t size);
+
+     /**
+      * Releases every block of the arena in O(1). The chunks are kept and
+      * reused by the next allocations.
+      */
+     void mem_arena_reset(struct MemArena *arena);
+
+     /**
+      * Returns all chunks of the arena to the pool.
+      */
+     void mem_arena_destroy(struct MemArena *arena);
+
+ #ifdef __cplusplus
+ }
+ #endif
+
+ #endif // MEM_ARENA_H
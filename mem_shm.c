@@ -0,0 +1,378 @@
+// mem_shm.c
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "mem_shm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x4d48534d454d31ULL  // "1MEMSHM"
+#define SHM_ALIGN 16
+
+// Rounds up to the block alignment
+#define shm_round(size) (((size) + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1))
+
+// Header in front of every block. The blocks form a list ordered by address,
+// like the MemBlock list of the private pool, linked by offsets from the start
+// of the mapping so that the list reads the same in every process.
+struct ShmBlock
+{
+    uint64_t next;  // Offset of the next block header, 0 at the end of the list
+    uint64_t size;  // Size requested by the caller
+};
+
+// Start of the mapping, shared by all processes
+struct ShmHeader
+{
+    uint64_t magic;          // Set last by the creator, the pool is ready once it matches
+    uint64_t length;         // Length of the mapping
+    uint64_t first;          // Offset of the first block header, 0 if the pool is empty
+    pthread_mutex_t lock;    // Process-shared, robust mutex for the list and the counters
+    struct MemStats counters;
+};
+
+// Blocks start after the header
+#define SHM_DATA_START shm_round(sizeof(struct ShmHeader))
+
+// Per-process handle, base differs between processes
+struct MemShm
+{
+    struct ShmHeader* header;
+    size_t length;
+    int fd;
+};
+
+// The block header at offset
+static struct ShmBlock* shm_block(struct MemShm* shm, uint64_t offset)
+{
+    return (struct ShmBlock*)((char*)shm->header + offset);
+}
+
+// End offset of the memory taken by the block at offset
+static uint64_t shm_block_end(struct MemShm* shm, uint64_t offset)
+{
+    return offset + sizeof(struct ShmBlock) + shm_round(shm_block(shm, offset)->size);
+}
+
+// shm_recount rebuilds the layout counters from the block list, after a
+// process died while holding the lock. The list itself is only changed by
+// single stores of a next offset, so it is consistent at any point.
+static void shm_recount(struct MemShm* shm)
+{
+    struct ShmHeader* header = shm->header;
+    header->counters.used_bytes = 0;
+    for (uint64_t offset = header->first; offset; offset = shm_block(shm, offset)->next)
+    {
+        header->counters.used_bytes += shm_block(shm, offset)->size;
+    }
+}
+
+// shm_lock takes the pool lock, repairing the pool if its last owner died
+static void shm_lock(struct MemShm* shm)
+{
+    if (pthread_mutex_lock(&shm->header->lock) == EOWNERDEAD)
+    {
+        fprintf(stderr, "mem_shm: a process died while holding the pool lock, recovering.\n");
+        shm_recount(shm);
+        pthread_mutex_consistent(&shm->header->lock);
+    }
+}
+
+static void shm_unlock(struct MemShm* shm)
+{
+    pthread_mutex_unlock(&shm->header->lock);
+}
+
+// shm_map maps the pool in fd and returns its handle, the handle owns fd
+static struct MemShm* shm_map(int fd, size_t length)
+{
+    struct MemShm* shm = malloc(sizeof(struct MemShm));
+    void* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (!shm || base == MAP_FAILED)
+    {
+        fprintf(stderr, "mem_shm: can not map the pool.\n");
+        if (base != MAP_FAILED) munmap(base, length);
+        free(shm);
+        close(fd);
+        return NULL;
+    }
+
+    shm->header = base;
+    shm->length = length;
+    shm->fd = fd;
+    return shm;
+}
+
+// mem_shm_create creates a shared pool, named or anonymous
+struct MemShm* mem_shm_create(const char* name, size_t size)
+{
+    // Rounding the size and adding the header must not wrap
+    if (size > SIZE_MAX - SHM_DATA_START - SHM_ALIGN)
+    {
+        fprintf(stderr, "mem_shm_create failed, %zu bytes is too large.\n", size);
+        return NULL;
+    }
+
+    int fd = name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) : memfd_create("mem_shm", 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "mem_shm_create failed, can not create %s.\n", name ? name : "memfd");
+        return NULL;
+    }
+
+    size_t length = SHM_DATA_START + shm_round(size);
+    if (ftruncate(fd, length) != 0)
+    {
+        fprintf(stderr, "mem_shm_create failed, can not resize the pool.\n");
+        close(fd);
+        if (name) shm_unlink(name);
+        return NULL;
+    }
+
+    struct MemShm* shm = shm_map(fd, length);
+    if (!shm)
+    {
+        if (name) shm_unlink(name);
+        return NULL;
+    }
+
+    // Initialize the lock so that any process can take it, and a process that
+    // dies while holding it does not leave the others waiting forever
+    struct ShmHeader* header = shm->header;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    header->length = length;
+    header->first = 0;
+    memset(&header->counters, 0, sizeof(header->counters));
+    header->counters.pool_size = length - SHM_DATA_START;
+
+    // Publish the pool to processes waiting in mem_shm_open
+    __atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+}
+
+// mem_shm_open attaches to a named pool
+struct MemShm* mem_shm_open(const char* name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "mem_shm_open failed, can not open %s.\n", name);
+        return NULL;
+    }
+    return mem_shm_open_fd(fd);
+}
+
+// mem_shm_open_fd attaches to the pool in fd
+struct MemShm* mem_shm_open_fd(int fd)
+{
+    // The creator may still be sizing the object, wait for it briefly
+    struct stat st;
+    bool sized = false;
+    for (int i = 0; i < 1000; i++)
+    {
+        if (fstat(fd, &st) == 0)
+        {
+            sized = true;
+            if (st.st_size >= (off_t)SHM_DATA_START) break;
+        }
+        sched_yield();
+    }
+
+    if (!sized)
+    {
+        fprintf(stderr, "mem_shm_open failed, can not stat the object.\n");
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size < (off_t)SHM_DATA_START)
+    {
+        fprintf(stderr, "mem_shm_open failed, the object does not hold a pool.\n");
+        close(fd);
+        return NULL;
+    }
+
+    struct MemShm* shm = shm_map(fd, st.st_size);
+    if (!shm) return NULL;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        if (__atomic_load_n(&shm->header->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC) return shm;
+        sched_yield();
+    }
+
+    fprintf(stderr, "mem_shm_open failed, the pool was not initialized.\n");
+    mem_shm_close(shm);
+    return NULL;
+}
+
+int mem_shm_fd(struct MemShm* shm)
+{
+    return shm->fd;
+}
+
+// mem_shm_alloc finds the first gap that fits the block and its header
+void* mem_shm_alloc(struct MemShm* shm, size_t size)
+{
+    struct ShmHeader* header = shm->header;
+
+    // Lock the pool
+    shm_lock(shm);
+
+    // Rounding the size and adding the header must not wrap
+    if (size > SIZE_MAX - sizeof(struct ShmBlock) - SHM_ALIGN)
+    {
+        header->counters.alloc_failures++;
+        shm_unlock(shm);
+        return NULL;
+    }
+    size_t needed = sizeof(struct ShmBlock) + shm_round(size);
+
+    // Walk the gaps between the blocks, link points at the next offset of
+    // the block before the gap
+    uint64_t* link = &header->first;
+    uint64_t gap_start = SHM_DATA_START;
+    uint64_t offset = header->first;
+    while (1)
+    {
+        uint64_t gap_end = offset ? offset : header->length;
+        if (needed <= gap_end - gap_start) break;
+
+        if (!offset)
+        {
+            header->counters.alloc_failures++;
+            shm_unlock(shm);
+            return NULL;
+        }
+
+        link = &shm_block(shm, offset)->next;
+        gap_start = shm_block_end(shm, offset);
+        offset = *link;
+    }
+
+    // Fill in the header before linking it, so the list never holds a partial block
+    struct ShmBlock* block = shm_block(shm, gap_start);
+    block->next = offset;
+    block->size = size;
+    __atomic_store_n(link, gap_start, __ATOMIC_RELEASE);
+
+    header->counters.num_allocs++;
+    header->counters.used_bytes += size;
+    if (header->counters.used_bytes > header->counters.peak_used_bytes)
+    {
+        header->counters.peak_used_bytes = header->counters.used_bytes;
+    }
+
+    // Unlock the pool
+    shm_unlock(shm);
+    return block + 1;
+}
+
+// mem_shm_free unlinks the block from the list
+void mem_shm_free(struct MemShm* shm, void* block)
+{
+    if (!block)
+    {
+        fprintf(stderr, "mem_shm_free failed, block ptr is null.\n");
+        return;
+    }
+
+    struct ShmHeader* header = shm->header;
+    uint64_t target = mem_shm_offset(shm, block) - sizeof(struct ShmBlock);
+
+    // Lock the pool
+    shm_lock(shm);
+
+    uint64_t* link = &header->first;
+    while (*link && *link != target)
+    {
+        link = &shm_block(shm, *link)->next;
+    }
+
+    if (!*link)
+    {
+        fprintf(stderr, "mem_shm_free failed, can not find block %p in the pool.\n", block);
+        shm_unlock(shm);
+        return;
+    }
+
+    header->counters.used_bytes -= shm_block(shm, target)->size;
+    header->counters.num_frees++;
+    __atomic_store_n(link, shm_block(shm, target)->next, __ATOMIC_RELEASE);
+
+    // Unlock the pool
+    shm_unlock(shm);
+}
+
+size_t mem_shm_offset(struct MemShm* shm, void* ptr)
+{
+    return (char*)ptr - (char*)shm->header;
+}
+
+void* mem_shm_ptr(struct MemShm* shm, size_t offset)
+{
+    return (char*)shm->header + offset;
+}
+
+// mem_shm_stats fills in the counters and walks the gaps like mem_stats
+void mem_shm_stats(struct MemShm* shm, struct MemStats* stats)
+{
+    if (!stats) return;
+
+    struct ShmHeader* header = shm->header;
+
+    // Lock the pool
+    shm_lock(shm);
+
+    *stats = header->counters;
+    stats->num_blocks = 0;
+    stats->largest_free = 0;
+
+    size_t taken = 0;
+    uint64_t gap_start = SHM_DATA_START;
+    uint64_t offset = header->first;
+    while (1)
+    {
+        uint64_t gap_end = offset ? offset : header->length;
+        if (gap_end - gap_start > stats->largest_free) stats->largest_free = gap_end - gap_start;
+
+        if (!offset) break;
+        stats->num_blocks++;
+        gap_start = shm_block_end(shm, offset);
+        taken += gap_start - offset;
+        offset = shm_block(shm, offset)->next;
+    }
+
+    // Headers and alignment padding count as taken
+    stats->free_bytes = stats->pool_size - taken;
+    stats->fragmentation = stats->free_bytes ?
+        1.0 - (double)stats->largest_free / stats->free_bytes : 0.0;
+
+    // Unlock the pool
+    shm_unlock(shm);
+}
+
+void mem_shm_close(struct MemShm* shm)
+{
+    if (!shm) return;
+    munmap(shm->header, shm->length);
+    close(shm->fd);
+    free(shm);
+}
+
+void mem_shm_unlink(const char* name)
+{
+    shm_unlink(name);
+}
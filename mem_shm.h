@@ -0,0 +1,88 @@
+// mem_shm.h
+#ifndef MEM_SHM_H
+#define MEM_SHM_H
+
+#include "memory_manager.h"
+
+// Helps C++ compilers to handle C header files
+ #ifdef __cplusplus
+ extern "C"
+ {
+ #endif
+
+// A memory pool shared between processes. The block list and the lock live
+// inside the shared mapping and refer to blocks by offset, so every process
+// can allocate, and free blocks that other processes allocated.
+struct MemShm;
+
+   /**
+      * Creates a shared pool. With a name the pool is a POSIX shared memory
+      * object that other processes attach to with mem_shm_open, without one it
+      * is an anonymous memfd that is shared through fork or by passing the
+      * descriptor from mem_shm_fd to mem_shm_open_fd.
+      *
+      * @param name The shared memory object name, e.g. "/my_pool", or NULL.
+      * @param size The number of bytes for blocks, each block also takes a small header.
+      * @return The pool, or NULL if it can not be created or the name exists.
+      */
+     struct MemShm *mem_shm_create(const char *name, size_t size);
+
+     /**
+      * Attaches to a pool created by another process.
+      *
+      * @param name The name given to mem_shm_create.
+      * @return The pool, or NULL if it does not exist.
+      */
+     struct MemShm *mem_shm_open(const char *name);
+
+     /**
+      * Attaches to a pool through a descriptor received from mem_shm_fd.
+      * The pool takes over the descriptor.
+      */
+     struct MemShm *mem_shm_open_fd(int fd);
+
+     /**
+      * Returns the descriptor of the pool, to pass it to another process.
+      */
+     int mem_shm_fd(struct MemShm *shm);
+
+     /**
+      * Allocates a block of at least size bytes, aligned to 16 bytes.
+      *
+      * @return A pointer to the block in this process's mapping, or NULL.
+      */
+     void *mem_shm_alloc(struct MemShm *shm, size_t size);
+
+     /**
+      * Frees a block, which may have been allocated by another process.
+      */
+     void mem_shm_free(struct MemShm *shm, void *block);
+
+     /**
+      * Converts between pointers into this process's mapping and offsets, which
+      * are the same in every process. Blocks are handed to other processes by offset.
+      */
+     size_t mem_shm_offset(struct MemShm *shm, void *ptr);
+     void *mem_shm_ptr(struct MemShm *shm, size_t offset);
+
+     /**
+      * Fills in the counters of the pool, the same ones mem_stats reports.
+      */
+     void mem_shm_stats(struct MemShm *shm, struct MemStats *stats);
+
+     /**
+      * Detaches this process from the pool. The pool lives on until every
+      * process has closed it and, for named pools, the name is unlinked.
+      */
+     void mem_shm_close(struct MemShm *shm);
+
+     /**
+      * Removes the name of a pool, see shm_unlink.
+      */
+     void mem_shm_unlink(const char *name);
+
+ #ifdef __cplusplus
+ }
+ #endif
+
+ #endif // MEM_SHM_H
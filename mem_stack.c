@@ -0,0 +1,107 @@
+// mem_stack.c
+#include "mem_stack.h"
+#include <stdint.h>
+
+// Rounds up to the stack alignment
+#define stack_round(size) (((size) + MEM_STACK_ALIGN - 1) & ~(size_t)(MEM_STACK_ALIGN - 1))
+
+// Header of a block that did not fit in the segment. Only these blocks carry
+// metadata, the chain lets mem_stack_release free them.
+struct StackOverflow
+{
+    struct StackOverflow *prev;  // The overflow block allocated before this one
+};
+
+#define OVERFLOW_HEADER stack_round(sizeof(struct StackOverflow))
+
+// The stack of the calling thread
+static __thread struct
+{
+    void *segment;                    // Block from mem_alloc, NULL without a segment
+    char *top;                        // Next free aligned byte
+    char *end;                        // End of the segment
+    struct StackOverflow *overflow;   // Newest overflow block
+} stack;
+
+// mem_stack_init allocates the segment of the calling thread
+bool mem_stack_init(size_t size)
+{
+    mem_stack_deinit();
+
+    // A size this close to SIZE_MAX would wrap with the alignment slack
+    if (size > SIZE_MAX - MEM_STACK_ALIGN)
+    {
+        fprintf(stderr, "mem_stack_init failed, %zu bytes is too large.\n", size);
+        return false;
+    }
+
+    // mem_alloc does not align, so leave room to align the first block
+    stack.segment = mem_alloc(size + MEM_STACK_ALIGN - 1);
+    if (!stack.segment)
+    {
+        fprintf(stderr, "mem_stack_init failed, can not allocate a segment of %zu bytes.\n", size);
+        return false;
+    }
+
+    stack.top = (char *)stack_round((uintptr_t)stack.segment);
+    stack.end = stack.top + size;
+    return true;
+}
+
+// mem_stack_alloc bumps the top of the segment, or falls back to mem_alloc
+void *mem_stack_alloc(size_t size)
+{
+    // Sizes this close to SIZE_MAX would wrap when rounded or given a header
+    if (size > SIZE_MAX - OVERFLOW_HEADER - MEM_STACK_ALIGN)
+    {
+        fprintf(stderr, "mem_stack_alloc failed, %zu bytes is too large.\n", size);
+        return NULL;
+    }
+    size = stack_round(size);
+
+    // Without a segment every block, zero sizes too, comes from the pool
+    if (stack.top && size <= (size_t)(stack.end - stack.top))
+    {
+        void *block = stack.top;
+        stack.top += size;
+        return block;
+    }
+
+    // The segment is full, take the block from the pool and chain it
+    struct StackOverflow *block = mem_alloc_aligned(OVERFLOW_HEADER + size, MEM_STACK_ALIGN);
+    if (!block) return NULL;
+
+    block->prev = stack.overflow;
+    stack.overflow = block;
+    return (char *)block + OVERFLOW_HEADER;
+}
+
+struct MemStackMark mem_stack_mark()
+{
+    return (struct MemStackMark){stack.top, stack.overflow};
+}
+
+// mem_stack_release moves the top back and frees the newer overflow blocks
+void mem_stack_release(struct MemStackMark mark)
+{
+    while (stack.overflow && stack.overflow != mark.overflow)
+    {
+        struct StackOverflow *prev = stack.overflow->prev;
+        mem_free(stack.overflow);
+        stack.overflow = prev;
+    }
+
+    // A mark taken before the segment existed releases the whole segment
+    stack.top = mark.top ? mark.top : (stack.segment ? (char *)stack_round((uintptr_t)stack.segment) : NULL);
+}
+
+// mem_stack_deinit frees the overflow blocks and the segment
+void mem_stack_deinit()
+{
+    mem_stack_release((struct MemStackMark){NULL, NULL});
+
+    if (stack.segment) mem_free(stack.segment);
+    stack.segment = NULL;
+    stack.top = NULL;
+    stack.end = NULL;
+}
@@ -0,0 +1,66 @@
+// mem_stack.h
+#ifndef MEM_STACK_H
+#define MEM_STACK_H
+
+#include "memory_manager.h"
+
+// Helps C++ compilers to handle C header files
+ #ifdef __cplusplus
+ extern "C"
+ {
+ #endif
+
+// Alignment of the blocks handed out by the stack
+#define MEM_STACK_ALIGN 16
+
+// Position of the calling thread's stack, returned by mem_stack_mark
+struct MemStackMark
+{
+    char *top;       // Top of the segment
+    void *overflow;  // Newest block allocated with mem_alloc after the segment filled up
+};
+
+   /**
+      * Gives the calling thread a stack segment of size bytes from the pool.
+      * Each thread has its own stack, so no locking is needed. Without a
+      * segment every stack allocation falls back to mem_alloc.
+      *
+      * @param size The size of the segment.
+      * @return true on success, false if the pool has no room for it.
+      */
+     bool mem_stack_init(size_t size);
+
+     /**
+      * Allocates a block from the top of the calling thread's stack, aligned to
+      * MEM_STACK_ALIGN. The block lives until the stack is released to a mark
+      * taken before it. When the segment is full, or the thread has none, the
+      * block comes from mem_alloc_aligned. A size of 0 gets a pointer in
+      * either case, not NULL.
+      *
+      * @return A pointer to the block, or NULL if the pool is out of memory
+      *         or size is too large to round up.
+      */
+     void *mem_stack_alloc(size_t size);
+
+     /**
+      * Returns the current top of the calling thread's stack.
+      */
+     struct MemStackMark mem_stack_mark();
+
+     /**
+      * Frees every block allocated since mark was taken, in O(1) unless blocks
+      * overflowed into mem_alloc. Marks must be released in LIFO order.
+      */
+     void mem_stack_release(struct MemStackMark mark);
+
+     /**
+      * Frees all blocks of the calling thread's stack and returns its segment
+      * to the pool. Must be called before mem_deinit.
+      */
+     void mem_stack_deinit();
+
+ #ifdef __cplusplus
+ }
+ #endif
+
+ #endif // MEM_STACK_H
@@ -0,0 +1,86 @@
+// mem_static_pool.h
+#ifndef MEM_STATIC_POOL_H
+#define MEM_STATIC_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Helps C++ compilers to handle C header files
+ #ifdef __cplusplus
+ extern "C"
+ {
+ #endif
+
+// Alignment of the blocks of a static pool
+#define MEM_STATIC_ALIGN 16
+
+// Bytes a block of size takes in a static pool, room for the free list link included
+#define MEM_STATIC_SLOT(size) \
+    ((((size) > sizeof(void *) ? (size) : sizeof(void *)) + MEM_STATIC_ALIGN - 1) / MEM_STATIC_ALIGN * MEM_STATIC_ALIGN)
+
+#ifdef __cplusplus
+#define MEM_STATIC_ALIGNAS alignas(MEM_STATIC_ALIGN)
+#else
+#define MEM_STATIC_ALIGNAS _Alignas(MEM_STATIC_ALIGN)
+#endif
+
+// Pool of equal blocks in static storage, defined with MEM_STATIC_POOL. The
+// blocks above used were never handed out, so a pool in zeroed memory needs
+// no initialization. Freed blocks link each other through their first bytes.
+struct MemStaticPool
+{
+    unsigned char *storage;
+    size_t slot_size;
+    size_t count;
+    size_t used;  // Blocks handed out at least once
+    void *free;   // Freed blocks
+};
+
+/**
+ * Defines name, a pool of count blocks of block_size bytes with static
+ * storage duration, and its storage. Nothing is allocated at run time, not
+ * even from the memory manager, and no call is needed before the first
+ * MEM_STATIC_ALLOC. The pool is not thread safe.
+ */
+#define MEM_STATIC_POOL(name, block_size, count) \
+    MEM_STATIC_ALIGNAS static unsigned char name##_storage[MEM_STATIC_SLOT(block_size) * (count)]; \
+    static struct MemStaticPool name = {name##_storage, MEM_STATIC_SLOT(block_size), (count), 0, NULL}
+
+// Returns a block of the pool, or NULL when all blocks are in use
+#define MEM_STATIC_ALLOC(name) mem_static_alloc(&(name))
+
+// Returns a block from MEM_STATIC_ALLOC to the pool
+#define MEM_STATIC_FREE(name, block) mem_static_free(&(name), (block))
+
+// Tells if block lies in the storage of the pool
+#define MEM_STATIC_OWNS(name, block) mem_static_owns(&(name), (block))
+
+static inline void *mem_static_alloc(struct MemStaticPool *pool)
+{
+    // Reuse the last freed block, else take the next one that was never used
+    void *block = pool->free;
+    if (block)
+    {
+        pool->free = *(void **)block;
+        return block;
+    }
+    return pool->used < pool->count ? pool->storage + pool->used++ * pool->slot_size : NULL;
+}
+
+static inline void mem_static_free(struct MemStaticPool *pool, void *block)
+{
+    *(void **)block = pool->free;
+    pool->free = block;
+}
+
+static inline bool mem_static_owns(const struct MemStaticPool *pool, const void *block)
+{
+    const unsigned char *byte = (const unsigned char *)block;
+    return byte >= pool->storage && byte < pool->storage + pool->slot_size * pool->count;
+}
+
+ #ifdef __cplusplus
+ }
+ #endif
+
+ #endif // MEM_STATIC_POOL_H
@@ -1,271 +1,2367 @@
 // memory_manager.c
 #include "memory_manager.h"
+#include <stdint.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Clears of at least this many bytes bypass the cache with non-temporal stores
+#define ZERO_STREAM_MIN (256 * 1024)
+
+// Lock policy of pools created without one, e.g. -DMEM_LOCK_POLICY=MEM_LOCK_SPIN
+#ifndef MEM_LOCK_POLICY
+#define MEM_LOCK_POLICY MEM_LOCK_MUTEX
+#endif
+
+// Spin iterations before the futex lock goes to sleep, and the longest backoff
+#define LOCK_SPIN_LIMIT 100
+#define LOCK_BACKOFF_MAX 1024
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+// The memory pool, the blocks are kept in the block table, MemPool.next is unused
+struct MemBlock MemPool;
+
+// A live block as 8 bytes of metadata, its offset from the start of the pool
+// and its size. The gaps between the blocks are free.
+struct BlockEntry
+{
+    uint32_t offset;
+    uint32_t size;
+};
+
+// Smallest capacity of the block table
+#define BLOCK_TABLE_MIN 64
+
+// The block table holds the live blocks in address order, protected by mem_lock
+static struct
+{
+    struct BlockEntry* entries;
+    size_t count;
+    size_t capacity;
+    uint8_t* tenants;  // Tenant of each entry, NULL while every block belongs to tenant 0
+} blocks;
+
+// Usage and quotas of the tenants, see mem_tenant_set. A block is charged to
+// the tenant of the thread that put it in the block table and credited when it
+// leaves, so the counters are only written under mem_lock, which the table
+// changes hold anyway. The limits outlive the pool. Protected by mem_lock.
+static struct MemTenantStats tenants[MEM_MAX_TENANTS];
+static bool tenants_tagged;  // A thread has set a tenant other than 0
+static __thread unsigned tenant_current;
+
+// Bytes of the pool under each leaf of the gap index
+#define GAP_LEAF_BYTES 1024
+
+// Free runs of a range of the pool: the free bytes at its start and at its
+// end, and the longest run inside it. A block, even one of size zero, ends a run.
+struct GapNode
+{
+    uint32_t pre;
+    uint32_t suf;
+    uint32_t best;
+};
+
+// Gap index, a segment tree over the pool whose nodes record the free runs of
+// their range. It finds the first gap that fits a request in O(log n) instead
+// of walking the block table, protected by mem_lock.
+static struct
+{
+    struct GapNode* nodes;  // nodes[1] is the root, the leaves start at nodes[leaves]
+    size_t leaves;          // A power of two
+    bool deferred;          // Frees only mark their leaves stale, see mem_maint_start
+    unsigned char* stale;   // One bit per leaf that misses freed space
+    size_t num_stale;
+    size_t cursor;          // Leaf the next flush starts at
+} gap_index;
+
+// Maintenance thread, see mem_maint_start. It works for duty percent of
+// every period, in slices of at most MAINT_BATCH_LEAVES leaves.
+#define MAINT_PERIOD_NS 1000000L
+#define MAINT_BATCH_LEAVES 64
+
+static struct
+{
+    pthread_t thread;
+    bool running;
+    bool stop;
+    unsigned duty;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} maint = {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+// The memory manager lock, word is the spinlock or futex state:
+// 0 unlocked, 1 locked, 2 locked and a thread may be sleeping on the futex
+static struct
+{
+    enum MemLockPolicy policy;
+    pthread_mutex_t mutex;
+    int word;
+} mem_lock = {MEM_LOCK_POLICY, PTHREAD_MUTEX_INITIALIZER, 0};
+
+// Page state of the pool, one bit per page that is set once any byte of the
+// page has been handed out. Clear pages still hold the zeros from mmap.
+static unsigned char* dirty_map;
+static size_t page_size;
+
+// Pages that were free and dirty at the last pass of the background trimmer,
+// a page that is still free at the next pass is returned to the OS
+static unsigned char* idle_map;
+
+// Pages the background trimmer releases per hold of mem_lock
+#define TRIM_BATCH_PAGES 256
+
+// Background trimmer, see MemConfig.trim_decay_ms
+static struct
+{
+    pthread_t thread;
+    bool running;
+    bool stop;
+    unsigned decay_ms;
+    void* cursor;    // Where the next pass continues, NULL to start over
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} trimmer = {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+// Pools mapped from a file with mem_init_file. The file starts with a header
+// page, followed by the pool and two areas for the records of the
+// checkpoints, the header points at the area of the last complete one. The
+// first record of a checkpoint holds the root, the others the blocks.
+#define POOL_FILE_MAGIC 0x4c4f4f504d454d31ULL  // "1MEMPOOL"
+#define POOL_FILE_VERSION 2
+
+struct PoolFileHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t pool_size;
+    uint64_t unused;          // Held the root before version 2
+    uint64_t generation;      // Number of completed checkpoints
+    uint64_t records_offset;  // File offset of the block records of the last checkpoint
+    uint64_t records_count;   // Block records, the root record not counted
+    uint64_t records_sum;     // Checksum of the records, the root record included
+};
+
+// A live block of the pool, as an offset from the start of the pool. The root
+// record has the offset of the root block plus one, 0 for none, and size 0.
+struct PoolFileRecord
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+static struct
+{
+    int fd;                          // -1 for pools that are not backed by a file
+    struct PoolFileHeader* header;   // Start of the mapping, the pool follows it
+    size_t length;                   // Length of the mapping
+    uint64_t root;                   // Root for the next checkpoint, protected by mem_lock
+    uint64_t committed_root;         // Root of the last checkpoint, protected by mem_lock
+} pool_file = {-1, NULL, 0, 0, 0};
+
+// Placement policy of the pool, rover is where next fit continues from and
+// hot where the next MEM_HINT_HOT block goes, offsets into the pool.
+// Protected by mem_lock.
+static struct
+{
+    enum MemPlacement policy;
+    size_t rover;
+    size_t hot;
+} placement;
+
+// Allocation counters, protected by mem_lock
+static struct MemStats mem_counters;
+
+// Changes with every mem_init and mem_deinit, so that thread caches can tell
+// that the blocks they hold belong to a pool that is gone
+static size_t mem_generation;
+
+// Auto-tuned size classes and thread caches, see MemConfig.autotune.
+// Requests up to TUNE_BINS * TUNE_GRANULE bytes are recorded in a histogram
+// and rounded up to a size class, freed blocks of a class are kept in a
+// cache of the freeing thread and handed out again without taking mem_lock.
+#define TUNE_GRANULE 16      // Width of a histogram bin
+#define TUNE_BINS 256        // Number of histogram bins
+#define TUNE_BATCH 256       // Requests a thread records before merging them
+#define TUNE_INTERVAL 4096   // Merged requests between two tunings
+#define CACHE_BUDGET 256     // Blocks a thread cache holds over all classes
+#define CACHE_MAX_DEPTH 64   // Blocks a thread cache holds of one class
+#define CACHE_SLOTS 512      // Entries of the table of block sizes of a thread
+
+static struct
+{
+    bool enabled;
+    size_t generation;                   // Bumped by every tuning, thread caches then flush
+    size_t num_classes;
+    size_t class_size[MEM_MAX_CLASSES];  // Ascending
+    size_t depth[MEM_MAX_CLASSES];       // Thread cache depth of each class
+    uint64_t hist[TUNE_BINS];            // Requests per bin, halved after every tuning
+    uint64_t hist_bytes[TUNE_BINS];      // Bytes requested per bin, halved with hist
+    uint64_t recorded;                   // Requests merged since the last tuning
+    size_t tunings;
+    double waste;                        // Estimated share of bytes lost to rounding
+    size_t epoch;                        // Bumped when a block is released or resized
+    size_t cached_bytes;                 // Atomic, bytes held in the thread caches
+    size_t cache_allocs;                 // Atomic, allocations served by the thread caches
+    size_t cache_frees;                  // Atomic, frees kept in the thread caches
+} mem_tune;
+
+struct ThreadCache
+{
+    size_t pool_generation;   // mem_generation of the pool the blocks belong to
+    size_t tune_generation;   // mem_tune.generation the classes were copied at
+    size_t num_classes;
+    size_t class_size[MEM_MAX_CLASSES];
+    size_t depth[MEM_MAX_CLASSES];
+    size_t count[MEM_MAX_CLASSES];
+    void* blocks[MEM_MAX_CLASSES][CACHE_MAX_DEPTH];
+    uint32_t hist[TUNE_BINS];
+    uint64_t hist_bytes[TUNE_BINS];
+    size_t recorded;
+
+    // Sizes of blocks this thread allocated or freed, so that mem_free can find
+    // the size without the block list. An entry is only trusted while
+    // mem_tune.epoch has not changed, no block changed size since it was made.
+    struct
+    {
+        void* ptr;
+        size_t size;
+        size_t epoch;
+    } sizes[CACHE_SLOTS];
+};
+
+static __thread struct ThreadCache* thread_cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+// Remote-free queue, a bounded lock-free queue of blocks whose mem_free found
+// mem_lock taken. Any thread can push, only the holder of mem_lock pops.
+#define REMOTE_QUEUE_SIZE 1024
+
+struct RemoteCell
+{
+    size_t seq;   // Equals the position when free, position + 1 when it holds a block
+    void* block;
+};
+
+static struct
+{
+    struct RemoteCell cells[REMOTE_QUEUE_SIZE];
+    size_t head;  // Next position to pop, only changed by the lock holder
+    size_t tail;  // Next position to push
+} remote_queue;
+
+// spin_acquire takes the spinlock, waiting threads back off exponentially
+// and yield the cpu once the backoff is at its longest
+static void spin_acquire(int* word)
+{
+    unsigned backoff = 1;
+    while (__atomic_exchange_n(word, 1, __ATOMIC_ACQUIRE))
+    {
+        do
+        {
+            for (unsigned i = 0; i < backoff; i++) cpu_relax();
+            if (backoff < LOCK_BACKOFF_MAX) backoff <<= 1;
+            else sched_yield();
+        } while (__atomic_load_n(word, __ATOMIC_RELAXED));
+    }
+}
+
+// futex_acquire spins with backoff for a short while, then sleeps on the futex
+static void futex_acquire(int* word)
+{
+    unsigned backoff = 1;
+    for (int i = 0; i < LOCK_SPIN_LIMIT; i++)
+    {
+        int c = 0;
+        if (__atomic_compare_exchange_n(word, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+
+        // Other threads are already sleeping, join them
+        if (c == 2) break;
+
+        for (unsigned j = 0; j < backoff; j++) cpu_relax();
+        if (backoff < LOCK_BACKOFF_MAX) backoff <<= 1;
+    }
+
+    while (__atomic_exchange_n(word, 2, __ATOMIC_ACQUIRE) != 0)
+    {
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    }
+}
+
+static void futex_release(int* word)
+{
+    if (__atomic_exchange_n(word, 0, __ATOMIC_RELEASE) == 2)
+    {
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+// mem_lock_acquire takes the memory manager lock with the pool's policy
+static void mem_lock_acquire()
+{
+    switch (mem_lock.policy)
+    {
+    case MEM_LOCK_NONE:
+        break;
+    case MEM_LOCK_SPIN:
+        spin_acquire(&mem_lock.word);
+        break;
+    case MEM_LOCK_FUTEX:
+        futex_acquire(&mem_lock.word);
+        break;
+    default:
+        pthread_mutex_lock(&mem_lock.mutex);
+        break;
+    }
+}
+
+// mem_lock_try takes the memory manager lock if it is free and returns true on success
+static bool mem_lock_try()
+{
+    int c = 0;
+    switch (mem_lock.policy)
+    {
+    case MEM_LOCK_NONE:
+        return true;
+    case MEM_LOCK_SPIN:
+    case MEM_LOCK_FUTEX:
+        return __atomic_compare_exchange_n(&mem_lock.word, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    default:
+        return pthread_mutex_trylock(&mem_lock.mutex) == 0;
+    }
+}
+
+static void mem_lock_release()
+{
+    switch (mem_lock.policy)
+    {
+    case MEM_LOCK_NONE:
+        break;
+    case MEM_LOCK_SPIN:
+        __atomic_store_n(&mem_lock.word, 0, __ATOMIC_RELEASE);
+        break;
+    case MEM_LOCK_FUTEX:
+        futex_release(&mem_lock.word);
+        break;
+    default:
+        pthread_mutex_unlock(&mem_lock.mutex);
+        break;
+    }
+}
+
+// block_print prints information of the block, it is also a mem_walk callback
+static bool block_print(const struct MemBlock *mblock, void *ctx)
+{
+    printf("\nMemBlock: %p\n", (void*)mblock);
+    printf("Ptr: %p\n", mblock->ptr);
+    printf("size: %zu\n", mblock->size);
+    printf("Next: %p\n", (void*)mblock->next);
+    return true;
+}
 
 // block_info prints information of the block
 void block_info(struct MemBlock *mblock)
 {
-    // Lock the mutex   
-    pthread_mutex_lock(&mem_lock);
+    // Lock the pool   
+    mem_lock_acquire();
+
+    block_print(mblock, NULL);
+
+    // Unlock the pool
+    mem_lock_release();
+}
+
+// pool_info prints informations of all block in the pool, from a snapshot
+void pool_info()
+{
+    block_info(&MemPool);
+    mem_walk(block_print, NULL);
+}
+
+// block_init creates a MemBlock in in the memory pool
+// and returns ptr of the created block
+struct MemBlock* block_init(void* ptr, size_t size, void* next)
+{
+    // Validate inputs
+    if (!ptr) {
+        return NULL;
+    }
+
+    // Allocate memory for the block
+    struct MemBlock* block = (struct MemBlock*)malloc(sizeof(struct MemBlock));
+    if (!block) {
+        fprintf(stderr, "block_init failed, can not allocate memory.\n");
+        return NULL;
+    }
+
+    // Initialize the block
+    block->ptr = ptr;
+    block->size = size;
+    block->next = next;
+
+    return block;
+}
+
+// block_search returns the index of the first block at or after ptr,
+// the caller must hold mem_lock
+static size_t block_search(void* ptr)
+{
+    size_t offset = ptr - MemPool.ptr;
+    size_t low = 0, high = blocks.count;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (blocks.entries[mid].offset < offset) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// block_index returns the index of the block starting at ptr, or blocks.count
+// if there is none, the caller must hold mem_lock
+static size_t block_index(void* ptr)
+{
+    if (ptr < MemPool.ptr || ptr > MemPool.ptr + MemPool.size) return blocks.count;
+
+    size_t i = block_search(ptr);
+    if (i < blocks.count && MemPool.ptr + blocks.entries[i].offset == ptr) return i;
+    return blocks.count;
+}
+
+// gap_node_bytes returns the bytes of the pool under node k of the gap index,
+// nodes past the end of the pool cover none
+static size_t gap_node_bytes(size_t k)
+{
+    size_t shift = __builtin_clzl(k) - __builtin_clzl(gap_index.leaves);
+    size_t start = ((k << shift) - gap_index.leaves) * GAP_LEAF_BYTES;
+    size_t end = start + ((size_t)GAP_LEAF_BYTES << shift);
+    if (end > MemPool.size) end = MemPool.size;
+    return end > start ? end - start : 0;
+}
+
+// gap_leaf_walk walks the free runs of a leaf of the gap index. Fills in the
+// runs of the leaf and returns the lowest offset from from on where size free
+// bytes start, or SIZE_MAX. The caller must hold mem_lock.
+static size_t gap_leaf_walk(size_t leaf, size_t size, size_t from, struct GapNode* node)
+{
+    size_t start = leaf * GAP_LEAF_BYTES;
+    size_t end = start + GAP_LEAF_BYTES < MemPool.size ? start + GAP_LEAF_BYTES : MemPool.size;
+    size_t found = SIZE_MAX;
+    *node = (struct GapNode){0, 0, 0};
+    if (start >= end) return found;
+
+    // Start at the block that covers the start of the leaf, if any
+    size_t i = block_search(MemPool.ptr + start);
+    if (i > 0 && blocks.entries[i - 1].offset + blocks.entries[i - 1].size > start) i--;
+
+    size_t pos = start;
+    bool cut = false;
+    for (; i < blocks.count && blocks.entries[i].offset < end; i++)
+    {
+        size_t offset = blocks.entries[i].offset;
+        size_t run = offset > pos ? offset - pos : 0;
+        if (!cut) node->pre = run;
+        if (run > node->best) node->best = run;
+        size_t first = pos > from ? pos : from;
+        if (found == SIZE_MAX && offset > first && offset - first >= size) found = first;
+        cut = true;
+
+        size_t block_end = offset + blocks.entries[i].size;
+        if (block_end > pos) pos = block_end < end ? block_end : end;
+    }
+
+    size_t run = end - pos;
+    if (!cut) node->pre = run;
+    node->suf = run;
+    if (run > node->best) node->best = run;
+    size_t first = pos > from ? pos : from;
+    if (found == SIZE_MAX && end > first && end - first >= size) found = first;
+    return found;
+}
+
+// gap_combine computes the runs of node k from its children
+static void gap_combine(size_t k)
+{
+    struct GapNode* left = &gap_index.nodes[2 * k];
+    struct GapNode* right = &gap_index.nodes[2 * k + 1];
+    size_t left_bytes = gap_node_bytes(2 * k);
+    size_t right_bytes = gap_node_bytes(2 * k + 1);
+
+    // A child is free throughout if its first run spans it
+    struct GapNode* node = &gap_index.nodes[k];
+    node->pre = left->pre == left_bytes ? left_bytes + right->pre : left->pre;
+    node->suf = right->pre == right_bytes ? right_bytes + left->suf : right->suf;
+    node->best = left->best > right->best ? left->best : right->best;
+    if (left->suf + right->pre > node->best) node->best = left->suf + right->pre;
+}
+
+// gap_index_update recomputes the leaves under [offset, offset + size) and
+// their ancestors after a block there changed, the caller must hold mem_lock
+static void gap_index_update(size_t offset, size_t size)
+{
+    if (!gap_index.nodes || offset >= MemPool.size) return;
+
+    size_t first = offset / GAP_LEAF_BYTES;
+    size_t last = (size ? offset + size - 1 : offset) / GAP_LEAF_BYTES;
+    for (size_t leaf = first; leaf <= last; leaf++)
+    {
+        gap_leaf_walk(leaf, SIZE_MAX, 0, &gap_index.nodes[gap_index.leaves + leaf]);
+        if (gap_index.stale[leaf / 8] & (1 << (leaf % 8)))
+        {
+            gap_index.stale[leaf / 8] &= ~(1 << (leaf % 8));
+            gap_index.num_stale--;
+        }
+    }
+
+    for (size_t lo = (gap_index.leaves + first) / 2, hi = (gap_index.leaves + last) / 2; lo > 0; lo /= 2, hi /= 2)
+    {
+        for (size_t k = lo; k <= hi; k++) gap_combine(k);
+    }
+}
+
+// gap_index_freed updates the gap index after the block at [offset, offset +
+// size) was freed. While the maintenance thread runs the leaves are only marked
+// stale, the index then misses the freed space until they are flushed, which
+// makes it pass over some gaps but never offer one that is in use.
+static void gap_index_freed(size_t offset, size_t size)
+{
+    if (!gap_index.deferred || offset >= MemPool.size)
+    {
+        gap_index_update(offset, size);
+        return;
+    }
+
+    size_t last = (size ? offset + size - 1 : offset) / GAP_LEAF_BYTES;
+    for (size_t leaf = offset / GAP_LEAF_BYTES; leaf <= last; leaf++)
+    {
+        if (gap_index.stale[leaf / 8] & (1 << (leaf % 8))) continue;
+        gap_index.stale[leaf / 8] |= 1 << (leaf % 8);
+        gap_index.num_stale++;
+    }
+}
+
+// gap_index_flush recomputes up to limit stale leaves, continuing where the
+// last flush stopped. Returns true if stale leaves remain, the caller must
+// hold mem_lock.
+static bool gap_index_flush(size_t limit)
+{
+    for (size_t scanned = 0; gap_index.num_stale > 0 && limit > 0 && scanned < gap_index.leaves; scanned++)
+    {
+        size_t leaf = gap_index.cursor;
+        gap_index.cursor = (leaf + 1) % gap_index.leaves;
+        if (!(gap_index.stale[leaf / 8] & (1 << (leaf % 8)))) continue;
+
+        gap_index_update(leaf * GAP_LEAF_BYTES, 1);
+        limit--;
+    }
+    return gap_index.num_stale > 0;
+}
+
+// gap_index_build allocates the gap index and computes it from the block
+// table, the caller must hold mem_lock
+static bool gap_index_build()
+{
+    size_t leaves = 1;
+    while (leaves * GAP_LEAF_BYTES < MemPool.size) leaves *= 2;
+
+    free(gap_index.nodes);
+    free(gap_index.stale);
+    gap_index.leaves = leaves;
+    gap_index.nodes = malloc(2 * leaves * sizeof(struct GapNode));
+    gap_index.stale = calloc((leaves + 7) / 8, 1);
+    gap_index.num_stale = 0;
+    gap_index.cursor = 0;
+    gap_index.deferred = false;
+    if (!gap_index.nodes || !gap_index.stale) return false;
+
+    for (size_t leaf = 0; leaf < leaves; leaf++)
+    {
+        gap_leaf_walk(leaf, SIZE_MAX, 0, &gap_index.nodes[leaves + leaf]);
+    }
+    for (size_t k = leaves - 1; k > 0; k--) gap_combine(k);
+    return true;
+}
+
+// gap_node_find finds the lowest offset from from on where size free bytes
+// start in node k, which begins at offset base. Runs that cross the end of the
+// node are left to its ancestors. Returns SIZE_MAX if there is none.
+static size_t gap_node_find(size_t k, size_t base, size_t size, size_t from)
+{
+    struct GapNode* node = &gap_index.nodes[k];
+    size_t bytes = gap_node_bytes(k);
+    if (node->best < size || base + bytes <= from) return SIZE_MAX;
+
+    if (k >= gap_index.leaves)
+    {
+        struct GapNode leaf;
+        return gap_leaf_walk(k - gap_index.leaves, size, from, &leaf);
+    }
+
+    // Left half, then the run across the middle, then the right half. A node
+    // after from has room in its left half whenever its best run says so, so
+    // only the path down to from is ever retraced.
+    size_t found = gap_node_find(2 * k, base, size, from);
+    if (found != SIZE_MAX) return found;
+
+    size_t middle = base + gap_node_bytes(2 * k);
+    size_t start = middle - gap_index.nodes[2 * k].suf;
+    if (start < from) start = from;
+    size_t end = middle + gap_index.nodes[2 * k + 1].pre;
+    if (end > start && end - start >= size) return start;
+
+    return gap_node_find(2 * k + 1, middle, size, from);
+}
+
+// gap_index_find finds the lowest offset from from on where a free run of at
+// least size bytes starts, size must not be zero. The caller must hold mem_lock.
+static bool gap_index_find(size_t size, size_t from, size_t* offset)
+{
+    *offset = gap_node_find(1, 0, size, from);
+    return *offset != SIZE_MAX;
+}
+
+// gap_leaf_last returns the highest offset up to until where a free run of a
+// leaf of the gap index that has size bytes before it ends, or SIZE_MAX. The
+// caller must hold mem_lock.
+static size_t gap_leaf_last(size_t leaf, size_t size, size_t until)
+{
+    size_t start = leaf * GAP_LEAF_BYTES;
+    size_t end = start + GAP_LEAF_BYTES < MemPool.size ? start + GAP_LEAF_BYTES : MemPool.size;
+    if (end > until) end = until;
+    size_t found = SIZE_MAX;
+    if (start >= end) return found;
+
+    size_t i = block_search(MemPool.ptr + start);
+    if (i > 0 && blocks.entries[i - 1].offset + blocks.entries[i - 1].size > start) i--;
+
+    size_t pos = start;
+    for (; i < blocks.count && blocks.entries[i].offset < end; i++)
+    {
+        size_t offset = blocks.entries[i].offset;
+        if (offset > pos && offset - pos >= size) found = offset;
+
+        size_t block_end = offset + blocks.entries[i].size;
+        if (block_end > pos) pos = block_end < end ? block_end : end;
+    }
+    if (end > pos && end - pos >= size) found = end;
+    return found;
+}
+
+// gap_node_last returns the highest offset up to until where size free bytes
+// under node k, which starts at base, end, or SIZE_MAX. The mirror image of
+// gap_node_find.
+static size_t gap_node_last(size_t k, size_t base, size_t size, size_t until)
+{
+    struct GapNode* node = &gap_index.nodes[k];
+    if (node->best < size || base >= until) return SIZE_MAX;
+
+    if (k >= gap_index.leaves) return gap_leaf_last(k - gap_index.leaves, size, until);
+
+    // Right half, then the run across the middle, then the left half
+    size_t middle = base + gap_node_bytes(2 * k);
+    size_t found = gap_node_last(2 * k + 1, middle, size, until);
+    if (found != SIZE_MAX) return found;
+
+    size_t start = middle - gap_index.nodes[2 * k].suf;
+    size_t end = middle + gap_index.nodes[2 * k + 1].pre;
+    if (end > until) end = until;
+    if (end > start && end - start >= size) return end;
+
+    return gap_node_last(2 * k, base, size, until);
+}
+
+// block_find finds the block and returns a copy of it that is valid until the
+// next call from the same thread, or NULL if ptr is not a block of the pool
+struct MemBlock* block_find(void* block)
+{
+    static __thread struct MemBlock found;
+
+    size_t i = block_index(block);
+    if (i == blocks.count)
+    {
+        fprintf(stderr, "block_find failed, can not find block %p in the memory pool.\n", block);
+        return NULL;
+    }
+
+    found = (struct MemBlock){block, blocks.entries[i].size, NULL};
+    return &found;
+}
+
+// tenant_resize sizes the tenant array to capacity entries, the blocks from
+// before it existed belong to tenant 0. The caller must hold mem_lock.
+static bool tenant_resize(size_t capacity)
+{
+    uint8_t* tenants = realloc(blocks.tenants, capacity);
+    if (!tenants)
+    {
+        fprintf(stderr, "block_insert failed, can not grow the tenant table.\n");
+        return false;
+    }
+    if (!blocks.tenants) memset(tenants, 0, capacity);
+    blocks.tenants = tenants;
+    return true;
+}
+
+// block_tenant returns the tenant of block i
+static unsigned block_tenant(size_t i)
+{
+    return blocks.tenants ? blocks.tenants[i] : 0;
+}
+
+// tenant_charge adds bytes and blocks to the usage of a tenant, the caller
+// must hold mem_lock
+static void tenant_charge(unsigned tenant, intptr_t bytes, int count)
+{
+    struct MemTenantStats* t = &tenants[tenant];
+    size_t before = t->used_bytes;
+    t->used_bytes += bytes;
+    t->num_blocks += count;
+    if (t->used_bytes > t->peak_bytes) t->peak_bytes = t->used_bytes;
+    if (t->soft_limit && before <= t->soft_limit && t->used_bytes > t->soft_limit) t->soft_overruns++;
+}
+
+// tenant_admit tells if a tenant may take size more bytes, and counts a refusal.
+// The caller must hold mem_lock.
+static bool tenant_admit(unsigned tenant, size_t size)
+{
+    struct MemTenantStats* t = &tenants[tenant];
+    if (!t->hard_limit || t->used_bytes + size <= t->hard_limit) return true;
+
+    t->hard_failures++;
+    return false;
+}
+
+// block_insert adds a block of tenant at index i of the table, growing it
+// when full, the caller must hold mem_lock
+static bool block_insert(size_t i, void* ptr, size_t size, unsigned tenant)
+{
+    if (blocks.count == blocks.capacity)
+    {
+        size_t capacity = blocks.capacity ? blocks.capacity * 2 : BLOCK_TABLE_MIN;
+        struct BlockEntry* entries = realloc(blocks.entries, capacity * sizeof(*entries));
+        if (!entries)
+        {
+            fprintf(stderr, "block_insert failed, can not grow the block table.\n");
+            return false;
+        }
+        blocks.entries = entries;
+        if (blocks.tenants && !tenant_resize(capacity)) return false;
+        blocks.capacity = capacity;
+    }
+
+    // The tenant of each block is only kept once a tenant other than 0 shows up
+    if (!blocks.tenants && tenant && !tenant_resize(blocks.capacity)) return false;
+
+    memmove(&blocks.entries[i + 1], &blocks.entries[i], (blocks.count - i) * sizeof(*blocks.entries));
+    blocks.entries[i] = (struct BlockEntry){(uint32_t)(ptr - MemPool.ptr), (uint32_t)size};
+    if (blocks.tenants)
+    {
+        memmove(&blocks.tenants[i + 1], &blocks.tenants[i], blocks.count - i);
+        blocks.tenants[i] = tenant;
+    }
+    blocks.count++;
+    tenant_charge(tenant, size, 1);
+    gap_index_update(ptr - MemPool.ptr, size);
+    return true;
+}
+
+// block_remove removes the block at index i, the caller must hold mem_lock
+static void block_remove(size_t i)
+{
+    struct BlockEntry entry = blocks.entries[i];
+    tenant_charge(block_tenant(i), -(intptr_t)entry.size, -1);
+    blocks.count--;
+    memmove(&blocks.entries[i], &blocks.entries[i + 1], (blocks.count - i) * sizeof(*blocks.entries));
+    if (blocks.tenants) memmove(&blocks.tenants[i], &blocks.tenants[i + 1], blocks.count - i);
+    gap_index_freed(entry.offset, entry.size);
+}
+
+// gap_start and gap_end bound the free extent before block i, gap
+// blocks.count is the one at the end of the pool
+static void* gap_start(size_t i)
+{
+    return i ? MemPool.ptr + blocks.entries[i - 1].offset + blocks.entries[i - 1].size : MemPool.ptr;
+}
+
+static void* gap_end(size_t i)
+{
+    return i < blocks.count ? MemPool.ptr + blocks.entries[i].offset : MemPool.ptr + MemPool.size;
+}
+
+// block_release removes the block from the pool, the caller must hold mem_lock
+static void block_release(void* block)
+{
+    // Check if MemPool is empty
+    if (blocks.count == 0) 
+    {
+        fprintf(stderr, "mem_free failed, MemPool is empty.\n");
+        return;
+    }
+    
+    // Check if block exists
+    size_t i = block_index(block);
+    if (i == blocks.count)
+    {
+        fprintf(stderr, "mem_free failed, can not find block %p in the memory pool.\n", block);
+        return;
+    }
+
+    // Update the counters
+    mem_counters.used_bytes -= blocks.entries[i].size;
+    mem_counters.num_frees++;
+    if (mem_tune.enabled) __atomic_add_fetch(&mem_tune.epoch, 1, __ATOMIC_RELEASE);
+    
+    // Remove the block
+    block_remove(i);
+}
+
+// remote_push queues a block for the lock holder to free, it never blocks
+// and returns false when the queue is full
+static bool remote_push(void* block)
+{
+    size_t pos = __atomic_load_n(&remote_queue.tail, __ATOMIC_RELAXED);
+    struct RemoteCell* cell;
+
+    while (1)
+    {
+        cell = &remote_queue.cells[pos % REMOTE_QUEUE_SIZE];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        // The cell is free, try to claim it
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&remote_queue.tail, &pos, pos + 1, true, 
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        // The consumer has not emptied the cell yet
+        else if (diff < 0)
+        {
+            return false;
+        }
+        // Another thread claimed the cell first
+        else
+        {
+            pos = __atomic_load_n(&remote_queue.tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->block = block;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// remote_drain frees the queued blocks in one batch, the caller must hold mem_lock
+static void remote_drain()
+{
+    while (1)
+    {
+        struct RemoteCell* cell = &remote_queue.cells[remote_queue.head % REMOTE_QUEUE_SIZE];
+
+        // Stop at an empty cell or one that is still being written
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != remote_queue.head + 1) break;
+
+        void* block = cell->block;
+        __atomic_store_n(&cell->seq, remote_queue.head + REMOTE_QUEUE_SIZE, __ATOMIC_RELEASE);
+        remote_queue.head++;
+
+        block_release(block);
+        mem_counters.remote_frees++;
+    }
+}
+
+// pool_length rounds the pool size up to whole pages for mmap
+static size_t pool_length(size_t size)
+{
+    size_t length = (size + page_size - 1) / page_size * page_size;
+    return length ? length : page_size;
+}
+
+static size_t page_of(void* ptr)
+{
+    return (size_t)(ptr - MemPool.ptr) / page_size;
+}
+
+static bool page_is_dirty(size_t page)
+{
+    return dirty_map[page / 8] & (1 << (page % 8));
+}
+
+// pages_dirty marks the pages under [ptr, ptr + size) as handed out,
+// the caller must hold mem_lock
+static void pages_dirty(void* ptr, size_t size)
+{
+    if (size == 0) return;
+
+    for (size_t page = page_of(ptr); page <= page_of(ptr + size - 1); page++)
+    {
+        dirty_map[page / 8] |= 1 << (page % 8);
+        idle_map[page / 8] &= ~(1 << (page % 8));
+    }
+}
+
+// trim_pages returns the dirty pages that lie wholly inside the free extent
+// [start, end) to the OS, the caller must hold mem_lock. With aged set only
+// pages that were already idle at the last pass are released, and the other
+// dirty pages are marked idle. Stops after limit pages, returns the number
+// of pages released.
+static size_t trim_pages(void* start, void* end, bool aged, size_t limit)
+{
+    size_t first = (start - MemPool.ptr + page_size - 1) / page_size;
+    size_t last = (end - MemPool.ptr) / page_size;  // One past the last whole page
+    size_t released = 0;
+
+    size_t page = first;
+    while (page < last && released < limit)
+    {
+        // Find a run of pages to release
+        size_t run = page;
+        while (run < last && released + (run - page) < limit && page_is_dirty(run) &&
+               (!aged || (idle_map[run / 8] & (1 << (run % 8)))))
+        {
+            run++;
+        }
+
+        if (run > page)
+        {
+            // Private anonymous pages read as zero afterwards, so they are pristine again
+            madvise(MemPool.ptr + page * page_size, (run - page) * page_size, MADV_DONTNEED);
+            for (size_t i = page; i < run; i++)
+            {
+                dirty_map[i / 8] &= ~(1 << (i % 8));
+                idle_map[i / 8] &= ~(1 << (i % 8));
+            }
+            released += run - page;
+            page = run;
+            continue;
+        }
+
+        // A page that is still in use by nobody is released at the next pass
+        if (aged && page_is_dirty(page)) idle_map[page / 8] |= 1 << (page % 8);
+        page++;
+    }
+
+    mem_counters.trimmed_bytes += released * page_size;
+    return released;
+}
+
+// trim_gaps trims the free extents from the cursor on, the caller must hold
+// mem_lock. Returns the number of pages released and leaves the cursor where
+// the limit was reached, or NULL after the end of the pool.
+static size_t trim_gaps(void** cursor, bool aged, size_t limit)
+{
+    size_t released = 0;
+
+    // Start at the gap that holds the cursor
+    for (size_t i = *cursor ? block_search(*cursor) : 0; i <= blocks.count; i++)
+    {
+        void* start = gap_start(i);
+        void* end = gap_end(i);
+        if (*cursor > start) start = *cursor < end ? *cursor : end;
+
+        // Continue from this gap next time, its released pages are clean by then
+        released += trim_pages(start, end, aged, limit - released);
+        if (released >= limit)
+        {
+            *cursor = start;
+            return released;
+        }
+    }
+
+    *cursor = NULL;
+    return released;
+}
+
+// zero_bytes clears memory, large ranges use non-temporal stores so that
+// clearing them does not evict the rest of the cache
+static void zero_bytes(void* ptr, size_t size)
+{
+#ifdef __SSE2__
+    if (size >= ZERO_STREAM_MIN)
+    {
+        // Clear up to the first 16 byte boundary, then stream whole vectors
+        size_t head = -(uintptr_t)ptr & 15;
+        memset(ptr, 0, head);
+        ptr += head;
+        size -= head;
+
+        __m128i zero = _mm_setzero_si128();
+        __m128i* vec = ptr;
+        for (size_t i = 0; i < size / 16; i++) _mm_stream_si128(vec + i, zero);
+        _mm_sfence();
+
+        ptr += size & ~(size_t)15;
+        size &= 15;
+    }
+#endif
+    memset(ptr, 0, size);
+}
+
+// records_sum is the FNV-1a hash of the block records
+static uint64_t records_sum(const struct PoolFileRecord* records, size_t count)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const unsigned char* bytes = (const unsigned char*)records;
+    for (size_t i = 0; i < count * sizeof(*records); i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// file_map maps the pool file at path, creating or reinitializing it when it
+// does not hold a pool. Sets restored when the file holds a checkpointed pool.
+// Returns the start of the pool or NULL on failure.
+static void* file_map(const char* path, size_t size, bool* restored)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        fprintf(stderr, "mem_init failed, can not open %s.\n", path);
+        return NULL;
+    }
+
+    struct PoolFileHeader header;
+    *restored = pread(fd, &header, sizeof(header), 0) == sizeof(header) && 
+                header.magic == POOL_FILE_MAGIC && header.generation > 0;
+
+    if (*restored && (header.version != POOL_FILE_VERSION || header.page_size != page_size ||
+                      header.pool_size != size))
+    {
+        fprintf(stderr, "mem_init failed, %s holds a pool of %llu bytes that does not match.\n", 
+                path, (unsigned long long)header.pool_size);
+        close(fd);
+        return NULL;
+    }
+
+    size_t length = page_size + pool_length(size);
+
+    // A file cut short of its pool would be read past its end, it starts over
+    struct stat st;
+    if (*restored && (fstat(fd, &st) != 0 || st.st_size < (off_t)length))
+    {
+        fprintf(stderr, "mem_init: %s is shorter than its pool, the pool starts empty.\n", path);
+        *restored = false;
+    }
+
+    // A new pool starts from zero pages, so empty the file before sizing it
+    if (!*restored && (ftruncate(fd, 0) != 0 || ftruncate(fd, length) != 0))
+    {
+        fprintf(stderr, "mem_init failed, can not resize %s.\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        fprintf(stderr, "mem_init failed, can not map %s.\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    pool_file.fd = fd;
+    pool_file.header = base;
+    pool_file.length = length;
+    pool_file.root = 0;
+    pool_file.committed_root = 0;
+
+    if (!*restored)
+    {
+        *pool_file.header = (struct PoolFileHeader){
+            .magic = POOL_FILE_MAGIC,
+            .version = POOL_FILE_VERSION,
+            .page_size = page_size,
+            .pool_size = size,
+        };
+    }
+
+    return base + page_size;
+}
+
+static void file_unmap()
+{
+    munmap(pool_file.header, pool_file.length);
+    close(pool_file.fd);
+    pool_file.fd = -1;
+    pool_file.header = NULL;
+    pool_file.length = 0;
+}
+
+// file_records reads the records of the last checkpoint and checks them
+// against the file and the pool. Returns NULL when they are damaged or can
+// not be read, and sets *missing when there was no memory for them.
+static struct PoolFileRecord* file_records(bool* missing)
+{
+    struct PoolFileHeader* header = pool_file.header;
+    *missing = false;
+
+    // The records lie within the file, which bounds their count
+    struct stat st;
+    if (fstat(pool_file.fd, &st) != 0 || header->records_offset > (uint64_t)st.st_size ||
+        header->records_count >= ((uint64_t)st.st_size - header->records_offset) / sizeof(struct PoolFileRecord))
+    {
+        return NULL;
+    }
+
+    size_t bytes = (header->records_count + 1) * sizeof(struct PoolFileRecord);
+    struct PoolFileRecord* records = malloc(bytes);
+    if (!records)
+    {
+        *missing = true;
+        return NULL;
+    }
+
+    bool valid = pread(pool_file.fd, records, bytes, header->records_offset) == (ssize_t)bytes &&
+                 records_sum(records, header->records_count + 1) == header->records_sum &&
+                 records[0].offset <= MemPool.size;
+
+    // The blocks follow each other in the pool without overlapping
+    uint64_t end = 0;
+    for (size_t i = 1; valid && i <= header->records_count; i++)
+    {
+        valid = records[i].offset >= end && records[i].offset <= MemPool.size &&
+                records[i].size <= MemPool.size - records[i].offset;
+        end = records[i].offset + records[i].size;
+    }
+
+    if (!valid)
+    {
+        free(records);
+        return NULL;
+    }
+    return records;
+}
+
+// file_restore rebuilds the block list from the records of the last checkpoint,
+// a damaged checkpoint leaves the pool empty. Returns false when the block list
+// can not be allocated. The caller must hold mem_lock.
+static bool file_restore()
+{
+    struct PoolFileHeader* header = pool_file.header;
+    bool missing;
+    struct PoolFileRecord* records = file_records(&missing);
+    if (!records)
+    {
+        if (missing) return false;
+        fprintf(stderr, "mem_init: the checkpoint in the pool file is damaged, the pool starts empty.\n");
+        return true;
+    }
+    pool_file.root = records[0].offset;
+    pool_file.committed_root = records[0].offset;
+
+    bool ok = true;
+    // The records keep no tenant, the restored blocks belong to tenant 0
+    for (size_t i = 0; ok && i < header->records_count; i++)
+    {
+        ok = block_insert(i, MemPool.ptr + records[i + 1].offset, records[i + 1].size, 0);
+        mem_counters.used_bytes += records[i + 1].size;
+    }
+    mem_counters.peak_used_bytes = mem_counters.used_bytes;
+    mem_counters.peak_blocks = blocks.count;
+
+    free(records);
+    return ok;
+}
+
+// file_checkpoint writes the block list of a file pool and syncs the pool,
+// the caller must hold mem_lock
+static bool file_checkpoint()
+{
+    struct PoolFileHeader* header = pool_file.header;
+
+    size_t count = blocks.count;
+    struct PoolFileRecord* records = malloc((count + 1) * sizeof(*records));
+    if (!records) return false;
+
+    // The root goes with the blocks, so it commits with them
+    records[0] = (struct PoolFileRecord){pool_file.root, 0};
+    for (size_t i = 0; i < count; i++)
+    {
+        records[i + 1].offset = blocks.entries[i].offset;
+        records[i + 1].size = blocks.entries[i].size;
+    }
+
+    // Write the records to the area the last checkpoint does not use, so a
+    // crash before the header is updated leaves the last checkpoint intact
+    size_t bytes = (count + 1) * sizeof(*records);
+    size_t area = pool_file.length;
+    if (header->generation > 0 && area + bytes > header->records_offset)
+    {
+        area = header->records_offset + (header->records_count + 1) * sizeof(*records);
+        area = (area + page_size - 1) / page_size * page_size;
+    }
+
+    bool ok = pwrite(pool_file.fd, records, bytes, area) == (ssize_t)bytes &&
+              msync(MemPool.ptr, pool_length(MemPool.size), MS_SYNC) == 0 &&
+              fdatasync(pool_file.fd) == 0;
+
+    // Commit the checkpoint by pointing the header at the new records
+    if (ok)
+    {
+        header->records_offset = area;
+        header->records_count = count;
+        header->records_sum = records_sum(records, count + 1);
+        header->generation++;
+        ok = msync(header, page_size, MS_SYNC) == 0;
+    }
+    if (ok) pool_file.committed_root = records[0].offset;
+
+    if (!ok) fprintf(stderr, "mem_checkpoint failed, can not write the pool file.\n");
+    free(records);
+    return ok;
+}
+
+// pool_release frees the blocks and unmaps the pool without checkpointing,
+// the caller must hold mem_lock
+static void pool_release()
+{
+    // Free the block table, its entries point into the pool
+    free(blocks.entries);
+    blocks.entries = NULL;
+    blocks.count = 0;
+    blocks.capacity = 0;
+    free(blocks.tenants);
+    blocks.tenants = NULL;
+    free(gap_index.nodes);
+    gap_index.nodes = NULL;
+    free(gap_index.stale);
+    gap_index.stale = NULL;
+
+    free(idle_map);
+    idle_map = NULL;
+
+    // Free the pool
+    if (pool_file.fd >= 0) file_unmap();
+    else if (MemPool.ptr) munmap(MemPool.ptr, pool_length(MemPool.size));
+    free(dirty_map);
+    dirty_map = NULL;
+    MemPool.ptr = NULL;
+    MemPool.size = 0;
+    MemPool.next = NULL;
+}
+
+// mem_account updates the counters after an allocation attempt
+// and returns the result, the caller must hold mem_lock
+static void* mem_account(void* result, size_t size)
+{
+    if (!result)
+    {
+        mem_counters.alloc_failures++;
+        return NULL;
+    }
+
+    mem_counters.num_allocs++;
+    mem_counters.used_bytes += size;
+    if (blocks.count > mem_counters.peak_blocks) mem_counters.peak_blocks = blocks.count;
+    if (mem_counters.used_bytes > mem_counters.peak_used_bytes)
+    {
+        mem_counters.peak_used_bytes = mem_counters.used_bytes;
+    }
+
+    return result;
+}
+
+// tune_classes derives the size classes from the histogram, the caller must
+// hold mem_lock. The classes are upper edges of histogram bins, chosen by
+// dynamic programming so that rounding the recorded requests up to their
+// class wastes the fewest bytes. The thread cache depths follow the share of
+// the requests each class serves.
+static void tune_classes()
+{
+    // The bins that saw requests, with their upper edges
+    double upper[TUNE_BINS], count[TUNE_BINS], requested[TUNE_BINS];
+    size_t m = 0;
+    for (size_t b = 0; b < TUNE_BINS; b++)
+    {
+        if (!mem_tune.hist[b]) continue;
+        upper[m] = (b + 1) * TUNE_GRANULE;
+        count[m] = mem_tune.hist[b];
+        requested[m] = mem_tune.hist_bytes[b];
+        m++;
+    }
+    if (m == 0) return;
+
+    // Prefix sums of counts and requested bytes, the waste of serving bins
+    // i..j with the upper edge of bin j is upper[j] * counts - bytes
+    double counts[TUNE_BINS + 1] = {0}, bytes[TUNE_BINS + 1] = {0};
+    for (size_t i = 0; i < m; i++)
+    {
+        counts[i + 1] = counts[i] + count[i];
+        bytes[i + 1] = bytes[i] + requested[i];
+    }
+
+    // cost[k][j] is the least waste of serving bins 0..j with k + 1 classes,
+    // start[k][j] the first bin of the last class of that solution
+    size_t k_max = m < MEM_MAX_CLASSES ? m : MEM_MAX_CLASSES;
+    static double cost[MEM_MAX_CLASSES][TUNE_BINS];
+    static size_t start[MEM_MAX_CLASSES][TUNE_BINS];
+    for (size_t j = 0; j < m; j++)
+    {
+        cost[0][j] = upper[j] * counts[j + 1] - bytes[j + 1];
+        start[0][j] = 0;
+    }
+    for (size_t k = 1; k < k_max; k++)
+    {
+        for (size_t j = k; j < m; j++)
+        {
+            cost[k][j] = -1;
+            for (size_t i = k; i <= j; i++)
+            {
+                double c = cost[k - 1][i - 1] + upper[j] * (counts[j + 1] - counts[i]) - (bytes[j + 1] - bytes[i]);
+                if (cost[k][j] < 0 || c < cost[k][j])
+                {
+                    cost[k][j] = c;
+                    start[k][j] = i;
+                }
+            }
+        }
+    }
+
+    // Walk the solution back from the last bin
+    size_t n = k_max;
+    size_t j = m - 1;
+    for (size_t k = n; k-- > 0;)
+    {
+        size_t i = start[k][j];
+        mem_tune.class_size[k] = (size_t)upper[j];
+        double share = (counts[j + 1] - counts[i]) / counts[m];
+        size_t depth = (size_t)(share * CACHE_BUDGET);
+        mem_tune.depth[k] = depth < 1 ? 1 : depth > CACHE_MAX_DEPTH ? CACHE_MAX_DEPTH : depth;
+        if (i > 0) j = i - 1;
+    }
+
+    mem_tune.num_classes = n;
+    mem_tune.waste = cost[n - 1][m - 1] / (cost[n - 1][m - 1] + bytes[m]);
+    mem_tune.tunings++;
+
+    // Older requests count for less at the next tuning
+    for (size_t b = 0; b < TUNE_BINS; b++)
+    {
+        mem_tune.hist[b] /= 2;
+        mem_tune.hist_bytes[b] /= 2;
+    }
+    mem_tune.recorded = 0;
+
+    __atomic_add_fetch(&mem_tune.generation, 1, __ATOMIC_RELEASE);
+}
+
+// cache_flush returns the blocks of a thread cache to the pool, the caller
+// must hold mem_lock
+static void cache_flush(struct ThreadCache* cache)
+{
+    for (size_t c = 0; c < cache->num_classes; c++)
+    {
+        while (cache->count[c] > 0)
+        {
+            block_release(cache->blocks[c][--cache->count[c]]);
+            mem_counters.num_frees--;  // The caller's free was counted when the block was cached
+            __atomic_sub_fetch(&mem_tune.cached_bytes, cache->class_size[c], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// cache_exit flushes the cache of a thread that exits
+static void cache_exit(void* arg)
+{
+    struct ThreadCache* cache = arg;
+
+    // Lock the pool
+    mem_lock_acquire();
+    if (cache->pool_generation == mem_generation) cache_flush(cache);
+    mem_lock_release();
+
+    free(cache);
+}
+
+static void cache_key_create()
+{
+    pthread_key_create(&cache_key, cache_exit);
+}
+
+// cache_get returns the cache of the calling thread, brought up to date with
+// the pool and the current size classes
+static struct ThreadCache* cache_get()
+{
+    struct ThreadCache* cache = thread_cache;
+    size_t generation = __atomic_load_n(&mem_generation, __ATOMIC_ACQUIRE);
+
+    if (!cache)
+    {
+        cache = calloc(1, sizeof(struct ThreadCache));
+        if (!cache) return NULL;
+        cache->tune_generation = (size_t)-1;
+        cache->pool_generation = generation;
+        thread_cache = cache;
+        pthread_setspecific(cache_key, cache);
+    }
+
+    // The pool was created again, the blocks of the cache are gone
+    if (cache->pool_generation != generation)
+    {
+        memset(cache->count, 0, sizeof(cache->count));
+        memset(cache->hist, 0, sizeof(cache->hist));
+        memset(cache->hist_bytes, 0, sizeof(cache->hist_bytes));
+        memset(cache->sizes, 0, sizeof(cache->sizes));
+        cache->recorded = 0;
+        cache->tune_generation = (size_t)-1;
+        cache->pool_generation = generation;
+    }
+
+    // The classes changed, return the blocks of the old classes and copy the new ones
+    if (cache->tune_generation != __atomic_load_n(&mem_tune.generation, __ATOMIC_ACQUIRE))
+    {
+        // Lock the pool
+        mem_lock_acquire();
+        cache_flush(cache);
+        cache->num_classes = mem_tune.num_classes;
+        memcpy(cache->class_size, mem_tune.class_size, sizeof(cache->class_size));
+        memcpy(cache->depth, mem_tune.depth, sizeof(cache->depth));
+        cache->tune_generation = mem_tune.generation;
+        mem_lock_release();
+    }
+
+    return cache;
+}
+
+// cache_class returns the smallest class that fits size, or -1
+static int cache_class(struct ThreadCache* cache, size_t size)
+{
+    for (size_t c = 0; c < cache->num_classes; c++)
+    {
+        if (size <= cache->class_size[c]) return c;
+    }
+    return -1;
+}
+
+// cache_remember records the size of a block the thread handed out
+static void cache_remember(struct ThreadCache* cache, void* block, size_t size)
+{
+    size_t slot = ((uintptr_t)block >> 4) % CACHE_SLOTS;
+    cache->sizes[slot].ptr = block;
+    cache->sizes[slot].size = size;
+    cache->sizes[slot].epoch = __atomic_load_n(&mem_tune.epoch, __ATOMIC_ACQUIRE);
+}
+
+// cache_record counts a request in the histogram of the thread, and merges
+// it into the pool's histogram once TUNE_BATCH requests were recorded
+static void cache_record(struct ThreadCache* cache, size_t size)
+{
+    if (size > TUNE_BINS * TUNE_GRANULE) return;
+
+    cache->hist[(size - 1) / TUNE_GRANULE]++;
+    cache->hist_bytes[(size - 1) / TUNE_GRANULE] += size;
+    if (++cache->recorded < TUNE_BATCH) return;
+
+    // Lock the pool
+    mem_lock_acquire();
+    for (size_t b = 0; b < TUNE_BINS; b++)
+    {
+        mem_tune.hist[b] += cache->hist[b];
+        mem_tune.hist_bytes[b] += cache->hist_bytes[b];
+    }
+    mem_tune.recorded += cache->recorded;
+    if (mem_tune.recorded >= TUNE_INTERVAL) tune_classes();
+    mem_lock_release();
+
+    memset(cache->hist, 0, sizeof(cache->hist));
+    memset(cache->hist_bytes, 0, sizeof(cache->hist_bytes));
+    cache->recorded = 0;
+}
+
+// cache_push keeps a block of the given size in the thread cache if its class
+// has room, and returns true if it did
+static bool cache_push(struct ThreadCache* cache, void* block, size_t size)
+{
+    int c = cache_class(cache, size);
+    if (c < 0 || cache->class_size[c] != size || cache->count[c] >= cache->depth[c]) return false;
+
+    cache->blocks[c][cache->count[c]++] = block;
+    __atomic_add_fetch(&mem_tune.cached_bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mem_tune.cache_frees, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// cache_free keeps a block in the thread cache without taking mem_lock when
+// the thread knows its size, and returns true if it did
+static bool cache_free(struct ThreadCache* cache, void* block)
+{
+    size_t slot = ((uintptr_t)block >> 4) % CACHE_SLOTS;
+    if (cache->sizes[slot].ptr != block || 
+        cache->sizes[slot].epoch != __atomic_load_n(&mem_tune.epoch, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+    return cache_push(cache, block, cache->sizes[slot].size);
+}
+
+// cache_take looks the block up in the block list and keeps it in the thread
+// cache if it is of a class size, the caller must hold mem_lock
+static bool cache_take(struct ThreadCache* cache, void* block)
+{
+    if (cache->num_classes == 0) return false;
+
+    size_t i = block_index(block);
+    if (i == blocks.count || block_tenant(i) != tenant_current) return false;
+    if (!cache_push(cache, block, blocks.entries[i].size)) return false;
+    cache_remember(cache, block, blocks.entries[i].size);
+    return true;
+}
+
+// trimmer_run releases the pages that stayed free for a whole decay period,
+// in batches so that allocations never wait long for mem_lock
+static void* trimmer_run(void* arg)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&trimmer.mutex);
+    while (!trimmer.stop)
+    {
+        // The next pass is a decay period after the end of the last one, however long it took
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += trimmer.decay_ms / 1000;
+        deadline.tv_nsec += (trimmer.decay_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&trimmer.cond, &trimmer.mutex, &deadline);
+        if (trimmer.stop) break;
+        pthread_mutex_unlock(&trimmer.mutex);
+
+        // One pass over the pool, giving the lock up between batches
+        do
+        {
+            mem_lock_acquire();
+            trim_gaps(&trimmer.cursor, true, TRIM_BATCH_PAGES);
+            mem_lock_release();
+            if (trimmer.cursor) sched_yield();
+        } while (trimmer.cursor);
+
+        pthread_mutex_lock(&trimmer.mutex);
+    }
+    pthread_mutex_unlock(&trimmer.mutex);
+    return NULL;
+}
+
+static void trimmer_start(unsigned decay_ms)
+{
+    // Without a lock the trimmer would race with the allocating thread
+    if (mem_lock.policy == MEM_LOCK_NONE || pool_file.fd >= 0)
+    {
+        fprintf(stderr, "mem_init: the background trimmer needs a locked, anonymous pool.\n");
+        return;
+    }
+
+    trimmer.decay_ms = decay_ms;
+    trimmer.stop = false;
+    trimmer.cursor = NULL;
+    trimmer.running = pthread_create(&trimmer.thread, NULL, trimmer_run, NULL) == 0;
+}
+
+static void trimmer_stop()
+{
+    if (!trimmer.running) return;
+
+    pthread_mutex_lock(&trimmer.mutex);
+    trimmer.stop = true;
+    pthread_cond_signal(&trimmer.cond);
+    pthread_mutex_unlock(&trimmer.mutex);
+
+    pthread_join(trimmer.thread, NULL);
+    trimmer.running = false;
+}
+
+// maint_run drains the remote-free queue and flushes the stale leaves of the
+// gap index, for duty percent of every period
+static void* maint_run(void* arg)
+{
+    pthread_mutex_lock(&maint.mutex);
+    while (!maint.stop)
+    {
+        long budget = MAINT_PERIOD_NS / 100 * maint.duty;
+        pthread_mutex_unlock(&maint.mutex);
+
+        // Slices until the share of the period is used up or the work is done
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long worked = 0;
+        bool more = true;
+        while (more && worked < budget)
+        {
+            mem_lock_acquire();
+            remote_drain();
+            more = gap_index_flush(MAINT_BATCH_LEAVES);
+            mem_counters.maint_slices++;
+            mem_lock_release();
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            worked = (now.tv_sec - start.tv_sec) * 1000000000L + now.tv_nsec - start.tv_nsec;
+        }
+
+        // Rest for the remainder of the period, a full period when idle
+        long rest = more ? MAINT_PERIOD_NS - worked : MAINT_PERIOD_NS;
+        pthread_mutex_lock(&maint.mutex);
+        if (rest > 0 && !maint.stop)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += rest;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&maint.cond, &maint.mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&maint.mutex);
+    return NULL;
+}
+
+// mem_maint_start starts the maintenance thread and defers the index upkeep of frees to it
+bool mem_maint_start(unsigned duty)
+{
+    // Without a lock the thread would race with the allocating thread
+    if (maint.running || !MemPool.ptr || mem_lock.policy == MEM_LOCK_NONE)
+    {
+        fprintf(stderr, "mem_maint_start failed, it needs a locked pool without a maintenance thread.\n");
+        return false;
+    }
+
+    mem_maint_set_duty(duty);
+    maint.stop = false;
+    maint.running = pthread_create(&maint.thread, NULL, maint_run, NULL) == 0;
+    if (!maint.running) return false;
+
+    // Lock the pool
+    mem_lock_acquire();
+    gap_index.deferred = true;
+    mem_lock_release();
+    return true;
+}
+
+// mem_maint_set_duty changes the share of time the maintenance thread works
+void mem_maint_set_duty(unsigned duty)
+{
+    pthread_mutex_lock(&maint.mutex);
+    maint.duty = duty < 1 ? 1 : duty > 100 ? 100 : duty;
+    pthread_cond_signal(&maint.cond);
+    pthread_mutex_unlock(&maint.mutex);
+}
+
+// mem_maint_stop stops the maintenance thread and brings the gap index up to date
+void mem_maint_stop()
+{
+    if (!maint.running) return;
+
+    pthread_mutex_lock(&maint.mutex);
+    maint.stop = true;
+    pthread_cond_signal(&maint.cond);
+    pthread_mutex_unlock(&maint.mutex);
+
+    pthread_join(maint.thread, NULL);
+    maint.running = false;
+
+    // Lock the pool
+    mem_lock_acquire();
+    gap_index.deferred = false;
+    if (MemPool.ptr) gap_index_flush(SIZE_MAX);
+    mem_lock_release();
+}
+
+// mem_tenant_set makes the calling thread allocate for tenant
+bool mem_tenant_set(unsigned tenant)
+{
+    if (tenant >= MEM_MAX_TENANTS)
+    {
+        fprintf(stderr, "mem_tenant_set failed, tenant %u is not below %d.\n", tenant, MEM_MAX_TENANTS);
+        return false;
+    }
+    if (tenant == tenant_current) return true;
+
+    // The blocks in the thread cache are charged to the old tenant, return them
+    struct ThreadCache* cache = thread_cache;
+    mem_lock_acquire();
+    if (cache && cache->pool_generation == mem_generation)
+    {
+        cache_flush(cache);
+        memset(cache->sizes, 0, sizeof(cache->sizes));
+    }
+    if (tenant) __atomic_store_n(&tenants_tagged, true, __ATOMIC_RELAXED);
+    mem_lock_release();
+
+    tenant_current = tenant;
+    return true;
+}
+
+// mem_tenant_get returns the tenant the calling thread allocates for
+unsigned mem_tenant_get()
+{
+    return tenant_current;
+}
+
+// mem_tenant_quota sets the soft and hard byte limits of a tenant
+bool mem_tenant_quota(unsigned tenant, size_t soft_limit, size_t hard_limit)
+{
+    if (tenant >= MEM_MAX_TENANTS)
+    {
+        fprintf(stderr, "mem_tenant_quota failed, tenant %u is not below %d.\n", tenant, MEM_MAX_TENANTS);
+        return false;
+    }
+
+    // Lock the pool
+    mem_lock_acquire();
+    tenants[tenant].soft_limit = soft_limit;
+    tenants[tenant].hard_limit = hard_limit;
+    mem_lock_release();
+    return true;
+}
+
+// mem_tenant_stats fills in the usage and limits of a tenant
+bool mem_tenant_stats(unsigned tenant, struct MemTenantStats* stats)
+{
+    if (!stats || tenant >= MEM_MAX_TENANTS) return false;
+
+    // Lock the pool
+    mem_lock_acquire();
+    remote_drain();
+    *stats = tenants[tenant];
+    mem_lock_release();
+    return true;
+}
+
+// mem_trim returns the free pages of the pool to the OS right away
+size_t mem_trim()
+{
+    // Lock the pool
+    mem_lock_acquire();
+    remote_drain();
+
+    // Pages of a file pool are backed by the file, there is nothing to return
+    void* cursor = NULL;
+    size_t released = pool_file.fd < 0 && MemPool.ptr ? trim_gaps(&cursor, false, SIZE_MAX) : 0;
+
+    // Unlock the pool
+    mem_lock_release();
+    return released * page_size;
+}
+
+// mem_init initializes memory pool
+void mem_init(size_t size)
+{
+    mem_init_config(&(struct MemConfig){.size = size});
+}
+
+// mem_init_config initializes memory pool with the given configuration
+void mem_init_config(const struct MemConfig* config)
+{
+    size_t size = config->size;
+
+    // Block offsets and sizes are stored in 32 bits
+    if (size > MEM_POOL_MAX_SIZE)
+    {
+        fprintf(stderr, "mem_init failed, a pool can hold at most %zu bytes.\n", (size_t)MEM_POOL_MAX_SIZE);
+        return;
+    }
+
+    // The threads of a previous pool must not work on the new one
+    trimmer_stop();
+    mem_maint_stop();
+
+    // The pool is not in use yet, so the policy can change before locking
+    mem_lock.policy = config->lock_policy != MEM_LOCK_DEFAULT ? config->lock_policy : MEM_LOCK_POLICY;
+    mem_lock.word = 0;
+
+    // Lock the pool
+    mem_lock_acquire();
+
+    // A pool that was not deinitialized is released first, as mem_deinit would
+    if (MemPool.ptr) remote_drain();
+    if (pool_file.fd >= 0) file_checkpoint();
+    pool_release();
+    
+    // Map the pool, fresh anonymous pages are zero until first touched
+    page_size = sysconf(_SC_PAGESIZE);
+    bool restored = false;
+    void* ptr = config->path ? file_map(config->path, size, &restored) :
+        mmap(NULL, pool_length(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) ptr = NULL;
+
+    size_t pages = pool_length(size) / page_size;
+    dirty_map = ptr ? calloc((pages + 7) / 8, 1) : NULL;
+    idle_map = ptr ? calloc((pages + 7) / 8, 1) : NULL;
+
+    // Initialize MemPool, the gap index starts out as one free run
+    MemPool.ptr = ptr;
+    MemPool.size = size;
+    MemPool.next = NULL;
+    if (!dirty_map || !idle_map || !gap_index_build()) 
+    {
+        fprintf(stderr, "mem_init failed, can not allocate memory.\n");
+        pool_release();
+        mem_lock_release();
+        return;
+    }
+
+    // Reset the counters, the tenants keep their limits
+    memset(&mem_counters, 0, sizeof(mem_counters));
+    for (unsigned t = 0; t < MEM_MAX_TENANTS; t++)
+    {
+        tenants[t] = (struct MemTenantStats){.soft_limit = tenants[t].soft_limit, .hard_limit = tenants[t].hard_limit};
+    }
+    placement.policy = config->placement;
+    placement.rover = 0;
+    placement.hot = MemPool.size / 2;
+
+    // Reset the size classes, the thread caches see the new generation
+    memset(&mem_tune, 0, sizeof(mem_tune));
+    mem_tune.enabled = config->autotune;
+    if (mem_tune.enabled) pthread_once(&cache_key_once, cache_key_create);
+    __atomic_add_fetch(&mem_generation, 1, __ATOMIC_RELEASE);
+
+    // Reset the remote-free queue
+    remote_queue.head = 0;
+    remote_queue.tail = 0;
+    for (size_t i = 0; i < REMOTE_QUEUE_SIZE; i++)
+    {
+        remote_queue.cells[i].seq = i;
+    }
+
+    // Pick up the blocks of a reopened pool file, its pages hold old data
+    if (restored)
+    {
+        memset(dirty_map, 0xFF, (pages + 7) / 8);
+        if (!file_restore()) pool_release();
+    }
+
+    // Unlock the pool
+    mem_lock_release();
+
+    if (MemPool.ptr && config->trim_decay_ms > 0) trimmer_start(config->trim_decay_ms);
+}
+
+// mem_init_file initializes a memory pool backed by the file at path
+bool mem_init_file(const char* path, size_t size)
+{
+    mem_init_config(&(struct MemConfig){.size = size, .path = path});
+    return MemPool.ptr != NULL;
+}
+
+// mem_checkpoint makes the blocks and contents of a file pool durable
+bool mem_checkpoint()
+{
+    // Lock the pool
+    mem_lock_acquire();
+    remote_drain();
+
+    bool ok = pool_file.fd >= 0 && file_checkpoint();
+
+    // Unlock the pool
+    mem_lock_release();
+    return ok;
+}
 
-    printf("\nMemBlock: %p\n", mblock);
-    printf("Ptr: %p\n", mblock->ptr);
-    printf("size: %zu\n", mblock->size);
-    printf("Next: %p\n", mblock->next);
+// mem_root returns the root of the last checkpoint, or NULL
+void* mem_root()
+{
+    // Lock the pool
+    mem_lock_acquire();
+    void* root = pool_file.fd >= 0 && pool_file.committed_root ? MemPool.ptr + pool_file.committed_root - 1 : NULL;
+    mem_lock_release();
+    return root;
+}
 
-    // Unlock the mutex
-    pthread_mutex_unlock(&mem_lock);
+// mem_set_root records the block a reopened pool starts from, it is written
+// with the records of the next checkpoint
+void mem_set_root(void* block)
+{
+    // Lock the pool
+    mem_lock_acquire();
+    if (pool_file.fd >= 0) pool_file.root = block ? (uint64_t)(block - MemPool.ptr) + 1 : 0;
+    mem_lock_release();
 }
 
-// pool_info prints informations of all block in the pool
-void pool_info()
+size_t mem_offset(void* ptr)
 {
-    struct MemBlock* mblock = &MemPool;
-    
-    while(mblock != NULL)
-    {
-        block_info(mblock);
-        mblock = mblock->next;
-    }
+    return ptr - MemPool.ptr;
 }
 
-// block_init creates a MemBlock in in the memory pool
-// and returns ptr of the created block
-struct MemBlock* block_init(void* ptr, size_t size, void* next)
+void* mem_ptr(size_t offset)
 {
-    // Validate inputs
-    if (!ptr) {
-        return NULL;
-    }
+    return MemPool.ptr + offset;
+}
 
-    // Allocate memory for the block
-    struct MemBlock* block = (struct MemBlock*)malloc(sizeof(struct MemBlock));
-    if (!block) {
-        fprintf(stderr, "block_init failed, can not allocate memory.\n");
-        return NULL;
-    }
+// gap_fit returns where a block of size aligned to align starts in gap i, or
+// NULL if it does not fit, the caller must hold mem_lock
+static void* gap_fit(size_t i, size_t size, size_t align)
+{
+    void* end = gap_end(i);
+    void* start = (void*)(((uintptr_t)gap_start(i) + align - 1) & ~(uintptr_t)(align - 1));
 
-    // Initialize the block
-    block->ptr = ptr;
-    block->size = size;
-    block->next = next;
+    // An empty gap before the first block is not used, even for zero sizes
+    bool usable = i > 0 || blocks.count == 0 || end != MemPool.ptr;
 
-    return block;
+    return usable && start <= end && size <= (size_t)(end - start) ? start : NULL;
 }
 
-// block_find finds the block and returns ptr of the previous block
-struct MemBlock* block_find(void* block)
+// gap_first finds the first gap from offset from on that fits a block, sets
+// the gap and the start of the block and returns true if there is one. The
+// caller must hold mem_lock.
+static bool gap_first(size_t size, size_t align, size_t from, size_t* gap, void** start)
 {
-    // Defind the block
-    struct MemBlock* prevBlock = &MemPool;
+    // The gap index skips the gaps that are too small, zero sizes fit the
+    // first usable gap and need no search
+    size_t i = 0;
+    size_t last = blocks.count;
+    bool bounded = false;
+    size_t offset;
+    if (size > 0)
+    {
+        if (!gap_index_find(size, from, &offset)) return false;
+        i = block_search(MemPool.ptr + offset + 1);
+    }
 
-    // Find the block
-    while (prevBlock->next != NULL)
+    // Walk the gaps from there: before the first block, between blocks and at the end
+    for (; i <= last; i++)
     {
-        if (prevBlock->next->ptr == block)
+        *start = gap_fit(i, size, align);
+        if (*start)
         {
-            return prevBlock;
+            *gap = i;
+            return true;
+        }
+
+        // Aligning took too much of the first gap, the walk stops at the
+        // first gap that fits size at any alignment
+        if (size > 0 && !bounded)
+        {
+            bounded = true;
+            if (align - 1 <= MemPool.size - size && gap_index_find(size + align - 1, from, &offset))
+            {
+                last = block_search(MemPool.ptr + offset + 1);
+            }
         }
-    
-        // Continue to the next block
-        prevBlock = prevBlock->next;
     }
 
-    fprintf(stderr, "block_find failed, can not find block %p in the memory pool.\n", block);
-    return prevBlock;
-};
+    return false;
+}
 
-// mem_init initializes memory pool
-void mem_init(size_t size)
+// gap_best finds the smallest, or with worst set the largest, gap that fits
+// a block, like gap_first. Walks all gaps, except for a worst fit the largest
+// gap is taken from the gap index when the alignment leaves room in it.
+static bool gap_best(size_t size, size_t align, bool worst, size_t* gap, void** start)
 {
-    // Lock the mutex
-    pthread_mutex_lock(&mem_lock);
-    
-    // Allocate space in the memory
-    void* ptr = malloc(size);
-    if (!ptr) 
+    size_t offset;
+    if (worst && size > 0 && gap_index_find(gap_index.nodes[1].best, 0, &offset))
     {
-        fprintf(stderr, "mem_init failed, can not allocate memory.\n");
-        pthread_mutex_unlock(&mem_lock);
-        return;
+        size_t i = block_search(MemPool.ptr + offset + 1);
+        *start = gap_fit(i, size, align);
+        if (*start)
+        {
+            *gap = i;
+            return true;
+        }
     }
 
-    // Initialize MemPool
-    MemPool.ptr = ptr;
-    MemPool.size = size;
-    MemPool.next = NULL;
+    bool found = false;
+    size_t found_length = 0;
+    for (size_t i = 0; i <= blocks.count; i++)
+    {
+        size_t length = gap_end(i) - gap_start(i);
+        if (length < size || (found && (worst ? length <= found_length : length >= found_length))) continue;
+
+        void* fit = gap_fit(i, size, align);
+        if (!fit) continue;
+
+        *gap = i;
+        *start = fit;
+        found = true;
+        found_length = length;
+
+        // Nothing fits better than an exact fit
+        if (!worst && length == size) break;
+    }
 
-    // Unlock the mutex
-    pthread_mutex_unlock(&mem_lock);
+    return found;
 }
 
-// mem_alloc allocates space in the memory pool
-void* mem_alloc(size_t size)
+// gap_at sets the gap and the start of a block at offset, where size bytes
+// are free, and returns true
+static bool gap_at(size_t offset, size_t* gap, void** start)
+{
+    *gap = block_search(MemPool.ptr + offset + 1);
+    *start = MemPool.ptr + offset;
+    return true;
+}
+
+// block_place finds the gap the hint or else the placement policy puts a
+// block in and where the block starts, the caller must hold mem_lock. Hinted
+// blocks are byte aligned.
+static bool block_place(size_t size, size_t align, unsigned hint, size_t* gap, void** start)
 {
-    // Lock the mutex
-    pthread_mutex_lock(&mem_lock);
+    size_t offset;
+    if (size > 0 && (hint & MEM_HINT_HOT))
+    {
+        // Hot blocks pack after each other from the middle of the pool, wrapping around
+        return (gap_index_find(size, placement.hot, &offset) || gap_index_find(size, 0, &offset)) &&
+               gap_at(offset, gap, start);
+    }
+    if (size > 0 && (hint & (MEM_HINT_SHORT | MEM_HINT_LONG)) == MEM_HINT_SHORT)
+    {
+        // Short-lived blocks go to the top of the highest free run
+        offset = gap_node_last(1, 0, size, MemPool.size);
+        return offset != SIZE_MAX && gap_at(offset - size, gap, start);
+    }
+    if ((hint & (MEM_HINT_SHORT | MEM_HINT_LONG)) == MEM_HINT_LONG)
+    {
+        // Long-lived blocks go to the bottom of the lowest
+        return gap_first(size, align, 0, gap, start);
+    }
+
+    switch (size > 0 ? placement.policy : MEM_FIT_FIRST)
+    {
+    case MEM_FIT_NEXT:
+    {
+        // Continue from the gap that holds the rover, or follows the block it is in
+        size_t from = placement.rover < MemPool.size ?
+            (size_t)(gap_start(block_search(MemPool.ptr + placement.rover)) - MemPool.ptr) : 0;
+        return gap_first(size, align, from, gap, start) ||
+               (from > 0 && gap_first(size, align, 0, gap, start));
+    }
+    case MEM_FIT_BEST:
+    case MEM_FIT_WORST:
+        return gap_best(size, align, placement.policy == MEM_FIT_WORST, gap, start);
+    default:
+        return gap_first(size, align, 0, gap, start);
+    }
+}
 
+// block_alloc places a block of size for tenant at an address aligned to align
+// in a gap chosen by the hint or the placement policy, the caller must hold
+// mem_lock
+static void* block_alloc(size_t size, size_t align, unsigned hint, unsigned tenant)
+{
     // Check if size of MemBlock is greater than 0
     // if (size <= 0)
     // {
     //     fprintf(stderr, "mem_alloc error: Too small, block size is %zu\n", size);
-    //     pthread_mutex_unlock(&mem_lock);
     //     return NULL;
     // }
 
     // Check if enough space in the Memory pool
-    if (size > MemPool.size) 
+    if (size > MemPool.size)
     {
         fprintf(stderr, "mem_alloc error: Too large, block size is %zu\n", size);
-        pthread_mutex_unlock(&mem_lock);
+        return mem_account(NULL, size);
+    }
+
+    // A tenant over its hard limit gets nothing, however much room the pool has
+    if (!tenant_admit(tenant, size)) return mem_account(NULL, size);
+
+    size_t gap = 0;
+    void* start = NULL;
+
+    // Freed space the gap index has not seen yet may be what is missing
+    bool found = block_place(size, align, hint, &gap, &start) ||
+                 (gap_index.num_stale > 0 && !gap_index_flush(SIZE_MAX) && block_place(size, align, hint, &gap, &start));
+
+    if (!found || !block_insert(gap, start, size, tenant)) return mem_account(NULL, size);
+
+    if (hint & MEM_HINT_HOT) placement.hot = start + size - MemPool.ptr;
+    else if (hint == MEM_HINT_NONE) placement.rover = start + size - MemPool.ptr;
+    return mem_account(start, size);
+}
+
+// mem_alloc allocates space in the memory pool
+void* mem_alloc(size_t size)
+{
+    // With size classes, serve the request from the thread cache if it can
+    struct ThreadCache* cache = mem_tune.enabled && size > 0 ? cache_get() : NULL;
+    if (cache)
+    {
+        cache_record(cache, size);
+        int c = cache_class(cache, size);
+        if (c >= 0)
+        {
+            size = cache->class_size[c];
+            if (cache->count[c] > 0)
+            {
+                void* block = cache->blocks[c][--cache->count[c]];
+                __atomic_sub_fetch(&mem_tune.cached_bytes, size, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&mem_tune.cache_allocs, 1, __ATOMIC_RELAXED);
+                cache_remember(cache, block, size);
+                return block;
+            }
+        }
+    }
+
+    // Lock the pool
+    mem_lock_acquire();
+
+    // Free the blocks other threads left in the remote-free queue
+    remote_drain();
+
+    void* result = block_alloc(size, 1, MEM_HINT_NONE, tenant_current);
+    if (result) pages_dirty(result, size);
+
+    // Unlock the pool
+    mem_lock_release();
+
+    if (cache && result) cache_remember(cache, result, size);
+    return result;
+}
+
+// mem_alloc_hint allocates space in the region of the pool that suits the
+// expected lifetime and temperature of the block
+void* mem_alloc_hint(size_t size, unsigned hint)
+{
+    // Lock the pool
+    mem_lock_acquire();
+    remote_drain();
+
+    void* result = block_alloc(size, 1, hint, tenant_current);
+    if (result) pages_dirty(result, size);
+
+    // Unlock the pool
+    mem_lock_release();
+    return result;
+}
+
+// mem_alloc_aligned allocates space at an address that is a multiple of align
+void* mem_alloc_aligned(size_t size, size_t align)
+{
+    if (align == 0 || (align & (align - 1)))
+    {
+        fprintf(stderr, "mem_alloc_aligned error: alignment %zu is not a power of two\n", align);
         return NULL;
     }
 
-    void* result = NULL;
+    // Lock the pool
+    mem_lock_acquire();
+    remote_drain();
+
+    void* result = block_alloc(size, align, MEM_HINT_NONE, tenant_current);
+    if (result) pages_dirty(result, size);
+
+    // Unlock the pool
+    mem_lock_release();
+    return result;
+}
 
-    // Check if Memory pool is empty
-    if (MemPool.next == NULL) 
+// mem_calloc allocates a zeroed array, only the pages that have been
+// handed out before are cleared, pristine pages are still zero from mmap
+void* mem_calloc(size_t num, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(num, size, &total))
     {
-        MemPool.next = block_init(MemPool.ptr, size, NULL);
-        if (MemPool.next) result = MemPool.next->ptr;
-        pthread_mutex_unlock(&mem_lock);
-        return result;
+        fprintf(stderr, "mem_calloc error: %zu * %zu overflows\n", num, size);
+        return NULL;
     }
 
-    // Check if it's space before the first block
-    if (MemPool.next->ptr != MemPool.ptr && 
-        (MemPool.ptr + size) <= MemPool.next->ptr)     
+    // Lock the pool
+    mem_lock_acquire();
+    remote_drain();
+
+    void* result = block_alloc(total, 1, MEM_HINT_NONE, tenant_current);
+
+    // An empty block has no bytes to clear, and may sit at the end of the pool
+    if (!result || total == 0)
     {
-        struct MemBlock *new_block = block_init(MemPool.ptr, size, MemPool.next);
-        if (new_block) 
-        {
-            MemPool.next = new_block;
-            result = new_block->ptr;
-        }
-        pthread_mutex_unlock(&mem_lock);
+        mem_lock_release();
         return result;
     }
 
-    // Check for space between blocks
-    struct MemBlock* current = MemPool.next;
-    while (current->next != NULL) 
+    // Find the dirty span before marking the block, pristine pages
+    // inside the span are cleared as well
+    size_t first = page_of(result);
+    size_t last = page_of(result + total - 1);
+    while (first <= last && !page_is_dirty(first)) first++;
+    while (last > first && !page_is_dirty(last)) last--;
+
+    void* start = NULL;
+    void* end = NULL;
+    if (first <= last && total)
     {
-        void* gap_start = current->ptr + current->size;
-        void* gap_end = current->next->ptr;
-        
-        if ((gap_start + size) <= gap_end) 
-        {
-            struct MemBlock *new_block = block_init(gap_start, size, current->next);
-            if (new_block) 
-            {
-                current->next = new_block;
-                result = new_block->ptr;
-            }
-            pthread_mutex_unlock(&mem_lock);
-            return result;
-        }
-        current = current->next;
+        start = MemPool.ptr + first * page_size;
+        end = MemPool.ptr + (last + 1) * page_size;
+        if (start < result) start = result;
+        if (end > result + total) end = result + total;
     }
+    pages_dirty(result, total);
+    mem_counters.calloc_skipped += total - (end - start);
+
+    // Unlock the pool, the block is ours so it can be cleared without the lock
+    mem_lock_release();
+
+    if (start) zero_bytes(start, end - start);
+    return result;
+}
 
-    // Check if it's enough space at the end
-    void* end_ptr = current->ptr + current->size;
-    if ((end_ptr + size) <= (MemPool.ptr + MemPool.size)) 
+// pool_free frees the block under the lock, or leaves it in the remote-free
+// queue when the lock is taken. With a cache it is kept there if its size
+// in the block list is a class size.
+static void pool_free(void* block, struct ThreadCache* cache)
+{
+    // If another thread holds the lock, leave the block to it instead of waiting
+    if (!mem_lock_try())
     {
-        struct MemBlock *new_block = block_init(end_ptr, size, NULL);
-        if (new_block) 
-        {
-            current->next = new_block;
-            result = new_block->ptr;
-        }
+        if (remote_push(block)) return;
+
+        // The queue is full, wait for the lock
+        mem_lock_acquire();
     }
 
-    pthread_mutex_unlock(&mem_lock);
-    return result;
+    if (!cache || !cache_take(cache, block)) block_release(block);
+
+    // Unlock the pool
+    mem_lock_release();
 }
 
 // Free the allocated space in the memory pool
 void mem_free(void* block)
 {
-    // Lock the mutex
-    pthread_mutex_lock(&mem_lock);
-
     // Check if block ptr is null
     if (!block) 
     {
         fprintf(stderr, "mem_free failed, block ptr is null.\n");
-        pthread_mutex_unlock(&mem_lock);
         return;
     }
 
-    // Check if MemPool is empty
-    if (!MemPool.next) 
-    {
-        fprintf(stderr, "mem_free failed, MemPool is empty.\n");
-        pthread_mutex_unlock(&mem_lock);
-        return;
-    }
-    
-    // Defind the previous block to the block
-    struct MemBlock* prevBlock = block_find(block);
+    // With size classes, keep the block in the thread cache if it can
+    struct ThreadCache* cache = mem_tune.enabled ? cache_get() : NULL;
+    if (cache && cache_free(cache, block)) return;
 
-    // Check if block exists
-    if (!prevBlock->next) return;
-    
-    // Remove the block
-    struct MemBlock *temp = prevBlock->next->next;
-    free(prevBlock->next);
-    if (!prevBlock->next) 
+    pool_free(block, cache);
+}
+
+#ifdef MEM_DEBUG
+// sized_check tells if block is a block of the pool of at least size bytes
+static bool sized_check(const char* caller, void* block, size_t size)
+{
+    // Lock the pool
+    mem_lock_acquire();
+    remote_drain();
+
+    size_t i = block_index(block);
+    bool valid = i < blocks.count && size <= blocks.entries[i].size;
+    if (!valid)
     {
-        fprintf(stderr, "mem_free failed, free the block %p failed.\n", block);
+        fprintf(stderr, "%s failed, block %p does not hold %zu bytes.\n", caller, block, size);
     }
-    prevBlock->next = temp;
 
-    // Unlock the mutex
-    pthread_mutex_unlock(&mem_lock);
+    // Unlock the pool
+    mem_lock_release();
+    return valid;
 }
+#endif
 
-// mem_resize resizes the block size and returns the new ptr
-void* mem_resize(void* block, size_t size)
+// mem_free_sized frees a block of a size known to the caller
+void mem_free_sized(void* block, size_t size)
 {
-    if (!block || size == 0) 
+    if (!block) 
     {
-        fprintf(stderr, "mem_resize failed, block ptr is null or size is 0.\n");
-        return NULL;
+        fprintf(stderr, "mem_free_sized failed, block ptr is null.\n");
+        return;
+    }
+
+#ifdef MEM_DEBUG
+    if (!sized_check("mem_free_sized", block, size)) return;
+#endif
+
+    // A block of a class size goes to its class, the block is at least that large
+    struct ThreadCache* cache = mem_tune.enabled ? cache_get() : NULL;
+    if (cache && (cache_free(cache, block) || 
+                  (!__atomic_load_n(&tenants_tagged, __ATOMIC_RELAXED) && cache_push(cache, block, size))))
+    {
+        return;
     }
 
-    // Lock the mutex
-    pthread_mutex_lock(&mem_lock);
+    // The tenant of the block is not known, only the block list can tell if the cache may keep it
+    pool_free(block, __atomic_load_n(&tenants_tagged, __ATOMIC_RELAXED) ? cache : NULL);
+}
+
+// block_resize resizes the block and moves it when it can not grow in place,
+// copying at most keep bytes
+static void* block_resize(void* block, size_t size, size_t keep)
+{
+    // Lock the pool
+    mem_lock_acquire();
+    remote_drain();
 
     // Find the block
-    struct MemBlock* prevBlock = block_find(block);
-    if (!prevBlock || !prevBlock->next) 
+    size_t i = block_index(block);
+    if (i == blocks.count) 
     {
-        pthread_mutex_unlock(&mem_lock);
+        mem_lock_release();
         fprintf(stderr, "mem_resize failed, cannot find the block to resize\n");
         return NULL;
     }
 
-    struct MemBlock* current = prevBlock->next;
+    struct BlockEntry* current = &blocks.entries[i];
     size_t old_size = current->size;
 
     // If new size is smaller, just update the size
     if (size <= old_size) {
         current->size = size;
-        pthread_mutex_unlock(&mem_lock);
+        tenant_charge(block_tenant(i), -(intptr_t)(old_size - size), 0);
+        gap_index_freed(current->offset, old_size);
+        mem_counters.used_bytes -= old_size - size;
+        if (mem_tune.enabled) __atomic_add_fetch(&mem_tune.epoch, 1, __ATOMIC_RELEASE);
+        mem_lock_release();
         return block;
     }
 
     // Try to expand in place if possible
-    if (current->next && 
-        (current->ptr + size) <= current->next->ptr) {
+    if (i + 1 < blocks.count && 
+        current->offset + size <= blocks.entries[i + 1].offset &&
+        tenant_admit(block_tenant(i), size - old_size)) {
         current->size = size;
-        pthread_mutex_unlock(&mem_lock);
-        fprintf(stderr, "mem_resize failed, can not allocate a new block.\n");
+        tenant_charge(block_tenant(i), size - old_size, 0);
+        gap_index_update(current->offset, size);
+        pages_dirty(block + old_size, size - old_size);
+        if (mem_tune.enabled) __atomic_add_fetch(&mem_tune.epoch, 1, __ATOMIC_RELEASE);
+        mem_counters.used_bytes += size - old_size;
+        if (mem_counters.used_bytes > mem_counters.peak_used_bytes)
+        {
+            mem_counters.peak_used_bytes = mem_counters.used_bytes;
+        }
+        mem_lock_release();
         return block;
     }
 
-    // Need to allocate new block and copy data
-    pthread_mutex_unlock(&mem_lock);
-    void* new_block = mem_alloc(size);
+    // Need to allocate new block and copy data. A block of another tenant
+    // moves within that tenant, past the thread cache of the calling one.
+    unsigned owner = block_tenant(i);
+    void* new_block = NULL;
+    if (owner != tenant_current)
+    {
+        new_block = block_alloc(size, 1, MEM_HINT_NONE, owner);
+        if (new_block) pages_dirty(new_block, size);
+    }
+    mem_lock_release();
+    if (owner == tenant_current) new_block = mem_alloc(size);
     if (!new_block) 
     {
         fprintf(stderr, "mem_resize failed, can not allocate a new block.\n");
@@ -273,7 +2369,7 @@ void* mem_resize(void* block, size_t size)
     }
 
     // Copy the data
-    memcpy(new_block, block, old_size);
+    memcpy(new_block, block, old_size < keep ? old_size : keep);
     
     // Free the old block
     mem_free(block);
@@ -281,24 +2377,256 @@ void* mem_resize(void* block, size_t size)
     return new_block;
 }
 
+// mem_resize resizes the block size and returns the new ptr
+void* mem_resize(void* block, size_t size)
+{
+    if (!block || size == 0) 
+    {
+        fprintf(stderr, "mem_resize failed, block ptr is null or size is 0.\n");
+        return NULL;
+    }
+
+    return block_resize(block, size, SIZE_MAX);
+}
+
+// mem_resize_sized resizes a block of a size known to the caller
+void* mem_resize_sized(void* block, size_t old_size, size_t size)
+{
+    if (!block || size == 0) 
+    {
+        fprintf(stderr, "mem_resize_sized failed, block ptr is null or size is 0.\n");
+        return NULL;
+    }
+
+#ifdef MEM_DEBUG
+    if (!sized_check("mem_resize_sized", block, old_size)) return NULL;
+#endif
+
+    // Only the bytes the caller had are copied when the block moves
+    return block_resize(block, size, old_size);
+}
+
 // mem_deinit frees all memory of the pool
 void mem_deinit()
 {
-    // Lock the mutex
-    pthread_mutex_lock(&mem_lock);
+    trimmer_stop();
+    mem_maint_stop();
+
+    // Lock the pool
+    mem_lock_acquire();
+    remote_drain();
+
+    // A file pool is checkpointed so it can be reopened
+    if (pool_file.fd >= 0) file_checkpoint();
+
+    pool_release();
+    __atomic_add_fetch(&mem_generation, 1, __ATOMIC_RELEASE);
+
+    // Unlock the pool
+    mem_lock_release();
+}
+
+// mem_stats fills in the counters and walks the pool for the free extents
+void mem_stats(struct MemStats *stats)
+{
+    if (!stats) return;
+
+    // Lock the pool
+    mem_lock_acquire();
+    remote_drain();
 
-    // Free all mblock
-    struct MemBlock* mblock = MemPool.next;
-    while(mblock != NULL)
+    *stats = mem_counters;
+    stats->pool_size = MemPool.size;
+    stats->num_blocks = blocks.count;
+    stats->metadata_bytes = blocks.capacity * sizeof(struct BlockEntry) + (blocks.tenants ? blocks.capacity : 0);
+    for (unsigned t = 0; t < MEM_MAX_TENANTS; t++)
     {
-        struct MemBlock* next = mblock->next;
-        free(mblock->ptr);
-        mblock = next;
+        stats->tenant_bytes[t] = tenants[t].used_bytes;
     }
+    if (MemPool.ptr) gap_index_flush(SIZE_MAX);
+    stats->largest_free = MemPool.ptr ? gap_index.nodes[1].best : 0;
 
-    // Free the pool
-    free(MemPool.ptr);
+    // Blocks in the thread caches are not handed out to callers
+    stats->used_bytes -= __atomic_load_n(&mem_tune.cached_bytes, __ATOMIC_RELAXED);
+    stats->cached_bytes = __atomic_load_n(&mem_tune.cached_bytes, __ATOMIC_RELAXED);
+    stats->cache_hits = __atomic_load_n(&mem_tune.cache_allocs, __ATOMIC_RELAXED);
+    stats->num_allocs += stats->cache_hits;
+    stats->num_frees += __atomic_load_n(&mem_tune.cache_frees, __ATOMIC_RELAXED);
+    stats->tunings = mem_tune.tunings;
+    stats->num_classes = mem_tune.num_classes;
+    memcpy(stats->class_sizes, mem_tune.class_size, sizeof(stats->class_sizes));
+    memcpy(stats->cache_depths, mem_tune.depth, sizeof(stats->cache_depths));
+    stats->class_waste = mem_tune.waste;
+
+    // Pages touched since they were mapped or trimmed
+    stats->dirty_bytes = 0;
+    for (size_t page = 0; MemPool.ptr && page < pool_length(MemPool.size) / page_size; page++)
+    {
+        if (page_is_dirty(page)) stats->dirty_bytes += page_size;
+    }
+
+    stats->free_bytes = MemPool.size - stats->used_bytes;
+    stats->fragmentation = stats->free_bytes ? 
+        1.0 - (double)stats->largest_free / stats->free_bytes : 0.0;
+
+    // Unlock the pool
+    mem_lock_release();
+}
+
+// mem_map spreads the blocks over the cells and collects the free extents
+bool mem_map(struct MemMap *map, size_t cells)
+{
+    if (!map) return false;
+    if (cells == 0) cells = 256;
+    if (cells > MEM_MAP_MAX_CELLS) cells = MEM_MAP_MAX_CELLS;
+
+    // Bytes in use per cell, turned into percentages at the end
+    size_t cell_used[MEM_MAP_MAX_CELLS] = {0};
+
+    // Lock the pool
+    mem_lock_acquire();
+    remote_drain();
+
+    if (!MemPool.ptr || MemPool.size == 0)
+    {
+        mem_lock_release();
+        return false;
+    }
+
+    memset(map, 0, sizeof(*map));
+    map->pool_size = MemPool.size;
+    map->cell_bytes = (MemPool.size + cells - 1) / cells;
+    map->num_cells = (MemPool.size + map->cell_bytes - 1) / map->cell_bytes;
+
+    // Walk the blocks and the gaps between them, including the one at the end
+    for (size_t i = 0; i <= blocks.count; i++)
+    {
+        size_t gap = gap_end(i) - gap_start(i);
+        if (gap > 0)
+        {
+            int bucket = MEM_MAP_BUCKETS - 1 - __builtin_clzl(gap);
+            map->extent_counts[bucket]++;
+            map->num_extents++;
+            map->free_bytes += gap;
+            if (gap > map->largest_free) map->largest_free = gap;
+        }
+
+        if (i == blocks.count) break;
+
+        // Add the bytes of the block to each cell it overlaps
+        size_t start = blocks.entries[i].offset;
+        size_t end = start + blocks.entries[i].size;
+        while (start < end)
+        {
+            size_t cell = start / map->cell_bytes;
+            size_t cell_end = (cell + 1) * map->cell_bytes;
+            size_t part = (end < cell_end ? end : cell_end) - start;
+            cell_used[cell] += part;
+            start += part;
+        }
+
+        map->used_bytes += blocks.entries[i].size;
+    }
+
+    // Unlock the pool
+    mem_lock_release();
+
+    for (size_t cell = 0; cell < map->num_cells; cell++)
+    {
+        size_t cell_size = cell + 1 < map->num_cells ? map->cell_bytes : map->pool_size - cell * map->cell_bytes;
+        map->fill[cell] = (cell_used[cell] * 100 + cell_size - 1) / cell_size;
+    }
+
+    map->fragmentation = map->free_bytes ?
+        1.0 - (double)map->largest_free / map->free_bytes : 0.0;
+    return true;
+}
+
+// mem_walk copies the block table under the lock and calls fn for the blocks of
+// the copy without it
+size_t mem_walk(MemWalkFn fn, void *ctx)
+{
+    if (!fn) return 0;
+
+    // The copy is allocated outside the lock, retry if the table grew meanwhile
+    struct BlockEntry *copy = NULL;
+    size_t room = 0;
+    for (;;)
+    {
+        // Lock the pool
+        mem_lock_acquire();
+        remote_drain();
+        if (blocks.count <= room) break;
+
+        room = blocks.count + blocks.count / 4 + 16;
+        mem_lock_release();
+        free(copy);
+        copy = malloc(room * sizeof(*copy));
+        if (!copy) return 0;
+    }
+
+    size_t count = blocks.count;
+    char *base = MemPool.ptr;
+    if (count) memcpy(copy, blocks.entries, count * sizeof(*copy));
+
+    // Unlock the pool
+    mem_lock_release();
+
+    size_t visited = 0;
+    while (visited < count)
+    {
+        struct MemBlock mblock = {base + copy[visited].offset, copy[visited].size, NULL};
+        visited++;
+        if (!fn(&mblock, ctx)) break;
+    }
+
+    free(copy);
+    return visited;
+}
 
-    // Unlock the mutex
-    pthread_mutex_unlock(&mem_lock);
+// mem_map_print writes the map as a heatmap of 64 cells per line, or as JSON
+void mem_map_print(const struct MemMap *map, FILE *out, bool json)
+{
+    static const char shades[] = " .:-=+*#%@";
+
+    if (json)
+    {
+        fprintf(out, "{\"pool_size\": %zu, \"cell_bytes\": %zu, \"used_bytes\": %zu, \"free_bytes\": %zu, "
+                "\"largest_free\": %zu, \"num_extents\": %zu, \"fragmentation\": %.4f,\n \"fill\": [",
+                map->pool_size, map->cell_bytes, map->used_bytes, map->free_bytes,
+                map->largest_free, map->num_extents, map->fragmentation);
+        for (size_t cell = 0; cell < map->num_cells; cell++)
+        {
+            fprintf(out, "%s%u", cell ? ", " : "", map->fill[cell]);
+        }
+
+        // Only the buckets that hold extents, keyed by their smallest size
+        fprintf(out, "],\n \"extents\": {");
+        bool first = true;
+        for (int bucket = 0; bucket < MEM_MAP_BUCKETS; bucket++)
+        {
+            if (!map->extent_counts[bucket]) continue;
+            fprintf(out, "%s\"%zu\": %zu", first ? "" : ", ", (size_t)1 << bucket, map->extent_counts[bucket]);
+            first = false;
+        }
+        fprintf(out, "}}\n");
+        return;
+    }
+
+    // A cell with any byte in use gets at least the first shade
+    for (size_t cell = 0; cell < map->num_cells; cell++)
+    {
+        if (cell % 64 == 0) fprintf(out, "%s%10zu |", cell ? "|\n" : "", cell * map->cell_bytes);
+        fputc(shades[(map->fill[cell] * 9 + 99) / 100], out);
+    }
+    fprintf(out, "|\n");
+
+    fprintf(out, "pool %zu bytes, %zu per cell, used %zu, free %zu in %zu extents, largest %zu, fragmentation %.4f\n",
+            map->pool_size, map->cell_bytes, map->used_bytes, map->free_bytes,
+            map->num_extents, map->largest_free, map->fragmentation);
+    for (int bucket = 0; bucket < MEM_MAP_BUCKETS; bucket++)
+    {
+        if (map->extent_counts[bucket])
+            fprintf(out, "  extents of %zu+ bytes: %zu\n", (size_t)1 << bucket, map->extent_counts[bucket]);
+    }
 }
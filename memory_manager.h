@@ -19,23 +19,194 @@ struct MemBlock
     void *ptr;
     size_t size;
     struct MemBlock *next;
-}MemPool;
+};
+
+extern struct MemBlock MemPool;
+
+// Synchronization of the memory manager calls
+enum MemLockPolicy
+{
+    MEM_LOCK_DEFAULT,   // Policy set at compile time with -DMEM_LOCK_POLICY, a pthread mutex if not set
+    MEM_LOCK_NONE,      // No locking, for pools that are only used by one thread
+    MEM_LOCK_SPIN,      // Spinlock with exponential backoff
+    MEM_LOCK_FUTEX,     // Spins with backoff for a while, then sleeps on a futex
+    MEM_LOCK_MUTEX      // pthread mutex
+};
+
+// Where a new block goes among the free gaps of the pool
+enum MemPlacement
+{
+    MEM_FIT_FIRST,  // The lowest gap that fits
+    MEM_FIT_NEXT,   // The first gap that fits from where the last block was placed, wrapping around
+    MEM_FIT_BEST,   // The smallest gap that fits, ties go to the lowest
+    MEM_FIT_WORST   // The largest gap
+};
+
+// Expected lifetime and temperature of a block, flags for mem_alloc_hint
+enum MemHint
+{
+    MEM_HINT_NONE = 0,   // Placed by the placement policy of the pool
+    MEM_HINT_SHORT = 1,  // Freed soon, placed top-down from the end of the pool
+    MEM_HINT_LONG = 2,   // Kept for long, placed bottom-up from the start of the pool
+    MEM_HINT_HOT = 4     // Used often, packed next to the other hot blocks from the middle
+};
+
+// Largest pool size, the offsets and sizes of the blocks are stored in 32 bits
+#define MEM_POOL_MAX_SIZE 0xFFFFFFFFu
+
+// Number of tenants, see mem_tenant_set
+#define MEM_MAX_TENANTS 32
+
+// Usage and limits of a tenant, filled in by mem_tenant_stats
+struct MemTenantStats
+{
+    size_t used_bytes;       // Bytes in the blocks of the tenant, including the ones in its thread caches
+    size_t peak_bytes;       // Highest value of used_bytes since mem_init
+    size_t num_blocks;       // Number of blocks of the tenant
+    size_t soft_limit;       // Bytes above which allocations are counted in soft_overruns, 0 for none
+    size_t hard_limit;       // Bytes above which allocations fail, 0 for none
+    size_t soft_overruns;    // Times used_bytes went above soft_limit
+    size_t hard_failures;    // Allocations and resizes refused by hard_limit
+};
+
+// Largest number of size classes of a pool with autotune
+#define MEM_MAX_CLASSES 16
+
+// Parameters of mem_init_config, fields left at zero take the default
+struct MemConfig
+{
+    size_t size;                    // Size of the memory pool
+    enum MemLockPolicy lock_policy; // Synchronization of the memory manager calls
+    const char *path;               // File to map the pool from, see mem_init_file
+    bool autotune;                  // Round small requests up to size classes derived from the
+                                    // request sizes, and cache freed blocks per thread
+    unsigned trim_decay_ms;         // Run a background thread that returns pages to the OS
+                                    // once they stayed free this long, 0 for none
+    enum MemPlacement placement;    // Gap a new block goes to, first fit by default
+};
+
+// Counters and layout summary of the memory pool, filled in by mem_stats
+struct MemStats
+{
+    size_t pool_size;        // Size of the memory pool in bytes
+    size_t used_bytes;       // Bytes currently handed out to callers
+    size_t peak_used_bytes;  // Highest value of used_bytes since mem_init
+    size_t free_bytes;       // Bytes not handed out
+    size_t largest_free;     // Largest contiguous free extent
+    size_t num_blocks;       // Number of live blocks
+    size_t peak_blocks;      // Highest value of num_blocks since mem_init
+    size_t metadata_bytes;   // Bytes of the table that tracks the blocks, 8 per entry
+    size_t num_allocs;       // Successful allocations since mem_init
+    size_t num_frees;        // Successful frees since mem_init
+    size_t alloc_failures;   // Allocations that returned NULL
+    size_t remote_frees;     // Frees handed to the lock holder through the remote-free queue
+    size_t dirty_bytes;      // Bytes of the pages touched since they were mapped or trimmed
+    size_t trimmed_bytes;    // Bytes returned to the OS since mem_init
+    size_t calloc_skipped;   // Bytes mem_calloc returned without clearing, they were never handed out
+    size_t maint_slices;     // Slices of work the maintenance thread did under the memory manager lock
+    size_t cache_hits;       // Allocations served by a thread cache, without mem_lock
+    size_t cached_bytes;     // Bytes of freed blocks held in the thread caches
+    size_t tunings;          // Times the size classes were derived from the request sizes
+    size_t num_classes;      // Size classes in use, 0 until the first tuning
+    size_t class_sizes[MEM_MAX_CLASSES];  // Size of each class, ascending
+    size_t cache_depths[MEM_MAX_CLASSES]; // Blocks of each class a thread cache keeps
+    double class_waste;      // Estimated share of the bytes of classed requests lost to rounding
+    size_t tenant_bytes[MEM_MAX_TENANTS];  // used_bytes of each tenant
+    double fragmentation;    // External fragmentation, 1 - largest_free / free_bytes
+};
+
+// Largest number of cells of a MemMap, and the buckets of its extent histogram
+#define MEM_MAP_MAX_CELLS 1024
+#define MEM_MAP_BUCKETS 64
+
+// Free-space map of the memory pool, filled in by mem_map. The pool is split
+// into cells of equal size, each cell records how much of it is in use.
+struct MemMap
+{
+    size_t pool_size;        // Size of the memory pool in bytes
+    size_t cell_bytes;       // Bytes of the pool covered by each cell, the last one may cover less
+    size_t num_cells;        // Cells in use of fill
+    unsigned char fill[MEM_MAP_MAX_CELLS];  // Percentage of each cell handed out, 0 to 100
+    size_t used_bytes;       // Bytes in blocks, including the blocks held in thread caches
+    size_t free_bytes;       // Bytes in free extents
+    size_t largest_free;     // Largest free extent
+    size_t num_extents;      // Number of free extents
+    size_t extent_counts[MEM_MAP_BUCKETS];  // Free extents of 2^i up to 2^(i+1) - 1 bytes
+    double fragmentation;    // External fragmentation, 1 - largest_free / free_bytes
+};
+
+// Called by mem_walk for each block, returns false to end the walk
+typedef bool (*MemWalkFn)(const struct MemBlock *block, void *ctx);
 
 void pool_info();
 void block_info(struct MemBlock *block);
 struct MemBlock* block_init(void* ptr, size_t size, void* next);
 struct MemBlock* block_find(void* block);
-static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
 
    /**
       * Initializes the memory manager with a specified size of memory pool.
       * The memory pool could be any data structure, for instance, a large array
-      * or a similar contiguous block of memory.
+      * or a similar contiguous block of memory. Pools are limited to
+      * MEM_POOL_MAX_SIZE bytes.
       *
       * @param size The size of the memory pool to initialize.
       */
      void mem_init(size_t size);
 
+     /**
+      * Initializes the memory manager like mem_init, with the pool parameters
+      * given in config. Must not be called while other threads use the pool.
+      *
+      * @param config The pool size and options, see struct MemConfig.
+      */
+     void mem_init_config(const struct MemConfig *config);
+
+     /**
+      * Initializes the memory manager with a pool mapped from the file at path.
+      * If the file holds a checkpoint of a pool of the same size, the blocks and
+      * their contents are restored as they were at that checkpoint, otherwise the
+      * file is created or overwritten with an empty pool. Blocks move to a new
+      * address between runs, so data in the pool should refer to other blocks by
+      * offset, see mem_offset and mem_ptr.
+      *
+      * @param path The pool file.
+      * @param size The size of the memory pool.
+      * @return true if the pool is ready, false if the file can not be used.
+      */
+     bool mem_init_file(const char *path, size_t size);
+
+     /**
+      * Writes the block list of a file pool to the file and flushes the pool with
+      * msync, so that reopening the file restores this state. mem_deinit
+      * checkpoints file pools as well.
+      *
+      * @return true on success, false on a write error or for pools without a file.
+      */
+     bool mem_checkpoint();
+
+     /**
+      * Returns the root block of the last checkpoint, the entry point into the
+      * data of a reopened file pool, or NULL if it had none. A root set with
+      * mem_set_root is returned once a checkpoint has committed it.
+      */
+     void *mem_root();
+
+     /**
+      * Records the root block of a file pool. It is written in the records of
+      * the next checkpoint, so a reopened pool only sees it once that
+      * checkpoint is complete.
+      *
+      * @param block The root block, or NULL to clear it.
+      */
+     void mem_set_root(void *block);
+
+     /**
+      * Converts between pointers into the pool and offsets from its start,
+      * which stay valid when a file pool is reopened at another address.
+      */
+     size_t mem_offset(void *ptr);
+     void *mem_ptr(size_t offset);
+
      /**
       * Allocates a block of memory of the specified size. This function finds a
       * suitable block in the pool, marks it as allocated, and returns a pointer
@@ -46,9 +217,49 @@ static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
       */
      void *mem_alloc(size_t size);
 
+     /**
+      * Allocates a block like mem_alloc, at an address that is a multiple of
+      * align. The bytes skipped to align the block stay free.
+      *
+      * @param size The size of the memory block to allocate.
+      * @param align The alignment, a power of two.
+      * @return A pointer to the allocated memory block, or NULL if allocation fails.
+      */
+     void *mem_alloc_aligned(size_t size, size_t align);
+
+     /**
+      * Allocates a block like mem_alloc, in a region of the pool chosen by
+      * how long the block lives and how often it is used. Long-lived blocks
+      * fill the pool from the bottom and short-lived ones from the top, so the
+      * free space a burst of short-lived blocks leaves behind stays in one
+      * piece. Hot blocks are placed one after the other from the middle of
+      * the pool, to share cache lines and pages. MEM_HINT_HOT wins over the
+      * lifetime flags, and both lifetime flags together count as none. The
+      * block comes from the pool, not from a thread cache.
+      *
+      * @param size The size of the memory block to allocate.
+      * @param hint MEM_HINT_SHORT, MEM_HINT_LONG or MEM_HINT_HOT, or'ed together.
+      * @return A pointer to the allocated memory block, or NULL if allocation fails.
+      */
+     void *mem_alloc_hint(size_t size, unsigned hint);
+
+     /**
+      * Allocates a zeroed array of num elements of size bytes. Only the pages
+      * of the pool that have been handed out before are cleared, pages that were
+      * never used are still zero from the operating system.
+      *
+      * @param num The number of elements.
+      * @param size The size of each element.
+      * @return A pointer to the zeroed memory block, or NULL if num * size
+      *         overflows or the allocation fails.
+      */
+     void *mem_calloc(size_t num, size_t size);
+
      /**
       * Frees the specified block of memory. This function marks the block as free
-      * within the memory manager's data structure.
+      * within the memory manager's data structure. If another thread holds the
+      * memory manager lock, the block is queued without blocking and freed by the
+      * next thread that allocates.
       *
       * @param block A pointer to the memory block to free.
       */
@@ -64,6 +275,105 @@ static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
       */
      void *mem_resize(void *block, size_t size);
 
+     /**
+      * Frees a block whose size the caller knows, the size it asked for or
+      * last resized it to. With size classes, a block of a class size goes to
+      * the thread cache without looking it up, without them it is freed like
+      * mem_free. Builds with MEM_DEBUG check the size against the block list
+      * and keep a block that does not match.
+      *
+      * @param block A pointer to the memory block to free.
+      * @param size The size the block was allocated or resized with.
+      */
+     void mem_free_sized(void *block, size_t size);
+
+     /**
+      * Resizes a block whose size the caller knows, like mem_resize. A block
+      * that moves has only old_size bytes copied. Builds with MEM_DEBUG check
+      * old_size against the block list.
+      *
+      * @param block A pointer to the memory block to resize.
+      * @param old_size The size the block was allocated or last resized with.
+      * @param size The new size of the memory block.
+      * @return A pointer to the resized memory block, or NULL if the resizing fails.
+      */
+     void *mem_resize_sized(void *block, size_t old_size, size_t size);
+
+     /**
+      * Returns the whole free pages of the pool to the OS with MADV_DONTNEED,
+      * so that the resident size drops to about the live bytes. The pages are
+      * mapped again on their next use and read as zero, so mem_calloc does not
+      * need to clear them. Pools backed by a file are not trimmed.
+      *
+      * @return The number of bytes released.
+      */
+     size_t mem_trim();
+
+     /**
+      * Starts a maintenance thread for the pool. While it runs, mem_free and
+      * shrinking mem_resize leave the upkeep of the free space index to it and
+      * return sooner, and the blocks other threads queued while the lock was
+      * taken are freed by it instead of the next allocation. It works in
+      * slices of bounded length, for duty percent of every millisecond. Freed
+      * space is reused once the thread has indexed it, or earlier when an
+      * allocation finds no room without it. mem_deinit stops the thread.
+      *
+      * @param duty The share of time the thread may work, 1 to 100 percent.
+      * @return true if the thread started, false if one is running already,
+      *         there is no pool, or the pool has no lock.
+      */
+     bool mem_maint_start(unsigned duty);
+
+     /**
+      * Changes the share of time the maintenance thread works, 1 to 100 percent.
+      */
+     void mem_maint_set_duty(unsigned duty);
+
+     /**
+      * Stops the maintenance thread and brings the free space index up to date.
+      */
+     void mem_maint_stop();
+
+     /**
+      * Makes the calling thread allocate for tenant, until it sets another.
+      * Every block the thread puts in the pool is charged to the tenant, and
+      * credited when it is freed, by any thread. Threads start out with
+      * tenant 0. The blocks in the thread cache are returned to the pool when
+      * the tenant changes.
+      *
+      * @param tenant The tenant, below MEM_MAX_TENANTS.
+      * @return true on success, false if tenant is out of range.
+      */
+     bool mem_tenant_set(unsigned tenant);
+
+     /**
+      * Returns the tenant the calling thread allocates for.
+      */
+     unsigned mem_tenant_get();
+
+     /**
+      * Sets the byte limits of a tenant. An allocation or in-place resize that
+      * takes the tenant above hard_limit fails, however much room the pool
+      * has. Going above soft_limit only counts in the soft_overruns of the
+      * tenant, for the caller to act on. The limits stay set across mem_init.
+      *
+      * @param tenant The tenant, below MEM_MAX_TENANTS.
+      * @param soft_limit The soft limit in bytes, 0 for none.
+      * @param hard_limit The hard limit in bytes, 0 for none.
+      * @return true on success, false if tenant is out of range.
+      */
+     bool mem_tenant_quota(unsigned tenant, size_t soft_limit, size_t hard_limit);
+
+     /**
+      * Fills in the usage and limits of a tenant. mem_stats has the bytes of
+      * every tenant in tenant_bytes.
+      *
+      * @param tenant The tenant, below MEM_MAX_TENANTS.
+      * @param stats Where to store the statistics.
+      * @return true on success, false if tenant is out of range.
+      */
+     bool mem_tenant_stats(unsigned tenant, struct MemTenantStats *stats);
+
      /**
       * Frees up the entire memory pool that was initially allocated by mem_init.
       * This function should be called to clean up the memory manager resources before
@@ -71,6 +381,53 @@ static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
       */
      void mem_deinit();
 
+     /**
+      * Fills in a snapshot of the pool counters and layout. The walk over the
+      * block list is done while holding the memory manager lock, so the values
+      * are consistent with each other.
+      *
+      * @param stats Where to store the statistics.
+      */
+     void mem_stats(struct MemStats *stats);
+
+     /**
+      * Fills in a map of the free and used space of the pool with the size of
+      * its free extents, in one walk over the block list under the memory
+      * manager lock.
+      *
+      * @param map Where to store the map.
+      * @param cells The number of cells to split the pool into, at most
+      *              MEM_MAP_MAX_CELLS, 0 for 256.
+      * @return true on success, false without a pool.
+      */
+     bool mem_map(struct MemMap *map, size_t cells);
+
+     /**
+      * Writes a map from mem_map to out, as an ASCII heatmap with one character
+      * per cell from ' ' (free) to '@' (in use) followed by the metrics, or as
+      * a JSON object.
+      *
+      * @param map The map to print.
+      * @param out The stream to write to.
+      * @param json true for JSON, false for the heatmap.
+      */
+     void mem_map_print(const struct MemMap *map, FILE *out, bool json);
+
+     /**
+      * Calls fn for every block of the pool in address order, including the
+      * blocks held in thread caches. The block table is copied while holding
+      * the memory manager lock, which takes a memcpy of 8 bytes per block, and
+      * the callbacks run on the copy without it. The walk is a consistent view
+      * of one moment, allocating threads are not stalled by the callbacks, and
+      * a block may be freed by the time fn sees it, so fn should only read the
+      * memory of blocks its caller keeps alive.
+      *
+      * @param fn The function to call with each block, false from it ends the walk.
+      * @param ctx Passed on to fn.
+      * @return The number of blocks fn was called for, 0 without a pool or memory for the copy.
+      */
+     size_t mem_walk(MemWalkFn fn, void *ctx);
+
  #ifdef __cplusplus
  }
  #endif
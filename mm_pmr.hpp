@@ -0,0 +1,133 @@
+// mm_pmr.hpp
+#ifndef MM_PMR_HPP
+#define MM_PMR_HPP
+
+#include "mem_arena.h"
+#include "mm_pool_allocator.hpp"
+#include <cstdint>
+#include <memory_resource>
+
+namespace mm
+{
+
+// Thread safe memory resource over the memory pool. Small objects come from
+// slabs behind a std::mutex, larger ones from mem_alloc_aligned. The slab
+// chunks go back to the pool on release() or destruction, which has to happen
+// before mem_deinit.
+class pool_resource : public std::pmr::memory_resource
+{
+public:
+    pool_resource() = default;
+    pool_resource(const pool_resource &) = delete;
+    pool_resource &operator=(const pool_resource &) = delete;
+
+    // Returns the slab chunks to the pool, no object of the resource may be in use
+    void release() noexcept { slabs_.release(); }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        // Every object may go to a slab, the size passed back to do_deallocate tells which
+        void *ptr = slabs_.allocate(bytes, align, true);
+        if (!ptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t align) override
+    {
+        slabs_.deallocate(ptr, bytes, align, true);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    pool slabs_;
+};
+
+// pool_resource for one thread, the slabs are used without locking
+class unsynchronized_pool_resource : public std::pmr::memory_resource
+{
+public:
+    unsynchronized_pool_resource() = default;
+    unsynchronized_pool_resource(const unsynchronized_pool_resource &) = delete;
+    unsynchronized_pool_resource &operator=(const unsynchronized_pool_resource &) = delete;
+
+    // Returns the slab chunks to the pool, no object of the resource may be in use
+    void release() noexcept { slabs_.release(); }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        void *ptr = slabs_.allocate(bytes, align, true);
+        if (!ptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t align) override
+    {
+        slabs_.deallocate(ptr, bytes, align, true);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    basic_pool<detail::null_mutex> slabs_;
+};
+
+// Monotonic memory resource on a pool arena. Allocation moves a pointer,
+// deallocation does nothing and release() frees everything at once. For one
+// thread, destroy it before mem_deinit.
+class monotonic_resource : public std::pmr::memory_resource
+{
+public:
+    explicit monotonic_resource(std::size_t chunk_size = 64 * 1024)
+        : arena_(mem_arena_create(chunk_size))
+    {
+        if (!arena_)
+            throw std::bad_alloc();
+    }
+
+    monotonic_resource(const monotonic_resource &) = delete;
+    monotonic_resource &operator=(const monotonic_resource &) = delete;
+    ~monotonic_resource() { mem_arena_destroy(arena_); }
+
+    // Frees every object of the resource, the arena keeps its chunks for reuse
+    void release() noexcept { mem_arena_reset(arena_); }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        // The arena aligns to MEM_ARENA_ALIGN, stricter alignments take extra room
+        std::size_t extra = align > MEM_ARENA_ALIGN ? align - MEM_ARENA_ALIGN : 0;
+        if (bytes > SIZE_MAX - extra)
+            throw std::bad_alloc();
+        void *ptr = mem_arena_alloc(arena_, bytes + extra);
+        if (!ptr)
+            throw std::bad_alloc();
+
+        std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(ptr);
+        return reinterpret_cast<void *>((addr + align - 1) & ~(std::uintptr_t)(align - 1));
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    MemArena *arena_;
+};
+
+} // namespace mm
+
+#endif // MM_PMR_HPP
@@ -0,0 +1,210 @@
+// mm_pool_allocator.hpp
+#ifndef MM_POOL_ALLOCATOR_HPP
+#define MM_POOL_ALLOCATOR_HPP
+
+#include "memory_manager.h"
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+namespace mm
+{
+
+namespace detail
+{
+
+// Lock for slabs that are only used by one thread
+struct null_mutex
+{
+    void lock() noexcept {}
+    void unlock() noexcept {}
+};
+
+// Free list of equal slots carved from chunks taken from the pool. The first
+// slot of a chunk links the chunks, the free slots link each other.
+template <typename Mutex>
+class slab
+{
+public:
+    static constexpr std::size_t chunk_slots = 64;
+    static constexpr std::size_t chunk_align = 16;
+
+    void *allocate(std::size_t slot_size)
+    {
+        std::lock_guard<Mutex> guard(lock_);
+        if (!free_ && !grow(slot_size))
+            return nullptr;
+
+        void *slot = free_;
+        free_ = *static_cast<void **>(free_);
+        return slot;
+    }
+
+    void deallocate(void *slot) noexcept
+    {
+        std::lock_guard<Mutex> guard(lock_);
+        *static_cast<void **>(slot) = free_;
+        free_ = slot;
+    }
+
+    void release() noexcept
+    {
+        std::lock_guard<Mutex> guard(lock_);
+        while (chunks_)
+        {
+            void *next = *static_cast<void **>(chunks_);
+            mem_free(chunks_);
+            chunks_ = next;
+        }
+        free_ = nullptr;
+    }
+
+private:
+    bool grow(std::size_t slot_size)
+    {
+        char *chunk = static_cast<char *>(mem_alloc_aligned(slot_size * (chunk_slots + 1), chunk_align));
+        if (!chunk)
+            return false;
+
+        *reinterpret_cast<void **>(chunk) = chunks_;
+        chunks_ = chunk;
+        for (std::size_t i = chunk_slots; i > 0; i--)
+        {
+            void *slot = chunk + i * slot_size;
+            *static_cast<void **>(slot) = free_;
+            free_ = slot;
+        }
+        return true;
+    }
+
+    Mutex lock_;
+    void *free_ = nullptr;
+    void *chunks_ = nullptr;
+};
+
+} // namespace detail
+
+// Handle to the memory pool that allocators carry as their state. Single
+// objects of up to slab_max_size bytes, which is how node-based containers
+// (std::list, std::map, std::unordered_map) allocate their nodes, come from
+// slabs of equal slots. Sizes are rounded up to slab_granule and each rounded
+// size has its own slab, node types of the same rounded size share it.
+// Everything else goes to mem_alloc_aligned directly.
+//
+// The slabs take their chunks from the pool and keep them until release(),
+// which has to be called before mem_deinit. Handles are thread safe with
+// std::mutex, and for use by one thread only with detail::null_mutex.
+template <typename Mutex>
+class basic_pool
+{
+public:
+    static constexpr std::size_t slab_granule = 16;
+    static constexpr std::size_t slab_max_size = 256;
+
+    basic_pool() = default;
+    basic_pool(const basic_pool &) = delete;
+    basic_pool &operator=(const basic_pool &) = delete;
+    ~basic_pool() { release(); }
+
+    // The handle used by default constructed allocators. It is never destroyed,
+    // so that it does not outlive the pool at exit, call release() before mem_deinit.
+    static basic_pool &global()
+    {
+        static basic_pool *handle = new basic_pool;
+        return *handle;
+    }
+
+    // Allocates bytes aligned to align, from a slab when single is set and the
+    // object fits one. Returns nullptr when the pool is out of memory.
+    void *allocate(std::size_t bytes, std::size_t align, bool single)
+    {
+        if (single && bytes > 0 && bytes <= slab_max_size && align <= slab_granule)
+            return slabs_[slab_index(bytes)].allocate(slab_size(bytes));
+        return mem_alloc_aligned(bytes, align);
+    }
+
+    void deallocate(void *ptr, std::size_t bytes, std::size_t align, bool single) noexcept
+    {
+        if (single && bytes > 0 && bytes <= slab_max_size && align <= slab_granule)
+            slabs_[slab_index(bytes)].deallocate(ptr);
+        else
+            mem_free(ptr);
+    }
+
+    // Returns the chunks of all slabs to the pool, the slots must not be in use
+    void release() noexcept
+    {
+        for (auto &s : slabs_)
+            s.release();
+    }
+
+private:
+    static std::size_t slab_index(std::size_t bytes) { return (bytes - 1) / slab_granule; }
+    static std::size_t slab_size(std::size_t bytes) { return (slab_index(bytes) + 1) * slab_granule; }
+
+    detail::slab<Mutex> slabs_[slab_max_size / slab_granule];
+};
+
+using pool = basic_pool<std::mutex>;
+
+// STL allocator over the memory manager. The allocator holds a pool handle,
+// copies and rebound copies share it, and it moves along with the containers
+// on copy, move and swap so that memory is always returned to its own handle.
+template <typename T>
+class pool_allocator
+{
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = pool_allocator<U>;
+    };
+
+    pool_allocator() noexcept : pool_(&pool::global()) {}
+    explicit pool_allocator(pool &handle) noexcept : pool_(&handle) {}
+
+    template <typename U>
+    pool_allocator(const pool_allocator<U> &other) noexcept : pool_(other.get_pool()) {}
+
+    T *allocate(size_type n)
+    {
+        if (n > std::numeric_limits<size_type>::max() / sizeof(T))
+            throw std::bad_array_new_length();
+
+        void *ptr = pool_->allocate(n * sizeof(T), alignof(T), n == 1);
+        if (!ptr)
+            throw std::bad_alloc();
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, size_type n) noexcept
+    {
+        pool_->deallocate(ptr, n * sizeof(T), alignof(T), n == 1);
+    }
+
+    pool *get_pool() const noexcept { return pool_; }
+
+    template <typename U>
+    bool operator==(const pool_allocator<U> &other) const noexcept { return pool_ == other.get_pool(); }
+
+    template <typename U>
+    bool operator!=(const pool_allocator<U> &other) const noexcept { return pool_ != other.get_pool(); }
+
+private:
+    pool *pool_;
+};
+
+} // namespace mm
+
+#endif // MM_POOL_ALLOCATOR_HPP
@@ -0,0 +1,82 @@
+// mm_static_pool.hpp
+#ifndef MM_STATIC_POOL_HPP
+#define MM_STATIC_POOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace mm
+{
+
+// Pool of Count blocks of BlockSize bytes in an array of its own, for code
+// that may not allocate at run time. The free list is an array of slot
+// indices that a constexpr constructor fills in, so a static or constinit
+// pool is ready before main without touching the memory manager. Allocation
+// and deallocation are a few loads and stores and one branch. Not thread
+// safe, guard a shared pool with a lock.
+template <std::size_t BlockSize, std::size_t Count, std::size_t Align = alignof(std::max_align_t)>
+class static_pool
+{
+    static_assert(BlockSize > 0 && Count > 0, "static_pool needs blocks");
+    static_assert(Align > 0 && (Align & (Align - 1)) == 0, "Align must be a power of two");
+
+public:
+    static constexpr std::size_t block_size = (BlockSize + Align - 1) / Align * Align;
+    static constexpr std::size_t capacity = Count;
+
+    // Smallest index type that also holds Count, the end of the free list
+    using index_type = std::conditional_t<Count < UINT8_MAX, std::uint8_t,
+                       std::conditional_t<Count < UINT16_MAX, std::uint16_t, std::uint32_t>>;
+    static_assert(Count < UINT32_MAX, "static_pool holds fewer than 2^32 - 1 blocks");
+
+    constexpr static_pool() noexcept : storage_{}, next_{}, head_(0), available_(Count)
+    {
+        for (std::size_t i = 0; i < Count; i++)
+            next_[i] = static_cast<index_type>(i + 1);
+    }
+
+    static_pool(const static_pool &) = delete;
+    static_pool &operator=(const static_pool &) = delete;
+
+    // Returns a block of block_size bytes aligned to Align, or nullptr when all are in use
+    void *allocate() noexcept
+    {
+        index_type i = head_;
+        if (i == Count)
+            return nullptr;
+
+        head_ = next_[i];
+        available_--;
+        return storage_ + i * block_size;
+    }
+
+    // Returns a block from allocate() to the pool
+    void deallocate(void *block) noexcept
+    {
+        auto i = static_cast<index_type>((static_cast<unsigned char *>(block) - storage_) / block_size);
+        next_[i] = head_;
+        head_ = i;
+        available_++;
+    }
+
+    // Tells if block lies in the storage of the pool
+    bool owns(const void *block) const noexcept
+    {
+        auto addr = reinterpret_cast<std::uintptr_t>(block);
+        auto base = reinterpret_cast<std::uintptr_t>(storage_);
+        return addr >= base && addr < base + sizeof(storage_);
+    }
+
+    std::size_t available() const noexcept { return available_; }
+
+private:
+    alignas(Align) unsigned char storage_[block_size * Count];
+    index_type next_[Count];
+    index_type head_;
+    std::size_t available_;
+};
+
+} // namespace mm
+
+#endif // MM_STATIC_POOL_HPP
@@ -0,0 +1,124 @@
+// perf_counters.h
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware and software events collected around a timed region
+enum
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_NUM_EVENTS
+};
+
+static const char *perf_event_names[PERF_NUM_EVENTS] = {
+    "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses", "dtlb_misses", "context_switches"};
+
+#define PERF_CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+} perf_event_configs[PERF_NUM_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+// Counters of the calling process, an fd of -1 marks an event that is not available
+typedef struct
+{
+    int fds[PERF_NUM_EVENTS];
+    int available; // Number of events that could be opened
+} perf_counters_t;
+
+// perf_counters_open opens every event on its own so that a missing one does not
+// disable the rest. The counters are inherited by threads created afterwards.
+// Returns the number of available events, 0 when perf_event_open is not permitted.
+static inline int perf_counters_open(perf_counters_t *pc)
+{
+    pc->available = 0;
+    for (int i = 0; i < PERF_NUM_EVENTS; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_event_configs[i].type;
+        attr.config = perf_event_configs[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = attr.type != PERF_TYPE_SOFTWARE;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        pc->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (pc->fds[i] >= 0)
+            pc->available++;
+    }
+    return pc->available;
+}
+
+static inline void perf_counters_start(perf_counters_t *pc)
+{
+    for (int i = 0; i < PERF_NUM_EVENTS; i++)
+    {
+        if (pc->fds[i] < 0)
+            continue;
+        ioctl(pc->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(pc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static inline void perf_counters_stop(perf_counters_t *pc)
+{
+    for (int i = 0; i < PERF_NUM_EVENTS; i++)
+    {
+        if (pc->fds[i] >= 0)
+            ioctl(pc->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+// perf_counters_read stores the counts since perf_counters_start, scaled up when the
+// kernel had to multiplex the counters. Unavailable events are stored as -1.
+static inline void perf_counters_read(perf_counters_t *pc, double values[PERF_NUM_EVENTS])
+{
+    for (int i = 0; i < PERF_NUM_EVENTS; i++)
+    {
+        uint64_t data[3]; // value, time enabled, time running
+        values[i] = -1;
+        if (pc->fds[i] < 0 || read(pc->fds[i], data, sizeof(data)) != sizeof(data))
+            continue;
+        values[i] = data[2] ? (double)data[0] * data[1] / data[2] : 0;
+    }
+}
+
+static inline void perf_counters_close(perf_counters_t *pc)
+{
+    for (int i = 0; i < PERF_NUM_EVENTS; i++)
+    {
+        if (pc->fds[i] >= 0)
+            close(pc->fds[i]);
+        pc->fds[i] = -1;
+    }
+    pc->available = 0;
+}
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,447 @@
+// replay_trace.c
+// Replays an allocation trace captured with cM2.c (LD_PRELOAD=./libmymalloc.so)
+// against the memory manager, or against glibc malloc for comparison.
+#include "bench_defs.h"
+#include <stdio.h>
+#include <string.h>
+#include "common_defs.h"
+
+#define SLOT_EMPTY NULL
+#define SLOT_FAILED ((void *)1)
+#define SLOT_DONE ((void *)2)
+#define MAX_THREADS 1024
+
+// One replayed call, slots refer to allocations in the order they appear in the trace
+typedef struct
+{
+    char op;     // 'a' allocate, 'f' free, 'r' resize
+    int src;     // Slot that is freed or resized, -1 if none
+    int dst;     // Slot that receives the result, -1 if none
+    size_t size; // Requested size
+} trace_event_t;
+
+// The events of one traced thread, kept in trace order
+typedef struct
+{
+    long tid;
+    trace_event_t *events;
+    int count;
+    int capacity;
+} trace_thread_t;
+
+// Open addressing map from a traced address to its live slot
+typedef struct
+{
+    uintptr_t *keys;
+    int *values;
+    size_t capacity;
+    size_t used;
+} addr_map_t;
+
+static trace_thread_t threads[MAX_THREADS];
+static int num_threads = 0;
+static int num_slots = 0;
+static size_t *slot_sizes = NULL;
+static void **slots = NULL;
+static size_t trace_peak_live = 0;
+static int unmatched = 0;
+
+static const allocator_t *replay_allocator;
+static my_barrier_t barrier;
+static size_t live_bytes = 0;
+static size_t peak_live_bytes = 0;
+static size_t replay_failures = 0;
+
+// ********* Trace parsing *********
+
+static size_t addr_hash(uintptr_t key, size_t capacity)
+{
+    return (key >> 4) * 0x9E3779B97F4A7C15ull & (capacity - 1);
+}
+
+static void addr_map_put(addr_map_t *map, uintptr_t key, int value);
+
+static void addr_map_grow(addr_map_t *map)
+{
+    addr_map_t old = *map;
+    map->capacity = old.capacity ? old.capacity * 2 : 1024;
+    map->keys = calloc(map->capacity, sizeof(uintptr_t));
+    map->values = calloc(map->capacity, sizeof(int));
+    map->used = 0;
+    if (!map->keys || !map->values)
+    {
+        fprintf(stderr, "replay_trace: out of memory while parsing\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Re-insert the live entries, values below 0 are deleted entries
+    for (size_t i = 0; i < old.capacity; i++)
+    {
+        if (old.keys[i] && old.values[i] >= 0)
+            addr_map_put(map, old.keys[i], old.values[i]);
+    }
+    free(old.keys);
+    free(old.values);
+}
+
+static void addr_map_put(addr_map_t *map, uintptr_t key, int value)
+{
+    if ((map->used + 1) * 2 > map->capacity)
+        addr_map_grow(map);
+
+    size_t i = addr_hash(key, map->capacity);
+    while (map->keys[i] && map->keys[i] != key)
+        i = (i + 1) & (map->capacity - 1);
+
+    if (!map->keys[i])
+        map->used++;
+    map->keys[i] = key;
+    map->values[i] = value;
+}
+
+// addr_map_take returns the slot of a traced address and removes it, or -1
+static int addr_map_take(addr_map_t *map, uintptr_t key)
+{
+    if (!map->capacity)
+        return -1;
+
+    size_t i = addr_hash(key, map->capacity);
+    while (map->keys[i])
+    {
+        if (map->keys[i] == key)
+        {
+            int value = map->values[i];
+            map->values[i] = -1;
+            return value;
+        }
+        i = (i + 1) & (map->capacity - 1);
+    }
+    return -1;
+}
+
+static trace_thread_t *thread_for(long tid)
+{
+    for (int i = 0; i < num_threads; i++)
+    {
+        if (threads[i].tid == tid)
+            return &threads[i];
+    }
+
+    if (num_threads == MAX_THREADS)
+    {
+        fprintf(stderr, "replay_trace: more than %d threads in the trace\n", MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+    threads[num_threads].tid = tid;
+    return &threads[num_threads++];
+}
+
+static int new_slot(size_t size)
+{
+    if ((num_slots & (num_slots - 1)) == 0)
+    {
+        size_t capacity = num_slots ? num_slots * 2 : 1024;
+        slot_sizes = realloc(slot_sizes, capacity * sizeof(size_t));
+        if (!slot_sizes)
+        {
+            fprintf(stderr, "replay_trace: out of memory while parsing\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    slot_sizes[num_slots] = size;
+    return num_slots++;
+}
+
+static void add_event(long tid, char op, int src, int dst, size_t size)
+{
+    trace_thread_t *thread = thread_for(tid);
+    if (thread->count == thread->capacity)
+    {
+        thread->capacity = thread->capacity ? thread->capacity * 2 : 1024;
+        thread->events = realloc(thread->events, thread->capacity * sizeof(trace_event_t));
+        if (!thread->events)
+        {
+            fprintf(stderr, "replay_trace: out of memory while parsing\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    thread->events[thread->count++] = (trace_event_t){.op = op, .src = src, .dst = dst, .size = size};
+}
+
+// parse_trace reads the cM2.c output, lines that are not allocator calls are skipped.
+// Traces recorded without thread ids are replayed as a single thread.
+static int parse_trace(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        perror("replay_trace: can not open trace");
+        return -1;
+    }
+
+    addr_map_t map = {0};
+    size_t live = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+        size_t size, nmemb;
+        void *ptr, *nptr;
+        long tid = 0;
+        int src;
+
+        if (sscanf(line, "rMALLOc (%zu) at %p [%ld]", &size, &ptr, &tid) >= 2 ||
+            sscanf(line, "rMEMALING (%zu, %zu) @ %p [%ld]", &nmemb, &size, &ptr, &tid) >= 3 ||
+            (sscanf(line, "rCALLOC (%zu,%zu) at %p [%ld]", &nmemb, &size, &ptr, &tid) >= 3 && (size *= nmemb, 1)))
+        {
+            int dst = new_slot(size);
+            addr_map_put(&map, (uintptr_t)ptr, dst);
+            add_event(tid, 'a', -1, dst, size);
+            live += size;
+        }
+        else if (sscanf(line, "rFREE at %p [%ld]", &ptr, &tid) >= 1)
+        {
+            if ((src = addr_map_take(&map, (uintptr_t)ptr)) < 0)
+            {
+                unmatched++;
+                continue;
+            }
+            add_event(tid, 'f', src, -1, 0);
+            live -= slot_sizes[src];
+        }
+        else if (sscanf(line, "rREALLOC (%zu) at %p -> %p [%ld]", &size, &ptr, &nptr, &tid) >= 3)
+        {
+            src = ptr ? addr_map_take(&map, (uintptr_t)ptr) : -1;
+            if (ptr && src < 0)
+            {
+                unmatched++;
+                continue;
+            }
+            if (src >= 0)
+                live -= slot_sizes[src];
+
+            // realloc(ptr, 0) frees the block
+            if (size == 0 || !nptr)
+            {
+                if (src >= 0)
+                    add_event(tid, 'f', src, -1, 0);
+                continue;
+            }
+
+            int dst = new_slot(size);
+            addr_map_put(&map, (uintptr_t)nptr, dst);
+            add_event(tid, src >= 0 ? 'r' : 'a', src, dst, size);
+            live += size;
+        }
+        else
+        {
+            continue;
+        }
+
+        if (live > trace_peak_live)
+            trace_peak_live = live;
+    }
+
+    fclose(fp);
+    free(map.keys);
+    free(map.values);
+    return 0;
+}
+
+// ********* Replay *********
+
+static void account(long delta)
+{
+    size_t live = __atomic_add_fetch(&live_bytes, delta, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&peak_live_bytes, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// wait_slot waits until the thread that allocated the slot has replayed that
+// allocation, so frees and resizes from other threads keep the trace order
+static void *wait_slot(int slot)
+{
+    void *ptr;
+    while ((ptr = __atomic_load_n(&slots[slot], __ATOMIC_ACQUIRE)) == SLOT_EMPTY)
+        sched_yield();
+    __atomic_store_n(&slots[slot], SLOT_DONE, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+static void publish_slot(int slot, void *ptr)
+{
+    __atomic_store_n(&slots[slot], ptr ? ptr : SLOT_FAILED, __ATOMIC_RELEASE);
+}
+
+static void *replay_thread(void *arg)
+{
+    trace_thread_t *thread = (trace_thread_t *)arg;
+    const allocator_t *a = replay_allocator;
+
+    my_barrier_wait(&barrier);
+
+    for (int i = 0; i < thread->count; i++)
+    {
+        trace_event_t *e = &thread->events[i];
+        void *ptr = e->src >= 0 ? wait_slot(e->src) : SLOT_FAILED;
+
+        switch (e->op)
+        {
+        case 'a':
+            ptr = a->alloc(e->size);
+            if (!ptr)
+                __atomic_add_fetch(&replay_failures, 1, __ATOMIC_RELAXED);
+            else
+                account(e->size);
+            publish_slot(e->dst, ptr);
+            break;
+        case 'f':
+            if (ptr != SLOT_FAILED)
+            {
+                a->free(ptr);
+                account(-(long)slot_sizes[e->src]);
+            }
+            break;
+        case 'r':
+            if (ptr == SLOT_FAILED)
+            {
+                ptr = a->alloc(e->size);
+            }
+            else
+            {
+                account(-(long)slot_sizes[e->src]);
+                void *nptr = a->resize(ptr, e->size);
+                if (!nptr)
+                    a->free(ptr);
+                ptr = nptr;
+            }
+            if (!ptr)
+                __atomic_add_fetch(&replay_failures, 1, __ATOMIC_RELAXED);
+            else
+                account(e->size);
+            publish_slot(e->dst, ptr);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void replay(const allocator_t *a, size_t pool_size)
+{
+    pthread_t tids[MAX_THREADS];
+    double start, end;
+    struct MemStats stats = {0};
+    long ops = 0;
+
+    replay_allocator = a;
+    live_bytes = peak_live_bytes = replay_failures = 0;
+    memset(slots, 0, num_slots * sizeof(void *));
+    for (int i = 0; i < num_threads; i++)
+        ops += threads[i].count;
+
+    bench_pool_init(a, pool_size);
+    my_barrier_init(&barrier, num_threads + 1);
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        if (pthread_create(&tids[i], NULL, replay_thread, &threads[i]) != 0)
+        {
+            perror("Failed to create thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    start = bench_now();
+    my_barrier_wait(&barrier);
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(tids[i], NULL);
+    end = bench_now();
+
+    if (bench_is_pool(a))
+        mem_stats(&stats);
+
+    // Release what the traced program never freed
+    for (int i = 0; i < num_slots; i++)
+    {
+        if (slots[i] != SLOT_EMPTY && slots[i] != SLOT_FAILED && slots[i] != SLOT_DONE)
+            a->free(slots[i]);
+    }
+
+    bench_pool_deinit(a);
+    my_barrier_destroy(&barrier);
+
+    double seconds = end - start;
+    printf("%-10s ops: %ld  time: %.6f s  throughput: %.0f ops/s  peak live: %zu B  failures: %zu\n",
+           a->name, ops, seconds, seconds > 0 ? ops / seconds : 0.0, peak_live_bytes, replay_failures);
+    if (bench_is_pool(a))
+    {
+        printf("%-10s pool: %zu B  peak used: %zu B (%.1f%%)  largest free: %zu B  fragmentation: %.3f\n",
+               "", stats.pool_size, stats.peak_used_bytes,
+               stats.pool_size ? 100.0 * stats.peak_used_bytes / stats.pool_size : 0.0,
+               stats.largest_free, stats.fragmentation);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t pool_size = 0;
+    bool with_glibc = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "gp:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'g':
+            with_glibc = true;
+            break;
+        case 'p':
+            pool_size = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        printf("Usage: %s [-g] [-p pool_size] <trace file>\n", argv[0]);
+        printf("  Record a trace with: LD_PRELOAD=./libmymalloc.so <program> > trace.txt\n");
+        printf("  -g  also replay the trace against glibc malloc\n");
+        printf("  -p  pool size in bytes (default: twice the peak live bytes of the trace)\n");
+        return 1;
+    }
+
+    if (parse_trace(argv[optind]) != 0)
+        return 1;
+    if (num_threads == 0)
+    {
+        printf("No allocator calls found in %s\n", argv[optind]);
+        return 1;
+    }
+
+    if (pool_size == 0)
+        pool_size = trace_peak_live * 2 > 4096 ? trace_peak_live * 2 : 4096;
+
+    slots = calloc(num_slots, sizeof(void *));
+    if (!slots)
+    {
+        fprintf(stderr, "replay_trace: out of memory\n");
+        return 1;
+    }
+
+    printf("Trace: %d threads, %d allocations, peak live %zu B, %d frees of unknown blocks skipped\n",
+           num_threads, num_slots, trace_peak_live, unmatched);
+
+    replay(&pool_allocator, pool_size);
+    if (with_glibc)
+        replay(&glibc_allocator, 0);
+
+    for (int i = 0; i < num_threads; i++)
+        free(threads[i].events);
+    free(slots);
+    free(slot_sizes);
+    return 0;
+}
@@ -2,7 +2,12 @@
 #include <sys/time.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "memory_manager.h"
+#include "mem_shm.h"
+#include "mem_arena.h"
+#include "mem_stack.h"
+#include "mem_static_pool.h"
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
@@ -11,6 +16,7 @@
 #include <dlfcn.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <sys/wait.h>
 #include "common_defs.h"
 
 #include <unistd.h>
@@ -87,214 +93,2113 @@ size_t *calculate_thread_allocations(int num_threads, size_t total_memory)
     The function takes a pointer to the test function, the number of threads to create, the size of the memory pool, and the name of the function being tested (used for printing purposes only).
 */
 
+// Thread counts and memory pool sizes swept by testAcrossConfigurations and scalingAcrossConfigurations
+static const int config_threads[] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+static const size_t config_mem_sizes[] = {1024, 2048, 4096, 8192};
+
 void testAcrossConfigurations(void (*test_func)(TestParams), TestParams params)
 {
-    int num_threads[] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+    const int *num_threads = config_threads;
     size_t *mem_sizes;
     int *repetitions;
 
-    int count = 1;
-    int rcount = 1;
+    int count = 1;
+    int rcount = 1;
+
+    // If mem_size is 0, we run with single memory size, ie. the function requires a fixes size mem_size
+    if (params.memory_size > 0)
+    {
+        mem_sizes = malloc(sizeof(size_t));
+        mem_sizes[0] = params.memory_size;
+    }
+    else
+    {
+        count = sizeof(config_mem_sizes) / sizeof(config_mem_sizes[0]);
+        mem_sizes = malloc(count * sizeof(size_t));
+        memcpy(mem_sizes, config_mem_sizes, sizeof(config_mem_sizes));
+    }
+
+    // If iterations is -1 (i.e. not set), we run with single iteration.
+    if (params.iterations > 0)
+    {
+        repetitions = malloc(4 * sizeof(int));
+        repetitions[0] = 10;
+        repetitions[1] = 100;
+        repetitions[2] = 500;
+        repetitions[3] = 1000;
+        rcount = 4;
+    }
+    else
+    {
+        repetitions = malloc(sizeof(int));
+        repetitions[0] = 1;
+    }
+
+    // Run the test function for all combinations of num_threads, mem_sizes, and repetitions
+    for (int i = 0; i < sizeof(config_threads) / sizeof(config_threads[0]); i++)
+    {
+        for (int j = 0; j < count; j++)
+        {
+            for (int z = 0; z < rcount; z++)
+            {
+                params.num_threads = num_threads[i];
+                params.memory_size = mem_sizes[j];
+                params.iterations = repetitions[z];
+                test_func(params);
+            }
+        }
+    }
+
+    free(mem_sizes);
+    free(repetitions);
+}
+
+// Per-thread data of the scaling benchmark
+typedef struct
+{
+    size_t block_size; // Size of each block to allocate
+    int iterations;    // Number of allocate and free pairs
+    long *latencies;   // Nanoseconds taken by each pair
+    int ops;           // Number of pairs that succeeded
+    struct timespec start, end; // When the thread started and finished the loop
+} scaling_data_t;
+
+static long elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+void *thread_scaling(void *arg)
+{
+    scaling_data_t *data = (scaling_data_t *)arg;
+    struct timespec op_start, op_end;
+
+    my_barrier_wait(&barrier);
+    clock_gettime(CLOCK_MONOTONIC, &data->start);
+    op_end = data->start;
+
+    for (int i = 0; i < data->iterations; i++)
+    {
+        op_start = op_end;
+        void *block = mem_alloc(data->block_size);
+        if (block != NULL)
+            mem_free(block);
+        clock_gettime(CLOCK_MONOTONIC, &op_end);
+
+        if (block != NULL)
+            data->latencies[data->ops++] = elapsed_ns(&op_start, &op_end);
+    }
+
+    data->end = op_end;
+    return NULL;
+}
+
+/*
+    Scaling benchmark over the same thread counts and memory sizes as testAcrossConfigurations.
+    Every thread repeatedly allocates and frees a block, the throughput, the fairness between
+    the threads (Jain's index of the per-thread rates) and the latency percentiles of each
+    configuration are written to a CSV file, and the speedup over one thread is plotted.
+*/
+void scalingAcrossConfigurations(const char *csv_path, int iterations)
+{
+    int thread_count = sizeof(config_threads) / sizeof(config_threads[0]);
+    int size_count = sizeof(config_mem_sizes) / sizeof(config_mem_sizes[0]);
+    double speedup[size_count][thread_count];
+
+    FILE *csv = fopen(csv_path, "w");
+    if (csv == NULL)
+    {
+        perror("Failed to open the CSV file");
+        return;
+    }
+    fprintf(csv, "threads,mem_size,ops,seconds,throughput,speedup,fairness,p50_ns,p99_ns,p999_ns,max_ns\n");
+
+    for (int j = 0; j < size_count; j++)
+    {
+        double base_throughput = 0;
+        for (int i = 0; i < thread_count; i++)
+        {
+            int num_threads = config_threads[i];
+            size_t mem_size = config_mem_sizes[j];
+            pthread_t threads[num_threads];
+            scaling_data_t data[num_threads];
+            long *latencies = malloc((size_t)num_threads * iterations * sizeof(long));
+            my_assert(latencies != NULL);
+
+            mem_init(mem_size);
+            my_barrier_init(&barrier, num_threads);
+            for (int t = 0; t < num_threads; t++)
+            {
+                data[t] = (scaling_data_t){.block_size = mem_size / num_threads / 2, .iterations = iterations,
+                                           .latencies = &latencies[(size_t)t * iterations]};
+                pthread_create(&threads[t], NULL, thread_scaling, &data[t]);
+            }
+
+            // The run lasts from the first thread starting to the last thread finishing
+            long ops = 0;
+            double rate_sum = 0, rate_sq_sum = 0;
+            struct timespec first = {0}, last = {0};
+            for (int t = 0; t < num_threads; t++)
+            {
+                pthread_join(threads[t], NULL);
+                long thread_ns = elapsed_ns(&data[t].start, &data[t].end);
+                double rate = thread_ns > 0 ? data[t].ops * 1e9 / thread_ns : 0;
+                rate_sum += rate;
+                rate_sq_sum += rate * rate;
+                ops += data[t].ops;
+                if (t == 0 || elapsed_ns(&data[t].start, &first) > 0)
+                    first = data[t].start;
+                if (t == 0 || elapsed_ns(&last, &data[t].end) > 0)
+                    last = data[t].end;
+            }
+            double seconds = elapsed_ns(&first, &last) / 1e9;
+            mem_deinit();
+            my_barrier_destroy(&barrier);
+
+            // Gather the latencies of all threads to get the percentiles
+            long count = 0;
+            for (int t = 0; t < num_threads; t++)
+            {
+                memmove(&latencies[count], data[t].latencies, data[t].ops * sizeof(long));
+                count += data[t].ops;
+            }
+            qsort(latencies, count, sizeof(long), compare_long);
+
+            double throughput = seconds > 0 ? ops / seconds : 0;
+            if (i == 0)
+                base_throughput = throughput;
+            speedup[j][i] = base_throughput > 0 ? throughput / base_throughput : 0;
+            double fairness = rate_sq_sum > 0 ? rate_sum * rate_sum / (num_threads * rate_sq_sum) : 0;
+
+            fprintf(csv, "%d,%zu,%ld,%.6f,%.1f,%.3f,%.4f,%ld,%ld,%ld,%ld\n", num_threads, mem_size, ops, seconds,
+                    throughput, speedup[j][i], fairness,
+                    count ? latencies[count / 2] : 0, count ? latencies[count * 99 / 100] : 0,
+                    count ? latencies[count * 999 / 1000] : 0, count ? latencies[count - 1] : 0);
+            printf_yellow("  Scaling (threads: %d, mem_size: %zu) ---> ", num_threads, mem_size);
+            printf("%.0f ops/s, speedup %.2f, fairness %.3f\n", throughput, speedup[j][i], fairness);
+            free(latencies);
+        }
+    }
+    fclose(csv);
+
+    // Plot the speedup against the thread count, one bar per memory size
+    double max_speedup = 1;
+    for (int j = 0; j < size_count; j++)
+        for (int i = 0; i < thread_count; i++)
+            if (speedup[j][i] > max_speedup)
+                max_speedup = speedup[j][i];
+
+    printf("\nSpeedup over 1 thread (full bar = %.2fx), results in %s\n", max_speedup, csv_path);
+    for (int i = 0; i < thread_count; i++)
+    {
+        for (int j = 0; j < size_count; j++)
+        {
+            int width = (int)(50 * speedup[j][i] / max_speedup + 0.5);
+            printf("%4d threads %5zu B |", config_threads[i], config_mem_sizes[j]);
+            for (int k = 0; k < width; k++)
+                printf("#");
+            printf(" %.2f\n", speedup[j][i]);
+        }
+    }
+}
+
+void run_concurrent_test(void *(*test_func)(void *), TestParams params, char *function_name)
+{
+    printf_yellow("  Testing \"%s\" (threads: %d, mem_size: %zu) ---> ", function_name, params.num_threads, params.memory_size);
+    mem_init(params.memory_size);
+    pthread_t threads[params.num_threads];
+    my_barrier_init(&barrier, params.num_threads);
+    thread_data_t params_t[params.num_threads];
+
+    // Create threads to run the test function concurrently
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        params_t[i].thread_id = i;
+        params_t[i].block_size = params.memory_size / params.num_threads;
+        int rc = pthread_create(&threads[i], NULL, (void *(*)(void *))test_func, &params_t[i]);
+        my_assert(rc == 0); // Ensure thread creation was successful
+    }
+
+    // Wait for all threads to complete
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    mem_deinit();
+    my_barrier_destroy(&barrier);
+    printf_green("[PASS].\n");
+}
+
+void sanityCheck(size_t size, char *block, char expected_value)
+{
+    if (block == NULL)
+        return;
+
+    for (int i = 0; i < size; ++i)
+    {
+        my_assert(block[i] == expected_value);
+    }
+}
+
+void *test_alloc_and_free(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+
+    // Allocate and fill two blocks of memory with unique patterns
+    size_t block1_size = data->block_size / 4;
+    char *block1 = (char *)mem_alloc(block1_size);
+    my_assert(block1 != NULL);
+    memset(block1, data->thread_id, block1_size); // Unique pattern using thread_id
+
+    size_t block2_size = block1_size * 3; // Corrected from undefined block2_size variable
+    char *block2 = (char *)mem_alloc(block2_size);
+    my_assert(block2 != NULL);
+    memset(block2, data->thread_id + block1_size, block2_size); // Another unique pattern offset by 100
+
+    my_barrier_wait(&barrier); // Assuming barrier is defined somewhere globally
+
+    // Check integrity of the data before freeing
+    sanityCheck(block1_size, block1, data->thread_id);
+    sanityCheck(block2_size, block2, data->thread_id + block1_size);
+
+    mem_free(block1);
+    mem_free(block2);
+
+    return NULL;
+}
+
+void *test_zero_alloc_and_free(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+
+    void *block1 = mem_alloc(0);
+    my_assert(block1 != NULL);
+    void *block2 = mem_alloc(200);
+    my_assert(block2 != NULL);
+
+    memset(block2, data->thread_id, 200); // Unique pattern using thread_id
+
+    my_barrier_wait(&barrier);
+
+    sanityCheck(200, block2, data->thread_id);
+
+    mem_free(block1);
+    mem_free(block2);
+
+    return NULL;
+}
+
+/*
+ * This function is used to test the allocation of random blocks of memory and then freeing them in a multithreading context.
+ * The test passes if all allocations and deallocations are successful.
+ */
+
+void *thread_alloc_free(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    int block_size;
+
+    // Allocation phase
+    for (int i = 0; i < data->num_blocks; i++)
+    {
+        block_size = rand() % data->max_block_size;
+        data->block_pointers[i] = mem_alloc(block_size);
+        my_assert(data->block_pointers[i] != NULL); // Make sure the allocation was successful
+    }
+
+    // De-allocation phase
+    for (int i = 0; i < data->num_blocks; i++)
+    {
+        mem_free(data->block_pointers[i]);
+    }
+
+    return NULL;
+}
+
+void test_random_blocks_multithread(TestParams params)
+{
+    printf_yellow("  Testing \"mem_alloc\" and mem_free for random blocks (threads: %d, max_block_size: %zu) ---> ", params.num_threads, params.block_size);
+    srand(time(NULL)); // Initialize random seed
+
+    int total_blocks = 1000 + rand() % 10000;
+    int mem_size = total_blocks * params.block_size;
+
+    mem_init(mem_size);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    void *block_pointers[total_blocks]; // Array to hold pointers to allocated blocks
+
+    // Prepare thread data
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].num_blocks = total_blocks / params.num_threads;
+        thread_data[i].max_block_size = params.block_size;
+        thread_data[i].block_pointers = &block_pointers[i * thread_data[i].num_blocks];
+    }
+
+    // Launch threads
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_create(&threads[i], NULL, thread_alloc_free, &thread_data[i]);
+    }
+
+    // Wait for all threads to finish
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    mem_deinit(); // Clean up memory manager after all operations
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function is used to test freeing blocks that were allocated by another thread.
+ * Every thread allocates its blocks, then frees the blocks of its neighbour while allocating
+ * and freeing on its own, so that frees meet a held lock and go through the remote-free queue.
+ * The test passes if the pool is empty at the end.
+ */
+void *thread_cross_free(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    thread_data_t *neighbour = data - data->thread_id + (data->thread_id + 1) % data->iterations;
+
+    for (int i = 0; i < data->num_blocks; i++)
+    {
+        data->block_pointers[i] = mem_alloc(data->block_size);
+        my_assert(data->block_pointers[i] != NULL);
+    }
+
+    my_barrier_wait(&barrier);
+
+    for (int i = 0; i < neighbour->num_blocks; i++)
+    {
+        mem_free(neighbour->block_pointers[i]);
+        void *block = mem_alloc(data->block_size);
+        my_assert(block != NULL);
+        mem_free(block);
+    }
+
+    return NULL;
+}
+
+void test_cross_thread_free_multithread(TestParams params)
+{
+    printf_yellow("  Testing \"mem_free\" of blocks from other threads (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    void *block_pointers[params.num_threads * params.num_blocks];
+    struct MemStats stats;
+
+    mem_init(params.num_threads * (params.num_blocks + 1) * params.block_size);
+    my_barrier_init(&barrier, params.num_threads);
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].iterations = params.num_threads; // Used to find the neighbour
+        thread_data[i].num_blocks = params.num_blocks;
+        thread_data[i].block_size = params.block_size;
+        thread_data[i].block_pointers = &block_pointers[i * params.num_blocks];
+        pthread_create(&threads[i], NULL, thread_cross_free, &thread_data[i]);
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    mem_stats(&stats);
+    my_assert(stats.used_bytes == 0);
+    my_assert(stats.num_blocks == 0);
+    my_assert(stats.num_frees == stats.num_allocs);
+
+    mem_deinit();
+    my_barrier_destroy(&barrier);
+    printf_green("[PASS].\n");
+}
+
+/*
+ * This function is used to test the lock policies of the memory manager.
+ * Every thread allocates, fills, checks and frees blocks under each policy that is
+ * safe with several threads. The test passes if no data is overwritten and the pool is empty at the end.
+ */
+void *thread_fill_and_check(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+
+    for (int i = 0; i < data->iterations; i++)
+    {
+        char *block = mem_alloc(data->block_size);
+        my_assert(block != NULL);
+        if (block == NULL)
+            continue;
+
+        memset(block, data->thread_id, data->block_size);
+        sched_yield();
+        sanityCheck(data->block_size, block, data->thread_id);
+        mem_free(block);
+    }
+
+    return NULL;
+}
+
+void test_lock_policies_multithread(TestParams params)
+{
+    enum MemLockPolicy policies[] = {MEM_LOCK_SPIN, MEM_LOCK_FUTEX, MEM_LOCK_MUTEX};
+    const char *names[] = {"spin", "futex", "mutex"};
+
+    for (int p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+    {
+        printf_yellow("  Testing lock policy \"%s\" (threads: %d) ---> ", names[p], params.num_threads);
+
+        pthread_t threads[params.num_threads];
+        thread_data_t thread_data[params.num_threads];
+        struct MemStats stats;
+
+        mem_init_config(&(struct MemConfig){.size = params.num_threads * params.block_size, .lock_policy = policies[p]});
+
+        for (int i = 0; i < params.num_threads; i++)
+        {
+            thread_data[i].thread_id = i;
+            thread_data[i].block_size = params.block_size;
+            thread_data[i].iterations = params.iterations;
+            pthread_create(&threads[i], NULL, thread_fill_and_check, &thread_data[i]);
+        }
+
+        for (int i = 0; i < params.num_threads; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        mem_stats(&stats);
+        my_assert(stats.used_bytes == 0);
+        my_assert(stats.alloc_failures == 0);
+
+        mem_deinit();
+        printf_green("[PASS].\n");
+    }
+}
+
+/*
+ * Each thread repeatedly callocs a block, checks that it is zero, dirties it and frees it,
+ * so later callocs reuse memory that has to be cleared.
+ */
+void *thread_calloc_and_check(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+
+    for (int i = 0; i < data->iterations; i++)
+    {
+        unsigned char *block = mem_calloc(data->block_size / 8, 8);
+        if (!block)
+            continue;
+
+        for (size_t j = 0; j < data->block_size; j++)
+            my_assert(block[j] == 0);
+
+        memset(block, data->thread_id + 1, data->block_size);
+        mem_free(block);
+    }
+
+    return NULL;
+}
+
+void test_calloc_multithread(TestParams params)
+{
+    printf_yellow("  Testing mem_calloc (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    struct MemStats stats;
+
+    mem_init(params.num_threads * params.block_size);
+
+    // num * size overflowing must fail instead of allocating a short block
+    my_assert(mem_calloc((size_t)-1, 2) == NULL);
+
+    // A fresh pool has never been touched, so nothing needs clearing
+    void *fresh = mem_calloc(params.num_threads, params.block_size);
+    my_assert(fresh != NULL);
+    mem_stats(&stats);
+    my_assert(stats.calloc_skipped == params.num_threads * params.block_size);
+    memset(fresh, 0xFF, params.num_threads * params.block_size);
+    mem_free(fresh);
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = params.block_size;
+        thread_data[i].iterations = params.iterations;
+        pthread_create(&threads[i], NULL, thread_calloc_and_check, &thread_data[i]);
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    mem_stats(&stats);
+    my_assert(stats.used_bytes == 0);
+    mem_deinit();
+
+    // On a full pool an empty block goes to the end of the pool
+    mem_init(params.block_size);
+    void *full = mem_calloc(1, params.block_size);
+    my_assert(full != NULL);
+    void *empty = mem_calloc(0, 16);
+    my_assert(empty == (char *)full + params.block_size);
+    mem_free(empty);
+    mem_free(full);
+    mem_stats(&stats);
+    my_assert(stats.used_bytes == 0 && stats.num_blocks == 0);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Each thread allocates a block in the file pool, fills it with its id and
+ * stores the offset of the block in the root block.
+ */
+void *thread_fill_file_pool(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    size_t *offsets = mem_root();
+
+    void *block = mem_alloc(data->block_size);
+    my_assert(block != NULL);
+    memset(block, data->thread_id + 1, data->block_size);
+    offsets[data->thread_id] = mem_offset(block);
+
+    return NULL;
+}
+
+void test_file_pool_restart_multithread(TestParams params)
+{
+    printf_yellow("  Testing file pool restart (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    struct MemStats stats;
+    char path[] = "/tmp/mem_poolXXXXXX";
+    size_t pool_size = params.num_threads * (params.block_size + sizeof(size_t));
+
+    close(mkstemp(path));
+    my_assert(mem_init_file(path, pool_size));
+    my_assert(mem_root() == NULL);
+
+    // The root block holds the offsets of the thread blocks, it counts from the next checkpoint
+    void *root = mem_alloc(params.num_threads * sizeof(size_t));
+    mem_set_root(root);
+    my_assert(mem_root() == NULL);
+    my_assert(mem_checkpoint());
+    my_assert(mem_root() == root);
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = params.block_size;
+        pthread_create(&threads[i], NULL, thread_fill_file_pool, &thread_data[i]);
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Free the first thread's block so the reopened pool has a gap to reuse
+    size_t *offsets = mem_root();
+    size_t gap = offsets[0];
+    mem_free(mem_ptr(gap));
+    mem_deinit();
+
+    // A different size does not match the checkpoint
+    my_assert(!mem_init_file(path, pool_size * 2));
+
+    my_assert(mem_init_file(path, pool_size));
+    offsets = mem_root();
+    my_assert(offsets != NULL);
+    for (int i = 1; i < params.num_threads; i++)
+    {
+        unsigned char *block = mem_ptr(offsets[i]);
+        for (size_t j = 0; j < params.block_size; j++)
+            my_assert(block[j] == i + 1);
+    }
+
+    mem_stats(&stats);
+    my_assert(stats.num_blocks == params.num_threads);
+    my_assert(stats.used_bytes == pool_size - params.block_size);
+    my_assert(mem_alloc(params.block_size) == mem_ptr(gap));
+
+    size_t root_offset = mem_offset(offsets);
+    mem_deinit();
+
+    // A root set after the last checkpoint is lost in a crash, the reopened
+    // pool has the root of the checkpoint
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (!mem_init_file(path, pool_size)) _exit(1);
+        mem_set_root(NULL);
+        _exit(0);
+    }
+    int status;
+    my_assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    my_assert(mem_init_file(path, pool_size));
+    my_assert(mem_root() == mem_ptr(root_offset));
+    mem_deinit();
+
+    // A record that reaches past the pool, under a checksum that matches,
+    // leaves the reopened pool empty. The root record comes first, then the
+    // root block, the thread blocks and the block that filled the gap.
+    uint64_t header[8], records[2 * (params.num_threads + 2)];
+    size_t records_bytes = sizeof(records);
+    int fd = open(path, O_RDWR);
+    my_assert(pread(fd, header, sizeof(header), 0) == sizeof(header) && header[6] == (uint64_t)params.num_threads + 1);
+    my_assert(pread(fd, records, records_bytes, header[5]) == (ssize_t)records_bytes);
+    records[3] = 2 * pool_size;
+    header[7] = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < records_bytes; i++)
+        header[7] = (header[7] ^ ((unsigned char *)records)[i]) * 0x100000001b3ULL;
+    my_assert(pwrite(fd, records, records_bytes, header[5]) == (ssize_t)records_bytes);
+    my_assert(pwrite(fd, header, sizeof(header), 0) == sizeof(header));
+    close(fd);
+
+    my_assert(mem_init_file(path, pool_size));
+    mem_stats(&stats);
+    my_assert(stats.num_blocks == 0 && stats.used_bytes == 0);
+    my_assert(mem_root() == NULL);
+    my_assert(mem_alloc(pool_size) != NULL);
+    mem_deinit();
+
+    // So does a file cut short of its pool
+    my_assert(truncate(path, sysconf(_SC_PAGESIZE)) == 0);
+    my_assert(mem_init_file(path, pool_size));
+    mem_stats(&stats);
+    my_assert(stats.num_blocks == 0 && mem_root() == NULL);
+    my_assert(mem_alloc(pool_size) != NULL);
+    mem_deinit();
+
+    unlink(path);
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Child processes attach to a named shared pool, each frees the block the parent
+ * allocated for it and allocates its own, which the parent frees afterwards.
+ */
+void test_shm_pool_multiprocess(TestParams params)
+{
+    printf_yellow("  Testing shared pool across processes (processes: %d) ---> ", params.num_threads);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/mem_shm_test_%d", getpid());
+    struct MemStats stats;
+
+    struct MemShm *shm = mem_shm_create(name, 2 * params.num_threads * (params.block_size + 64));
+    my_assert(shm != NULL);
+
+    // Offsets of the blocks handed between the processes, parent's then children's
+    size_t *offsets = mem_shm_alloc(shm, 2 * params.num_threads * sizeof(size_t));
+    my_assert(offsets != NULL);
+    for (int i = 0; i < params.num_threads; i++)
+        offsets[i] = mem_shm_offset(shm, mem_shm_alloc(shm, params.block_size));
+
+    pid_t pids[params.num_threads];
+    size_t table = mem_shm_offset(shm, offsets);
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+        {
+            struct MemShm *child = mem_shm_open(name);
+            if (!child)
+                _exit(1);
+            size_t *shared = mem_shm_ptr(child, table);
+
+            mem_shm_free(child, mem_shm_ptr(child, shared[i]));
+
+            unsigned char *block = mem_shm_alloc(child, params.block_size);
+            if (!block)
+                _exit(1);
+            memset(block, i + 1, params.block_size);
+            shared[params.num_threads + i] = mem_shm_offset(child, block);
+
+            mem_shm_close(child);
+            _exit(0);
+        }
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        int status;
+        waitpid(pids[i], &status, 0);
+        my_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    // The children's blocks are intact and can be freed here
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        unsigned char *block = mem_shm_ptr(shm, offsets[params.num_threads + i]);
+        for (size_t j = 0; j < params.block_size; j++)
+            my_assert(block[j] == i + 1);
+        mem_shm_free(shm, block);
+    }
+
+    // Sizes that wrap when rounded are refused, and so is an object that can not be examined
+    my_assert(mem_shm_alloc(shm, SIZE_MAX) == NULL);
+    my_assert(mem_shm_alloc(shm, SIZE_MAX - 8) == NULL);
+    my_assert(mem_shm_create(NULL, SIZE_MAX) == NULL);
+    my_assert(mem_shm_open_fd(-1) == NULL);
+
+    mem_shm_stats(shm, &stats);
+    my_assert(stats.num_blocks == 1);
+    my_assert(stats.used_bytes == 2 * params.num_threads * sizeof(size_t));
+    my_assert(stats.num_frees == 2 * params.num_threads);
+
+    mem_shm_close(shm);
+    mem_shm_unlink(name);
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Each thread fills its own arena with blocks of growing size until it spills
+ * into more chunks, checks the blocks and resets the arena.
+ */
+void *thread_arena(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    struct MemArena *arena = mem_arena_create(data->block_size);
+    my_assert(arena != NULL);
+
+    void *first = NULL;
+    for (int i = 0; i < data->iterations; i++)
+    {
+        unsigned char *blocks[data->num_blocks];
+        for (int j = 0; j < data->num_blocks; j++)
+        {
+            blocks[j] = mem_arena_alloc(arena, j + 1);
+            my_assert(blocks[j] != NULL);
+            my_assert((uintptr_t)blocks[j] % MEM_ARENA_ALIGN == 0);
+            memset(blocks[j], data->thread_id + j, j + 1);
+        }
+
+        for (int j = 0; j < data->num_blocks; j++)
+            sanityCheck(j + 1, (char *)blocks[j], (char)(data->thread_id + j));
+
+        // After a reset the arena starts over at the same address
+        if (first)
+            my_assert(blocks[0] == first);
+        first = blocks[0];
+        mem_arena_reset(arena);
+    }
+
+    mem_arena_destroy(arena);
+    return NULL;
+}
+
+void test_arena_multithread(TestParams params)
+{
+    printf_yellow("  Testing arenas (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    struct MemStats stats;
+
+    mem_init(params.memory_size);
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = params.block_size;
+        thread_data[i].num_blocks = params.num_blocks;
+        thread_data[i].iterations = params.iterations;
+        pthread_create(&threads[i], NULL, thread_arena, &thread_data[i]);
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    // The chunks are kept across resets, so only the first round allocates from the pool
+    mem_stats(&stats);
+    my_assert(stats.used_bytes == 0);
+    my_assert(stats.num_allocs == stats.num_frees);
+    my_assert(stats.num_allocs < (size_t)params.num_threads * params.num_blocks);
+
+    // Sizes that wrap when rounded are refused, and the next block is still apart from the last
+    struct MemArena *arena = mem_arena_create(params.block_size);
+    my_assert(arena != NULL);
+    char *before = mem_arena_alloc(arena, 16);
+    my_assert(mem_arena_alloc(arena, SIZE_MAX) == NULL);
+    my_assert(mem_arena_alloc(arena, SIZE_MAX - 3) == NULL);
+    my_assert(mem_arena_alloc(arena, SIZE_MAX - 2 * MEM_ARENA_ALIGN) == NULL);
+    my_assert(mem_arena_alloc(arena, 16) == before + 16);
+    mem_arena_destroy(arena);
+    my_assert(mem_arena_create(SIZE_MAX - 8) == NULL);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Recursive descent on the thread's stack, each level allocates scratch memory,
+ * recurses and checks that the deeper levels did not touch it.
+ */
+static void stack_descend(int depth, int max_depth, char value)
+{
+    struct MemStackMark mark = mem_stack_mark();
+    size_t size = 16 * (depth + 1);
+
+    char *scratch = mem_stack_alloc(size + depth % 3);
+    my_assert(scratch != NULL);
+    my_assert((uintptr_t)scratch % MEM_STACK_ALIGN == 0);
+    memset(scratch, value + depth, size);
+
+    if (depth < max_depth)
+        stack_descend(depth + 1, max_depth, value);
+
+    sanityCheck(size, scratch, value + depth);
+    mem_stack_release(mark);
+}
+
+void *thread_stack(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    my_assert(mem_stack_init(data->block_size));
+
+    struct MemStackMark start = mem_stack_mark();
+    for (int i = 0; i < data->iterations; i++)
+    {
+        stack_descend(0, data->num_blocks, data->thread_id);
+
+        // Everything was released, the stack is back where it started
+        struct MemStackMark end = mem_stack_mark();
+        my_assert(end.top == start.top && end.overflow == NULL);
+    }
+
+    mem_stack_deinit();
+    return NULL;
+}
+
+void test_stack_multithread(TestParams params)
+{
+    printf_yellow("  Testing mark/release stacks (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    struct MemStats stats;
+
+    mem_init(params.memory_size);
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = params.block_size;
+        thread_data[i].num_blocks = params.num_blocks;
+        thread_data[i].iterations = params.iterations;
+        pthread_create(&threads[i], NULL, thread_stack, &thread_data[i]);
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    // The recursion is deeper than the segments, so some blocks came from mem_alloc
+    mem_stats(&stats);
+    my_assert(stats.used_bytes == 0);
+    my_assert(stats.num_allocs > (size_t)params.num_threads);
+
+    // Without a segment the blocks come from the pool, aligned, zero sizes too
+    struct MemStackMark mark = mem_stack_mark();
+    for (size_t size = 0; size < 40; size += 3)
+    {
+        char *block = mem_stack_alloc(size);
+        my_assert(block != NULL);
+        my_assert((uintptr_t)block % MEM_STACK_ALIGN == 0);
+    }
+    my_assert(mem_stack_alloc(SIZE_MAX) == NULL);
+    my_assert(mem_stack_alloc(SIZE_MAX - 8) == NULL);
+    my_assert(!mem_stack_init(SIZE_MAX));
+    my_assert(!mem_stack_init(SIZE_MAX - 8));
+    my_assert(mem_stack_alloc(64) != NULL);
+    mem_stack_release(mark);
+    mem_stats(&stats);
+    my_assert(stats.used_bytes == 0);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+// Checks that the parts of a map add up
+static void check_map(const struct MemMap *map)
+{
+    size_t extents = 0;
+    for (int bucket = 0; bucket < MEM_MAP_BUCKETS; bucket++)
+    {
+        extents += map->extent_counts[bucket];
+    }
+
+    my_assert(extents == map->num_extents);
+    my_assert(map->used_bytes + map->free_bytes == map->pool_size);
+    my_assert(map->largest_free <= map->free_bytes);
+    my_assert(map->num_cells * map->cell_bytes >= map->pool_size);
+}
+
+/*
+ * Each thread keeps blocks alive with holes between them while taking maps
+ * of the pool, which must be consistent however the other threads move on.
+ */
+void *thread_map(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    void *blocks[data->num_blocks];
+    struct MemMap map;
+
+    for (int i = 0; i < data->iterations; i++)
+    {
+        for (int j = 0; j < data->num_blocks; j++)
+        {
+            blocks[j] = mem_alloc(data->block_size);
+            my_assert(blocks[j] != NULL);
+        }
+        for (int j = 0; j < data->num_blocks; j += 2)
+        {
+            mem_free(blocks[j]);
+        }
+
+        my_assert(mem_map(&map, 128));
+        check_map(&map);
+        my_assert(map.num_cells == 128);
+
+        for (int j = 1; j < data->num_blocks; j += 2)
+        {
+            mem_free(blocks[j]);
+        }
+    }
+
+    return NULL;
+}
+
+void test_map_multithread(TestParams params)
+{
+    printf_yellow("  Testing mem_map (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    struct MemMap map;
+    struct MemStats stats;
+
+    // Eight blocks with every other one freed, four free extents of a cell each
+    mem_init(8 * params.block_size);
+    void *blocks[8];
+    for (int i = 0; i < 8; i++)
+    {
+        blocks[i] = mem_alloc(params.block_size);
+        my_assert(blocks[i] != NULL);
+    }
+    for (int i = 1; i < 8; i += 2)
+    {
+        mem_free(blocks[i]);
+    }
+
+    my_assert(mem_map(&map, 8));
+    check_map(&map);
+    my_assert(map.cell_bytes == params.block_size);
+    for (int i = 0; i < 8; i++)
+    {
+        my_assert(map.fill[i] == (i % 2 ? 0 : 100));
+    }
+    my_assert(map.num_extents == 4);
+    my_assert(map.extent_counts[__builtin_ctzl(params.block_size)] == 4);
+    my_assert(map.largest_free == params.block_size);
+    my_assert(map.fragmentation == 0.75);
+
+    // The heatmap shows used cells as '@' and free ones as ' '
+    char text[4096];
+    FILE *out = fmemopen(text, sizeof(text), "w");
+    mem_map_print(&map, out, false);
+    fclose(out);
+    my_assert(strstr(text, "|@ @ @ @ |") != NULL);
+
+    out = fmemopen(text, sizeof(text), "w");
+    mem_map_print(&map, out, true);
+    fclose(out);
+    my_assert(strstr(text, "\"fill\": [100, 0, 100, 0, 100, 0, 100, 0]") != NULL);
+    my_assert(strstr(text, "\"num_extents\": 4") != NULL);
+    mem_deinit();
+
+    // No pool, no map
+    my_assert(!mem_map(&map, 0));
+
+    mem_init(params.num_threads * params.num_blocks * params.block_size);
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = params.block_size;
+        thread_data[i].iterations = params.iterations;
+        thread_data[i].num_blocks = params.num_blocks;
+        pthread_create(&threads[i], NULL, thread_map, &thread_data[i]);
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Agrees with mem_stats once the pool is empty again
+    my_assert(mem_map(&map, 0));
+    check_map(&map);
+    mem_stats(&stats);
+    my_assert(map.num_cells == 256);
+    my_assert(map.free_bytes == stats.free_bytes);
+    my_assert(map.largest_free == stats.largest_free);
+    my_assert(map.num_extents == 1);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Each thread allocates small blocks and frees them out of order, so that
+ * blocks are inserted into and removed from the middle of the block table.
+ */
+void *thread_small_blocks(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    char *blocks[data->num_blocks];
+
+    for (int i = 0; i < data->iterations; i++)
+    {
+        for (int j = 0; j < data->num_blocks; j++)
+        {
+            blocks[j] = mem_alloc(data->block_size);
+            my_assert(blocks[j] != NULL);
+            memset(blocks[j], data->thread_id + j, data->block_size);
+        }
+
+        for (int j = 0; j < data->num_blocks; j += 2)
+        {
+            sanityCheck(data->block_size, blocks[j], data->thread_id + j);
+            mem_free(blocks[j]);
+        }
+        for (int j = 1; j < data->num_blocks; j += 2)
+        {
+            sanityCheck(data->block_size, blocks[j], data->thread_id + j);
+            mem_free(blocks[j]);
+        }
+    }
+
+    return NULL;
+}
+
+void test_block_table_multithread(TestParams params)
+{
+    printf_yellow("  Testing the block table (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    struct MemStats stats;
+
+    // Offsets and sizes are 32 bits, larger pools are refused
+    if (sizeof(size_t) > 4)
+    {
+        mem_init((size_t)MEM_POOL_MAX_SIZE + 1);
+        mem_stats(&stats);
+        my_assert(stats.pool_size == 0);
+        my_assert(mem_alloc(1) == NULL);
+    }
+
+    mem_init(params.num_threads * params.num_blocks * params.block_size);
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = params.block_size;
+        thread_data[i].iterations = params.iterations;
+        thread_data[i].num_blocks = params.num_blocks;
+        pthread_create(&threads[i], NULL, thread_small_blocks, &thread_data[i]);
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Every block costs 8 bytes of metadata, twice that while the table has room to grow
+    mem_stats(&stats);
+    my_assert(stats.num_blocks == 0);
+    my_assert(stats.used_bytes == 0);
+    my_assert(stats.alloc_failures == 0);
+    my_assert(stats.peak_blocks > 0 && stats.peak_blocks <= (size_t)params.num_threads * params.num_blocks);
+    my_assert(stats.metadata_bytes >= 8 * stats.peak_blocks);
+    my_assert(stats.metadata_bytes <= 16 * stats.peak_blocks || stats.metadata_bytes <= 8 * 64);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Each thread allocates blocks of varied sizes and frees every third one, the
+ * rest stay in block_pointers for the caller to check and free.
+ */
+void *thread_gaps(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+
+    for (int i = 0; i < data->num_blocks; i++)
+    {
+        size_t size = data->block_size * (1 + (i * 7 + data->thread_id) % 5);
+        data->block_pointers[i] = i % 4 ? mem_alloc(size) : mem_alloc_aligned(size, 64);
+        my_assert(data->block_pointers[i] != NULL);
+        my_assert(i % 4 || (uintptr_t)data->block_pointers[i] % 64 == 0);
+    }
+
+    for (int i = 0; i < data->num_blocks; i += 3)
+    {
+        mem_free(data->block_pointers[i]);
+        data->block_pointers[i] = NULL;
+    }
+
+    return NULL;
+}
+
+void test_gap_index_multithread(TestParams params)
+{
+    printf_yellow("  Testing the gap index (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    void *pointers[params.num_threads][params.num_blocks];
+    struct MemStats stats;
+    struct MemMap map;
+
+    // Gaps of 3, 1, 5, 2, 8 and 4 blocks, far apart in the pool
+    size_t block = params.block_size;
+    int gaps[] = {3, 1, 5, 2, 8, 4};
+    mem_init(64 * 16 * block);
+    char *blocks[64 * 16];
+    for (int i = 0; i < 64 * 16; i++)
+    {
+        blocks[i] = mem_alloc(block);
+        my_assert(blocks[i] != NULL);
+    }
+    for (int g = 0; g < 6; g++)
+    {
+        for (int i = 0; i < gaps[g]; i++)
+        {
+            mem_free(blocks[g * 128 + 64 + i]);
+        }
+    }
+
+    // First fit, the lowest gap that is large enough
+    mem_stats(&stats);
+    my_assert(stats.largest_free == 8 * block);
+    my_assert(mem_alloc(4 * block) == blocks[2 * 128 + 64]);
+    my_assert(mem_alloc(6 * block) == blocks[4 * 128 + 64]);
+    my_assert(mem_alloc(2 * block) == blocks[0 * 128 + 64]);
+    my_assert(mem_alloc(4 * block) == blocks[5 * 128 + 64]);
+    my_assert(mem_alloc(9 * block) == NULL);
+    mem_stats(&stats);
+    my_assert(stats.largest_free == 2 * block);
+    mem_deinit();
+
+    mem_init(params.num_threads * params.num_blocks * block * 5 * 2);
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = block;
+        thread_data[i].num_blocks = params.num_blocks;
+        thread_data[i].block_pointers = pointers[i];
+        pthread_create(&threads[i], NULL, thread_gaps, &thread_data[i]);
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    // The index agrees with a walk over the blocks
+    mem_stats(&stats);
+    my_assert(mem_map(&map, 0));
+    my_assert(stats.largest_free == map.largest_free);
+    my_assert(stats.free_bytes == map.free_bytes);
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        for (int j = 0; j < params.num_blocks; j++)
+        {
+            if (pointers[i][j]) mem_free(pointers[i][j]);
+        }
+    }
+
+    mem_stats(&stats);
+    my_assert(stats.used_bytes == 0);
+    my_assert(stats.largest_free == stats.pool_size);
+
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+void test_placement_multithread(TestParams params)
+{
+    printf_yellow("  Testing the placement policies (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    struct MemStats stats;
+
+    // Gaps of 3, 1, 5, 2, 8 and 4 blocks, and where each policy places two
+    // blocks, two more and then one, as the gap and the block within it
+    size_t block = params.block_size;
+    int gaps[] = {3, 1, 5, 2, 8, 4};
+    int sizes[] = {2, 2, 1};
+    int picks[][3][2] = {
+        [MEM_FIT_FIRST] = {{0, 0}, {2, 0}, {0, 2}},
+        [MEM_FIT_NEXT] = {{0, 0}, {2, 0}, {2, 2}},
+        [MEM_FIT_BEST] = {{3, 0}, {0, 0}, {0, 2}},
+        [MEM_FIT_WORST] = {{4, 0}, {4, 2}, {2, 0}},
+    };
+    for (int policy = MEM_FIT_FIRST; policy <= MEM_FIT_WORST; policy++)
+    {
+        mem_init_config(&(struct MemConfig){.size = 6 * 128 * block, .placement = policy});
+        char *blocks[6 * 128];
+        for (int i = 0; i < 6 * 128; i++)
+        {
+            blocks[i] = mem_alloc(block);
+            my_assert(blocks[i] != NULL);
+        }
+        for (int g = 0; g < 6; g++)
+        {
+            for (int i = 0; i < gaps[g]; i++)
+            {
+                mem_free(blocks[g * 128 + 64 + i]);
+            }
+        }
+
+        for (int i = 0; i < 3; i++)
+        {
+            my_assert(mem_alloc(sizes[i] * block) == blocks[picks[policy][i][0] * 128 + 64 + picks[policy][i][1]]);
+        }
+        mem_deinit();
+    }
+
+    // Blocks of every thread stay intact under each policy
+    for (int policy = MEM_FIT_FIRST; policy <= MEM_FIT_WORST; policy++)
+    {
+        mem_init_config(&(struct MemConfig){.size = params.num_threads * params.num_blocks * block, .placement = policy});
+        for (int i = 0; i < params.num_threads; i++)
+        {
+            thread_data[i].thread_id = i;
+            thread_data[i].block_size = block;
+            thread_data[i].iterations = params.iterations;
+            thread_data[i].num_blocks = params.num_blocks;
+            pthread_create(&threads[i], NULL, thread_small_blocks, &thread_data[i]);
+        }
+
+        for (int i = 0; i < params.num_threads; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        mem_stats(&stats);
+        my_assert(stats.used_bytes == 0);
+        my_assert(stats.alloc_failures == 0);
+        mem_deinit();
+    }
+
+    printf_green("[PASS].\n");
+}
+
+void test_maint_multithread(TestParams params)
+{
+    printf_yellow("  Testing the maintenance thread (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    struct MemStats stats;
+    struct MemMap map;
+
+    // It needs a pool with a lock
+    my_assert(!mem_maint_start(50));
+    mem_init_config(&(struct MemConfig){.size = 4096, .lock_policy = MEM_LOCK_NONE});
+    my_assert(!mem_maint_start(50));
+    mem_deinit();
+
+    // Freed space is found before the thread got to it
+    size_t pool_size = params.num_threads * params.num_blocks * params.block_size;
+    mem_init(pool_size);
+    my_assert(mem_maint_start(10));
+    my_assert(!mem_maint_start(10));
+    void *all = mem_alloc(pool_size);
+    my_assert(all != NULL);
+    mem_free(all);
+    my_assert(mem_alloc(pool_size) == all);
+    mem_free(all);
+
+    // The pool is used up completely, no allocation may fail on stale space
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = params.block_size;
+        thread_data[i].iterations = params.iterations;
+        thread_data[i].num_blocks = params.num_blocks;
+        pthread_create(&threads[i], NULL, thread_small_blocks, &thread_data[i]);
+    }
+    mem_maint_set_duty(100);
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    usleep(5000);
+
+    mem_stats(&stats);
+    my_assert(stats.num_blocks == 0);
+    my_assert(stats.alloc_failures == 0);
+    my_assert(stats.maint_slices > 0);
+    my_assert(mem_map(&map, 0));
+    my_assert(stats.largest_free == map.largest_free);
+
+    mem_maint_stop();
+    mem_stats(&stats);
+    my_assert(stats.largest_free == stats.pool_size);
+
+    // mem_deinit stops a running thread
+    my_assert(mem_maint_start(1));
+    mem_deinit();
+
+    // So does setting up a new pool, which starts empty with an up to date gap index
+    mem_init(pool_size);
+    my_assert(mem_maint_start(1));
+    my_assert(mem_alloc(params.block_size) != NULL && mem_alloc(params.block_size) != NULL);
+    mem_init(pool_size);
+    mem_stats(&stats);
+    my_assert(stats.maint_slices == 0 && stats.largest_free == pool_size);
+    my_assert(stats.num_blocks == 0 && stats.used_bytes == 0);
+    all = mem_alloc(pool_size);
+    my_assert(all != NULL);
+    mem_free(all);
+    my_assert(mem_maint_start(1));
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+struct walk_check
+{
+    char *end;
+    size_t blocks;
+    size_t bytes;
+    size_t limit;
+};
+
+// Checks that the blocks come in address order, inside the pool and apart
+static bool check_walk(const struct MemBlock *block, void *ctx)
+{
+    struct walk_check *check = ctx;
+    my_assert((char *)block->ptr >= (char *)MemPool.ptr);
+    my_assert((char *)block->ptr + block->size <= (char *)MemPool.ptr + MemPool.size);
+    my_assert(!check->end || (char *)block->ptr >= check->end);
+    check->end = (char *)block->ptr + block->size;
+    check->blocks++;
+    check->bytes += block->size;
+    return check->blocks < check->limit;
+}
+
+static volatile bool walk_done;
+
+void *thread_walk(void *arg)
+{
+    size_t *walks = arg;
+    while (!walk_done)
+    {
+        struct walk_check check = {.limit = SIZE_MAX};
+        my_assert(mem_walk(check_walk, &check) == check.blocks);
+        (*walks)++;
+    }
+    return NULL;
+}
+
+void test_walk_multithread(TestParams params)
+{
+    printf_yellow("  Testing the block walk (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    pthread_t walker;
+    size_t walks = 0;
+    struct MemStats stats;
+
+    my_assert(mem_walk(check_walk, &(struct walk_check){.limit = SIZE_MAX}) == 0);
+
+    // Walks while the blocks come and go
+    mem_init(params.num_threads * params.num_blocks * params.block_size);
+    walk_done = false;
+    pthread_create(&walker, NULL, thread_walk, &walks);
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = params.block_size;
+        thread_data[i].iterations = params.iterations;
+        thread_data[i].num_blocks = params.num_blocks;
+        pthread_create(&threads[i], NULL, thread_small_blocks, &thread_data[i]);
+    }
+
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    walk_done = true;
+    pthread_join(walker, NULL);
+    my_assert(walks > 0);
+
+    // A walk of a quiet pool agrees with the counters, and stops when told to
+    void *kept[params.num_blocks];
+    for (int i = 0; i < params.num_blocks; i++)
+    {
+        kept[i] = mem_alloc(params.block_size + i);
+        my_assert(kept[i] != NULL);
+    }
+    struct walk_check check = {.limit = SIZE_MAX};
+    my_assert(mem_walk(check_walk, &check) == (size_t)params.num_blocks);
+    mem_stats(&stats);
+    my_assert(check.blocks == stats.num_blocks);
+    my_assert(check.bytes == stats.used_bytes);
+    my_assert(mem_walk(check_walk, &(struct walk_check){.limit = 3}) == 3);
+
+    for (int i = 0; i < params.num_blocks; i++)
+    {
+        mem_free(kept[i]);
+    }
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
+
+/*
+ * Each thread allocates small and kilobyte blocks, grows every other one with
+ * mem_resize_sized and frees them all with mem_free_sized.
+ */
+void *thread_sized(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    unsigned int seed = data->thread_id;
+
+    for (int i = 0; i < data->iterations; i++)
+    {
+        char *blocks[data->num_blocks];
+        size_t sizes[data->num_blocks];
+        for (int j = 0; j < data->num_blocks; j++)
+        {
+            sizes[j] = rand_r(&seed) % 2 ? 20 + rand_r(&seed) % 13 : 1000 + rand_r(&seed) % 25;
+            blocks[j] = mem_alloc(sizes[j]);
+            my_assert(blocks[j] != NULL);
+            memset(blocks[j], data->thread_id + j, sizes[j]);
+        }
+
+        for (int j = 0; j < data->num_blocks; j += 2)
+        {
+            blocks[j] = mem_resize_sized(blocks[j], sizes[j], sizes[j] + 40);
+            my_assert(blocks[j] != NULL);
+            sanityCheck(sizes[j], blocks[j], data->thread_id + j);
+            sizes[j] += 40;
+            memset(blocks[j], data->thread_id + j, sizes[j]);
+        }
+
+        for (int j = 0; j < data->num_blocks; j++)
+        {
+            sanityCheck(sizes[j], blocks[j], data->thread_id + j);
+            mem_free_sized(blocks[j], sizes[j]);
+        }
+    }
+
+    return NULL;
+}
+
+void test_sized_free_multithread(TestParams params)
+{
+    printf_yellow("  Testing sized free and resize (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    struct MemStats stats;
+
+    // Without and with size classes
+    for (int autotune = 0; autotune < 2; autotune++)
+    {
+        mem_init_config(&(struct MemConfig){.size = params.memory_size, .autotune = autotune});
+        for (int i = 0; i < params.num_threads; i++)
+        {
+            thread_data[i].thread_id = i;
+            thread_data[i].num_blocks = params.num_blocks;
+            thread_data[i].iterations = params.iterations;
+            pthread_create(&threads[i], NULL, thread_sized, &thread_data[i]);
+        }
+
+        for (int i = 0; i < params.num_threads; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        mem_stats(&stats);
+        my_assert(stats.used_bytes == 0);
+        my_assert(stats.num_allocs == stats.num_frees);
+        my_assert(stats.alloc_failures == 0);
+        my_assert(autotune ? stats.cache_hits > 0 : stats.cache_hits == 0);
+
+        // A block that shrinks within its class stays where it is and is counted at its new size
+        char *block = mem_alloc(stats.num_classes ? stats.class_sizes[0] : 64);
+        my_assert(block != NULL);
+        size_t size = stats.num_classes ? stats.class_sizes[0] : 64;
+        my_assert(mem_resize_sized(block, size, size - 1) == block);
+        mem_stats(&stats);
+        my_assert(stats.used_bytes == size - 1 && stats.num_blocks == 1);
+        mem_free_sized(block, size - 1);
+        mem_stats(&stats);
+        my_assert(stats.used_bytes == 0 && stats.num_blocks == 0);
+
+        mem_deinit();
+    }
+
+    printf_green("[PASS].\n");
+}
+
+static bool use_hints;
+
+/*
+ * Each thread allocates long-lived nodes, kept in block_pointers, between
+ * short-lived scratch buffers of which the last four stay live.
+ */
+void *thread_lifetimes(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    char *scratch[4] = {NULL};
 
-    // If mem_size is 0, we run with single memory size, ie. the function requires a fixes size mem_size
-    if (params.memory_size > 0)
-    {
-        mem_sizes = malloc(sizeof(size_t));
-        mem_sizes[0] = params.memory_size;
-    }
-    else
+    for (int i = 0; i < data->num_blocks; i++)
     {
-        mem_sizes = malloc(4 * sizeof(size_t));
-        mem_sizes[0] = 1024;
-        mem_sizes[1] = 2048;
-        mem_sizes[2] = 4096;
-        mem_sizes[3] = 8192;
-        count = 4;
+        data->block_pointers[i] = use_hints ? mem_alloc_hint(data->block_size, MEM_HINT_LONG) : mem_alloc(data->block_size);
+        my_assert(data->block_pointers[i] != NULL);
+        memset(data->block_pointers[i], data->thread_id + i, data->block_size);
+
+        if (scratch[i % 4]) mem_free(scratch[i % 4]);
+        scratch[i % 4] = use_hints ? mem_alloc_hint(3 * data->block_size, MEM_HINT_SHORT) : mem_alloc(3 * data->block_size);
+        my_assert(scratch[i % 4] != NULL);
+        memset(scratch[i % 4], 0xff, 3 * data->block_size);
     }
 
-    // If iterations is -1 (i.e. not set), we run with single iteration.
-    if (params.iterations > 0)
+    for (int i = 0; i < 4; i++)
     {
-        repetitions = malloc(4 * sizeof(int));
-        repetitions[0] = 10;
-        repetitions[1] = 100;
-        repetitions[2] = 500;
-        repetitions[3] = 1000;
-        rcount = 4;
+        mem_free(scratch[i]);
     }
-    else
+    for (int i = 0; i < data->num_blocks; i++)
     {
-        repetitions = malloc(sizeof(int));
-        repetitions[0] = 1;
+        sanityCheck(data->block_size, data->block_pointers[i], data->thread_id + i);
     }
 
-    // Run the test function for all combinations of num_threads, mem_sizes, and repetitions
-    for (int i = 0; i < sizeof(num_threads) / sizeof(num_threads[0]); i++)
+    return NULL;
+}
+
+void test_hint_multithread(TestParams params)
+{
+    printf_yellow("  Testing lifetime hints (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    void *pointers[params.num_threads][params.num_blocks];
+    struct MemStats stats;
+
+    // Long-lived at the bottom, short-lived at the top, hot ones packed from the middle
+    size_t block = params.block_size;
+    mem_init(64 * block);
+    char *bottom = mem_alloc_hint(block, MEM_HINT_LONG);
+    char *top = mem_alloc_hint(block, MEM_HINT_SHORT);
+    char *hot = mem_alloc_hint(block, MEM_HINT_HOT | MEM_HINT_SHORT);
+    my_assert(bottom == MemPool.ptr);
+    my_assert(top == (char *)MemPool.ptr + 63 * block);
+    my_assert(hot == (char *)MemPool.ptr + 32 * block);
+    my_assert(mem_alloc_hint(block, MEM_HINT_HOT) == hot + block);
+    my_assert(mem_alloc_hint(block, MEM_HINT_LONG) == bottom + block);
+    my_assert(mem_alloc_hint(block, MEM_HINT_SHORT) == top - block);
+    my_assert(mem_alloc_hint(64 * block, MEM_HINT_SHORT) == NULL);
+    mem_deinit();
+
+    // Without hints the freed scratch buffers leave holes between the nodes,
+    // with them the free space stays in one piece
+    for (int hinted = 0; hinted < 2; hinted++)
     {
-        for (int j = 0; j < count; j++)
+        use_hints = hinted;
+        mem_init(params.num_threads * (params.num_blocks + 16) * block);
+        for (int i = 0; i < params.num_threads; i++)
         {
-            for (int z = 0; z < rcount; z++)
+            thread_data[i].thread_id = i;
+            thread_data[i].block_size = block;
+            thread_data[i].num_blocks = params.num_blocks;
+            thread_data[i].block_pointers = pointers[i];
+            pthread_create(&threads[i], NULL, thread_lifetimes, &thread_data[i]);
+        }
+
+        for (int i = 0; i < params.num_threads; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        mem_stats(&stats);
+        my_assert(stats.alloc_failures == 0);
+        my_assert(stats.used_bytes == (size_t)params.num_threads * params.num_blocks * block);
+        my_assert(hinted ? stats.largest_free == stats.free_bytes : stats.largest_free < stats.free_bytes);
+
+        for (int i = 0; i < params.num_threads; i++)
+        {
+            for (int j = 0; j < params.num_blocks; j++)
             {
-                params.num_threads = num_threads[i];
-                params.memory_size = mem_sizes[j];
-                params.iterations = repetitions[z];
-                test_func(params);
+                mem_free(pointers[i][j]);
             }
         }
+        mem_deinit();
     }
 
-    free(mem_sizes);
-    free(repetitions);
+    printf_green("[PASS].\n");
 }
 
-void run_concurrent_test(void *(*test_func)(void *), TestParams params, char *function_name)
+MEM_STATIC_POOL(static_nodes, 24, 256);
+static pthread_mutex_t static_nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Each thread takes blocks from the shared static pool under a lock, fills
+ * them and gives them back, some of them right away.
+ */
+void *thread_static_pool(void *arg)
 {
-    printf_yellow("  Testing \"%s\" (threads: %d, mem_size: %zu) ---> ", function_name, params.num_threads, params.memory_size);
-    mem_init(params.memory_size);
+    thread_data_t *data = (thread_data_t *)arg;
+    char *blocks[data->num_blocks];
+
+    for (int i = 0; i < data->iterations; i++)
+    {
+        for (int j = 0; j < data->num_blocks; j++)
+        {
+            pthread_mutex_lock(&static_nodes_lock);
+            blocks[j] = MEM_STATIC_ALLOC(static_nodes);
+            pthread_mutex_unlock(&static_nodes_lock);
+            my_assert(blocks[j] != NULL && MEM_STATIC_OWNS(static_nodes, blocks[j]));
+            my_assert((uintptr_t)blocks[j] % MEM_STATIC_ALIGN == 0);
+            memset(blocks[j], data->thread_id + j, 24);
+        }
+
+        for (int j = 0; j < data->num_blocks; j++)
+        {
+            sanityCheck(24, blocks[j], data->thread_id + j);
+            pthread_mutex_lock(&static_nodes_lock);
+            MEM_STATIC_FREE(static_nodes, blocks[j]);
+            pthread_mutex_unlock(&static_nodes_lock);
+        }
+    }
+
+    return NULL;
+}
+
+void test_static_pool_multithread(TestParams params)
+{
+    printf_yellow("  Testing static pools (threads: %d) ---> ", params.num_threads);
+
     pthread_t threads[params.num_threads];
-    my_barrier_init(&barrier, params.num_threads);
-    thread_data_t params_t[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
 
-    // Create threads to run the test function concurrently
+    // The threads share the 256 blocks, without a memory manager pool
+    my_assert(params.num_threads * params.num_blocks <= 256);
+    my_assert(MemPool.ptr == NULL);
     for (int i = 0; i < params.num_threads; i++)
     {
-        params_t[i].thread_id = i;
-        params_t[i].block_size = params.memory_size / params.num_threads;
-        int rc = pthread_create(&threads[i], NULL, (void *(*)(void *))test_func, &params_t[i]);
-        my_assert(rc == 0); // Ensure thread creation was successful
+        thread_data[i].thread_id = i;
+        thread_data[i].iterations = params.iterations;
+        thread_data[i].num_blocks = params.num_blocks;
+        pthread_create(&threads[i], NULL, thread_static_pool, &thread_data[i]);
     }
 
-    // Wait for all threads to complete
     for (int i = 0; i < params.num_threads; i++)
     {
         pthread_join(threads[i], NULL);
     }
-    mem_deinit();
-    my_barrier_destroy(&barrier);
+
+    // Every block can be taken once, then the pool is exhausted
+    void *blocks[256];
+    for (int i = 0; i < 256; i++)
+    {
+        blocks[i] = MEM_STATIC_ALLOC(static_nodes);
+        my_assert(blocks[i] != NULL);
+        my_assert(i == 0 || blocks[i] != blocks[i - 1]);
+    }
+    my_assert(MEM_STATIC_ALLOC(static_nodes) == NULL);
+    my_assert(!MEM_STATIC_OWNS(static_nodes, (char *)blocks[0] + 256 * MEM_STATIC_SLOT(24)));
+    my_assert(static_nodes.slot_size == 32);
+
+    // The last block freed is the first one reused
+    MEM_STATIC_FREE(static_nodes, blocks[7]);
+    MEM_STATIC_FREE(static_nodes, blocks[3]);
+    my_assert(MEM_STATIC_ALLOC(static_nodes) == blocks[3]);
+    my_assert(MEM_STATIC_ALLOC(static_nodes) == blocks[7]);
+    for (int i = 0; i < 256; i++)
+    {
+        MEM_STATIC_FREE(static_nodes, blocks[i]);
+    }
+
     printf_green("[PASS].\n");
 }
 
-void sanityCheck(size_t size, char *block, char expected_value)
+/*
+ * Each thread allocates for tenant 1 or 2, by its id, and keeps its blocks in
+ * block_pointers. Blocks the quota refuses stay NULL.
+ */
+void *thread_tenant(void *arg)
 {
-    if (block == NULL)
-        return;
+    thread_data_t *data = (thread_data_t *)arg;
+    my_assert(mem_tenant_set(1 + data->thread_id % 2));
 
-    for (int i = 0; i < size; ++i)
+    for (int i = 0; i < data->num_blocks; i++)
     {
-        my_assert(block[i] == expected_value);
+        data->block_pointers[i] = mem_alloc(data->block_size);
+        if (data->block_pointers[i]) memset(data->block_pointers[i], data->thread_id, data->block_size);
     }
+
+    my_assert(mem_tenant_set(0));
+    return NULL;
 }
 
-void *test_alloc_and_free(void *arg)
+void test_tenant_multithread(TestParams params)
 {
-    thread_data_t *data = (thread_data_t *)arg;
+    printf_yellow("  Testing tenant quotas (threads: %d) ---> ", params.num_threads);
 
-    // Allocate and fill two blocks of memory with unique patterns
-    size_t block1_size = data->block_size / 4;
-    char *block1 = (char *)mem_alloc(block1_size);
-    my_assert(block1 != NULL);
-    memset(block1, data->thread_id, block1_size); // Unique pattern using thread_id
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    void *pointers[params.num_threads][params.num_blocks];
+    struct MemStats stats;
+    struct MemTenantStats tenant;
+    size_t block = params.block_size;
+
+    my_assert(!mem_tenant_set(MEM_MAX_TENANTS));
+    my_assert(!mem_tenant_quota(MEM_MAX_TENANTS, 0, 0));
+    my_assert(mem_tenant_get() == 0);
+
+    // Tenant 1 runs away and is held at its hard limit, tenant 2 gets all it asks for
+    size_t hard = params.num_blocks * block;
+    my_assert(mem_tenant_quota(1, hard / 2, hard));
+    mem_init(params.num_threads * params.num_blocks * block);
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = block;
+        thread_data[i].num_blocks = params.num_blocks;
+        thread_data[i].block_pointers = pointers[i];
+        pthread_create(&threads[i], NULL, thread_tenant, &thread_data[i]);
+    }
 
-    size_t block2_size = block1_size * 3; // Corrected from undefined block2_size variable
-    char *block2 = (char *)mem_alloc(block2_size);
-    my_assert(block2 != NULL);
-    memset(block2, data->thread_id + block1_size, block2_size); // Another unique pattern offset by 100
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
 
-    my_barrier_wait(&barrier); // Assuming barrier is defined somewhere globally
+    int tenant2_threads = params.num_threads / 2;
+    my_assert(mem_tenant_stats(1, &tenant));
+    my_assert(tenant.used_bytes == hard && tenant.num_blocks == (size_t)params.num_blocks);
+    my_assert(tenant.soft_limit == hard / 2 && tenant.hard_limit == hard);
+    my_assert(tenant.soft_overruns == 1);
+    my_assert(tenant.hard_failures == (size_t)(params.num_threads - tenant2_threads - 1) * params.num_blocks);
+    my_assert(mem_tenant_stats(2, &tenant));
+    my_assert(tenant.used_bytes == (size_t)tenant2_threads * params.num_blocks * block);
+    my_assert(tenant.hard_failures == 0);
+
+    mem_stats(&stats);
+    my_assert(stats.tenant_bytes[0] == 0);
+    my_assert(stats.tenant_bytes[1] + stats.tenant_bytes[2] == stats.used_bytes);
+
+    // A block of tenant 1 can not grow in place past the limit, freeing credits it from any thread
+    void *first = NULL;
+    for (int i = 0; i < params.num_threads && !first; i += 2)
+    {
+        for (int j = 0; j < params.num_blocks && !first; j++)
+        {
+            first = pointers[i][j];
+        }
+    }
+    my_assert(mem_resize(first, block / 2) == first);
+    my_assert(mem_tenant_stats(1, &tenant) && tenant.used_bytes == hard - block / 2);
+    size_t failures = tenant.hard_failures;
+    my_assert(mem_tenant_set(1));
+    void *filler = mem_alloc_hint(block / 2, MEM_HINT_SHORT);
+    my_assert(filler != NULL);
+    my_assert(mem_resize(first, block) == first);
+    my_assert(mem_tenant_stats(1, &tenant) && tenant.used_bytes == hard);
+    my_assert(tenant.hard_failures == failures + 2);
+    my_assert(mem_tenant_set(0));
+    mem_free(filler);
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        for (int j = 0; j < params.num_blocks; j++)
+        {
+            if (pointers[i][j] && pointers[i][j] != first) mem_free(pointers[i][j]);
+        }
+    }
+    mem_free(first);
+
+    // A block that moves when it grows stays with its tenant, whichever thread resizes it
+    my_assert(mem_tenant_set(2));
+    unsigned char *moved = mem_alloc(block);
+    unsigned char *neighbour = mem_alloc(block);
+    my_assert(moved && neighbour == moved + block);
+    memset(moved, 0x5a, block);
+    my_assert(mem_tenant_set(0));
+    unsigned char *grown = mem_resize(moved, 2 * block);
+    my_assert(grown != NULL && grown != moved);
+    sanityCheck(block, (char *)grown, 0x5a);
+    my_assert(mem_tenant_stats(2, &tenant) && tenant.used_bytes == 3 * block && tenant.num_blocks == 2);
+    my_assert(mem_tenant_stats(0, &tenant) && tenant.used_bytes == 0 && tenant.num_blocks == 0);
+    mem_free(grown);
+    mem_free(neighbour);
+    my_assert(mem_tenant_stats(2, &tenant) && tenant.used_bytes == 0 && tenant.num_blocks == 0);
+
+    mem_stats(&stats);
+    my_assert(stats.used_bytes == 0);
+    my_assert(mem_tenant_stats(1, &tenant) && tenant.used_bytes == 0 && tenant.num_blocks == 0);
+    my_assert(tenant.peak_bytes == hard);
+    mem_deinit();
 
-    // Check integrity of the data before freeing
-    sanityCheck(block1_size, block1, data->thread_id);
-    sanityCheck(block2_size, block2, data->thread_id + block1_size);
+    my_assert(mem_tenant_quota(1, 0, 0));
+    printf_green("[PASS].\n");
+}
 
-    mem_free(block1);
-    mem_free(block2);
+/*
+ * Each thread allocates batches of blocks from a bimodal size distribution, small
+ * records and kilobyte buffers, checks that the blocks do not overlap and frees them.
+ */
+void *thread_bimodal(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+    unsigned int seed = data->thread_id;
+
+    for (int i = 0; i < data->iterations; i++)
+    {
+        char *blocks[data->num_blocks];
+        size_t sizes[data->num_blocks];
+        for (int j = 0; j < data->num_blocks; j++)
+        {
+            sizes[j] = rand_r(&seed) % 2 ? 20 + rand_r(&seed) % 11 : 990 + rand_r(&seed) % 21;
+            blocks[j] = mem_alloc(sizes[j]);
+            my_assert(blocks[j] != NULL);
+            memset(blocks[j], data->thread_id + j, sizes[j]);
+        }
+
+        for (int j = 0; j < data->num_blocks; j++)
+        {
+            sanityCheck(sizes[j], blocks[j], data->thread_id + j);
+            mem_free(blocks[j]);
+        }
+    }
 
     return NULL;
 }
 
-void *test_zero_alloc_and_free(void *arg)
+void test_autotune_multithread(TestParams params)
 {
-    thread_data_t *data = (thread_data_t *)arg;
+    printf_yellow("  Testing auto-tuned size classes (threads: %d) ---> ", params.num_threads);
 
-    void *block1 = mem_alloc(0);
-    my_assert(block1 != NULL);
-    void *block2 = mem_alloc(200);
-    my_assert(block2 != NULL);
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    struct MemStats stats;
 
-    memset(block2, data->thread_id, 200); // Unique pattern using thread_id
+    mem_init_config(&(struct MemConfig){.size = params.memory_size, .autotune = true});
 
-    my_barrier_wait(&barrier);
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        thread_data[i].thread_id = i;
+        thread_data[i].num_blocks = params.num_blocks;
+        thread_data[i].iterations = params.iterations;
+        pthread_create(&threads[i], NULL, thread_bimodal, &thread_data[i]);
+    }
 
-    sanityCheck(200, block2, data->thread_id);
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
 
-    mem_free(block1);
-    mem_free(block2);
+    // The exited threads returned their cached blocks
+    mem_stats(&stats);
+    my_assert(stats.used_bytes == 0);
+    my_assert(stats.cached_bytes == 0);
+    my_assert(stats.num_allocs == stats.num_frees);
+
+    // The classes fit the two modes and most requests skipped the lock
+    my_assert(stats.tunings > 0);
+    my_assert(stats.num_classes >= 2);
+    my_assert(stats.class_sizes[0] == 32);
+    my_assert(stats.class_sizes[stats.num_classes - 1] == 1024);
+    for (size_t c = 1; c < stats.num_classes; c++)
+        my_assert(stats.class_sizes[c] > stats.class_sizes[c - 1] && stats.cache_depths[c] > 0);
+    my_assert(stats.cache_hits > stats.num_allocs / 2);
+    my_assert(stats.class_waste < 0.1);
 
-    return NULL;
+    mem_deinit();
+    printf_green("[PASS].\n");
 }
 
 /*
- * This function is used to test the allocation of random blocks of memory and then freeing them in a multithreading context.
- * The test passes if all allocations and deallocations are successful.
+ * Threads dirty most of the pool and free it again, mem_trim then returns the
+ * free pages to the OS. With a background trimmer the pages go back on their own.
  */
-
-void *thread_alloc_free(void *arg)
+void *thread_dirty_and_free(void *arg)
 {
     thread_data_t *data = (thread_data_t *)arg;
-    int block_size;
 
-    // Allocation phase
-    for (int i = 0; i < data->num_blocks; i++)
+    for (int i = 0; i < data->iterations; i++)
     {
-        block_size = rand() % data->max_block_size;
-        data->block_pointers[i] = mem_alloc(block_size);
-        my_assert(data->block_pointers[i] != NULL); // Make sure the allocation was successful
+        void *block = mem_alloc(data->block_size);
+        my_assert(block != NULL);
+        memset(block, data->thread_id + 1, data->block_size);
+        mem_free(block);
     }
 
-    // De-allocation phase
-    for (int i = 0; i < data->num_blocks; i++)
+    return NULL;
+}
+
+static void run_dirty_and_free(TestParams params)
+{
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+
+    for (int i = 0; i < params.num_threads; i++)
     {
-        mem_free(data->block_pointers[i]);
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = params.block_size;
+        thread_data[i].iterations = params.iterations;
+        pthread_create(&threads[i], NULL, thread_dirty_and_free, &thread_data[i]);
     }
 
-    return NULL;
+    for (int i = 0; i < params.num_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
 }
 
-void test_random_blocks_multithread(TestParams params)
+void test_trim_multithread(TestParams params)
 {
-    printf_yellow("  Testing \"mem_alloc\" and mem_free for random blocks (threads: %d, max_block_size: %zu) ---> ", params.num_threads, params.block_size);
-    srand(time(NULL)); // Initialize random seed
+    printf_yellow("  Testing mem_trim (threads: %d) ---> ", params.num_threads);
+
+    struct MemStats stats;
+    long page = sysconf(_SC_PAGESIZE);
+
+    mem_init(params.num_threads * params.block_size);
+    run_dirty_and_free(params);
+
+    mem_stats(&stats);
+    my_assert(stats.dirty_bytes >= params.block_size);
+
+    // One small live block keeps its pages, the rest of the pool goes back
+    void *live = mem_alloc(16);
+    memset(live, 0xFF, 16);
+    my_assert(mem_trim() > 0);
+    mem_stats(&stats);
+    my_assert(stats.dirty_bytes == (size_t)page);
+    my_assert(stats.trimmed_bytes > 0);
+
+    // Trimmed pages read as zero, so mem_calloc does not need to clear them
+    size_t skipped = stats.calloc_skipped;
+    char *block = mem_calloc(1, params.block_size);
+    my_assert(block != NULL);
+    sanityCheck(params.block_size, block, 0);
+    mem_stats(&stats);
+    my_assert(stats.calloc_skipped > skipped);
+
+    mem_free(block);
+    mem_free(live);
+    mem_deinit();
 
-    int total_blocks = 1000 + rand() % 10000;
-    int mem_size = total_blocks * params.block_size;
+    // The background trimmer releases the pages after they stayed free for the decay time
+    mem_init_config(&(struct MemConfig){.size = params.num_threads * params.block_size, .trim_decay_ms = 10});
+    run_dirty_and_free(params);
 
-    mem_init(mem_size);
+    for (int i = 0; i < 100; i++)
+    {
+        mem_stats(&stats);
+        if (stats.dirty_bytes == 0)
+            break;
+        usleep(10000);
+    }
+    my_assert(stats.dirty_bytes == 0);
 
-    pthread_t threads[params.num_threads];
-    thread_data_t thread_data[params.num_threads];
-    void *block_pointers[total_blocks]; // Array to hold pointers to allocated blocks
+    mem_deinit();
+    printf_green("[PASS].\n");
+}
 
-    // Prepare thread data
-    for (int i = 0; i < params.num_threads; i++)
+/*
+ * Each thread allocates blocks at growing alignments between unaligned ones,
+ * and checks the alignment and that the blocks do not overlap.
+ */
+void *thread_aligned(void *arg)
+{
+    thread_data_t *data = (thread_data_t *)arg;
+
+    for (int i = 0; i < data->iterations; i++)
     {
-        thread_data[i].num_blocks = total_blocks / params.num_threads;
-        thread_data[i].max_block_size = params.block_size;
-        thread_data[i].block_pointers = &block_pointers[i * thread_data[i].num_blocks];
+        char *blocks[8];
+        for (int j = 0; j < 8; j++)
+        {
+            size_t align = (size_t)1 << (j + 1);
+            blocks[j] = j % 2 ? mem_alloc(data->block_size + j) : mem_alloc_aligned(data->block_size, align);
+            my_assert(blocks[j] != NULL);
+            my_assert(j % 2 || (uintptr_t)blocks[j] % align == 0);
+            memset(blocks[j], data->thread_id + j, data->block_size);
+        }
+
+        for (int j = 0; j < 8; j++)
+        {
+            sanityCheck(data->block_size, blocks[j], data->thread_id + j);
+            mem_free(blocks[j]);
+        }
     }
 
-    // Launch threads
+    return NULL;
+}
+
+void test_aligned_alloc_multithread(TestParams params)
+{
+    printf_yellow("  Testing mem_alloc_aligned (threads: %d) ---> ", params.num_threads);
+
+    pthread_t threads[params.num_threads];
+    thread_data_t thread_data[params.num_threads];
+    struct MemStats stats;
+
+    // Room for the blocks and the bytes skipped to align them
+    mem_init(params.num_threads * 8 * (params.block_size + 512));
+
+    // Alignments that are not a power of two are refused
+    my_assert(mem_alloc_aligned(16, 24) == NULL);
+
     for (int i = 0; i < params.num_threads; i++)
     {
-        pthread_create(&threads[i], NULL, thread_alloc_free, &thread_data[i]);
+        thread_data[i].thread_id = i;
+        thread_data[i].block_size = params.block_size;
+        thread_data[i].iterations = params.iterations;
+        pthread_create(&threads[i], NULL, thread_aligned, &thread_data[i]);
     }
 
-    // Wait for all threads to finish
     for (int i = 0; i < params.num_threads; i++)
     {
         pthread_join(threads[i], NULL);
     }
 
-    mem_deinit(); // Clean up memory manager after all operations
+    mem_stats(&stats);
+    my_assert(stats.used_bytes == 0);
+    my_assert(stats.alloc_failures == 0);
+
+    mem_deinit();
     printf_green("[PASS].\n");
 }
 
@@ -902,7 +2807,8 @@ int main(int argc, char *argv[])
         printf("  0. tests various functions with a base number of threads\n");
         printf("  1. tests various functions across variious configurations (number of threads, memory sizes,  iterations)\n");
         printf("  2. stress tests various functions with various configurations. This may take some time (especially if simulate_work flag is set to true.\n");
-        printf("  3. test_looking_for_out_of_bounds, needs LD_PRELOAD=./libmymalloc.so .\n\n");
+        printf("  3. test_looking_for_out_of_bounds, needs LD_PRELOAD=./libmymalloc.so .\n");
+        printf("  4. scaling benchmark across configurations, writes scaling.csv (optional argument: iterations per thread, default 1000).\n\n");
         return 1;
     }
 
@@ -935,6 +2841,26 @@ int main(int argc, char *argv[])
 
         test_memory_fragmentation_multithread((TestParams){.num_threads = base_num_threads, .memory_size = 2048});
         test_random_blocks_multithread((TestParams){.num_threads = base_num_threads, .block_size = 1024});
+        test_cross_thread_free_multithread((TestParams){.num_threads = base_num_threads, .num_blocks = 256, .block_size = 64});
+        test_lock_policies_multithread((TestParams){.num_threads = base_num_threads, .iterations = 1000, .block_size = 128});
+        test_calloc_multithread((TestParams){.num_threads = base_num_threads, .iterations = 1000, .block_size = 8192});
+        test_file_pool_restart_multithread((TestParams){.num_threads = base_num_threads, .block_size = 256});
+        test_shm_pool_multiprocess((TestParams){.num_threads = base_num_threads, .block_size = 1024});
+        test_arena_multithread((TestParams){.num_threads = base_num_threads, .memory_size = 65536, .iterations = 100, .num_blocks = 64, .block_size = 512});
+        test_autotune_multithread((TestParams){.num_threads = base_num_threads, .memory_size = 1 << 20, .iterations = 2000, .num_blocks = 16});
+        test_trim_multithread((TestParams){.num_threads = base_num_threads, .iterations = 100, .block_size = 65536});
+        test_aligned_alloc_multithread((TestParams){.num_threads = base_num_threads, .iterations = 1000, .block_size = 100});
+        test_stack_multithread((TestParams){.num_threads = base_num_threads, .memory_size = 65536, .iterations = 100, .num_blocks = 40, .block_size = 4096});
+        test_map_multithread((TestParams){.num_threads = base_num_threads, .iterations = 100, .num_blocks = 16, .block_size = 512});
+        test_block_table_multithread((TestParams){.num_threads = base_num_threads, .iterations = 200, .num_blocks = 64, .block_size = 16});
+        test_gap_index_multithread((TestParams){.num_threads = base_num_threads, .num_blocks = 256, .block_size = 48});
+        test_placement_multithread((TestParams){.num_threads = base_num_threads, .iterations = 50, .num_blocks = 64, .block_size = 32});
+        test_maint_multithread((TestParams){.num_threads = base_num_threads, .iterations = 200, .num_blocks = 64, .block_size = 32});
+        test_walk_multithread((TestParams){.num_threads = base_num_threads, .iterations = 200, .num_blocks = 64, .block_size = 32});
+        test_sized_free_multithread((TestParams){.num_threads = base_num_threads, .memory_size = 1 << 20, .iterations = 2000, .num_blocks = 16});
+        test_hint_multithread((TestParams){.num_threads = base_num_threads, .num_blocks = 200, .block_size = 64});
+        test_static_pool_multithread((TestParams){.num_threads = base_num_threads, .iterations = 1000, .num_blocks = 32});
+        test_tenant_multithread((TestParams){.num_threads = base_num_threads, .num_blocks = 100, .block_size = 64});
 
         break;
 
@@ -985,6 +2911,11 @@ int main(int argc, char *argv[])
         test_looking_for_out_of_bounds();
         break;
 
+    case 4:
+        printf("\n*** Scaling benchmark across configurations: ***\n");
+        scalingAcrossConfigurations("scaling.csv", argc > 2 ? atoi(argv[2]) : 1000);
+        break;
+
     default:
         printf("Invalid test function\n");
         break;
@@ -0,0 +1,308 @@
+// test_pool_allocator.cpp
+// Tests of the C++ interfaces of the memory manager, mm::pool_allocator, the
+// mm std::pmr resources and mm::static_pool
+#include "common_defs.h"
+#include "memory_manager.h"
+#include "mm_pmr.hpp"
+#include "mm_static_pool.hpp"
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+static bool aligned(const void *ptr, std::size_t align)
+{
+    return reinterpret_cast<std::uintptr_t>(ptr) % align == 0;
+}
+
+template <typename T>
+using pool_list = std::list<T, mm::pool_allocator<T>>;
+
+template <typename K, typename V>
+using pool_map = std::map<K, V, std::less<K>, mm::pool_allocator<std::pair<const K, V>>>;
+
+template <typename K, typename V>
+using pool_unordered_map = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, mm::pool_allocator<std::pair<const K, V>>>;
+
+// Fills a list, a map and an unordered_map on alloc, erases every other
+// element and checks what is left
+static void check_containers(const mm::pool_allocator<long> &alloc)
+{
+    pool_list<long> list(alloc);
+    pool_map<int, long> map(alloc);
+    pool_unordered_map<int, long> hash(alloc);
+    for (int i = 0; i < 5000; i++)
+    {
+        list.push_back(i);
+        map[i] = 2L * i;
+        hash[i] = 3L * i;
+    }
+    for (int i = 0; i < 5000; i += 2)
+    {
+        map.erase(i);
+        hash.erase(i);
+    }
+    list.remove_if([](long v) { return v % 2 == 0; });
+
+    long sum = 0;
+    for (long v : list)
+        sum += v;
+    my_assert(list.size() == 2500 && sum == 2500L * 2500);
+    for (int i = 0; i < 5000; i++)
+    {
+        my_assert(map.count(i) == (size_t)(i % 2) && hash.count(i) == (size_t)(i % 2));
+        my_assert(i % 2 == 0 || (map[i] == 2L * i && hash[i] == 3L * i));
+    }
+    my_assert(map.get_allocator() == alloc && hash.get_allocator() == alloc);
+}
+
+// Copies, moves and swaps lists on the allocators of two pools and checks
+// that each allocator goes along with its elements
+static void check_propagation(const mm::pool_allocator<long> &alloc, const mm::pool_allocator<long> &other)
+{
+    pool_list<long> mine({1, 2, 3, 4}, alloc);
+    pool_list<long> copy(mine);
+    my_assert(copy.get_allocator() == alloc && copy == mine);
+
+    pool_list<long> theirs({7, 8, 9}, other);
+    copy = theirs;
+    my_assert(copy.get_allocator() == other && copy == theirs);
+
+    pool_list<long> moved(alloc);
+    moved = std::move(theirs);
+    my_assert(moved.get_allocator() == other && moved.size() == 3);
+
+    moved.swap(mine);
+    my_assert(moved.get_allocator() == alloc && moved.size() == 4);
+    my_assert(mine.get_allocator() == other && mine.size() == 3);
+}
+
+void test_pool_allocator()
+{
+    printf_yellow("  Testing mm::pool_allocator ---> ");
+
+    mem_init(4 << 20);
+    struct MemStats stats;
+    {
+        mm::pool pool;
+        mm::pool other;
+        mm::pool_allocator<long> alloc(pool);
+        mm::pool_allocator<long> other_alloc(other);
+
+        check_containers(alloc);
+        check_propagation(alloc, other_alloc);
+
+        // Rebound copies share the pool and compare equal, allocators of other pools do not
+        using rebound = std::allocator_traits<mm::pool_allocator<long>>::rebind_alloc<double>;
+        static_assert(std::is_same<rebound, mm::pool_allocator<double>>::value, "");
+        rebound doubles(alloc);
+        my_assert(doubles.get_pool() == &pool);
+        my_assert(doubles == alloc && alloc == doubles && !(doubles != alloc));
+        my_assert(alloc != other_alloc && doubles != other_alloc && !(alloc == other_alloc));
+        my_assert(mm::pool_allocator<long>() == mm::pool_allocator<char>());
+        my_assert(mm::pool_allocator<long>().get_pool() == &mm::pool::global());
+
+        // A block from one allocator goes back through an equal one
+        double *d = doubles.allocate(1);
+        *d = 1.5;
+        alloc.deallocate(reinterpret_cast<long *>(d), 1);
+
+        // The slabs keep their chunks until release() hands them back
+        mem_stats(&stats);
+        my_assert(stats.used_bytes > 0);
+        pool.release();
+        other.release();
+        mem_stats(&stats);
+        my_assert(stats.used_bytes == 0 && stats.num_blocks == 0);
+    }
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+// Allocates blocks of every alignment up to 4096 bytes from resource, from the
+// slabs and past them, and checks their alignment and that they hold their data
+static void check_alignment(std::pmr::memory_resource &resource)
+{
+    std::size_t sizes[] = {1, 24, 100, 256, 1000};
+    for (std::size_t align = 1; align <= 4096; align *= 2)
+    {
+        for (std::size_t size : sizes)
+        {
+            auto *block = static_cast<unsigned char *>(resource.allocate(size, align));
+            my_assert(aligned(block, align));
+            std::memset(block, 0x3c, size);
+            my_assert(block[0] == 0x3c && block[size - 1] == 0x3c);
+            resource.deallocate(block, size, align);
+        }
+    }
+}
+
+// Fills a std::pmr::vector on resource, copies it into a second vector on the
+// same resource and checks that both hold the values
+static void check_vector(std::pmr::memory_resource &resource)
+{
+    std::pmr::vector<long> values(&resource);
+    for (long i = 0; i < 10000; i++)
+        values.push_back(i * 3);
+    my_assert(values.get_allocator().resource() == &resource);
+
+    std::pmr::vector<long> copy(values, &resource);
+    values.clear();
+    values.shrink_to_fit();
+
+    long sum = 0;
+    for (long i = 0; i < (long)copy.size(); i++)
+    {
+        my_assert(copy[i] == i * 3);
+        sum += copy[i];
+    }
+    my_assert(copy.size() == 10000 && sum == 3L * 9999 * 10000 / 2);
+}
+
+void test_pmr_resources()
+{
+    printf_yellow("  Testing the std::pmr resources ---> ");
+
+    mem_init(4 << 20);
+    struct MemStats stats;
+    {
+        mm::pool_resource pool;
+        mm::unsynchronized_pool_resource local;
+        mm::monotonic_resource arena(4096);
+
+        check_alignment(pool);
+        check_alignment(local);
+        check_alignment(arena);
+
+        check_vector(pool);
+        check_vector(local);
+        check_vector(arena);
+
+        // Resources are only equal to themselves, even of the same type
+        mm::pool_resource other;
+        my_assert(pool.is_equal(pool) && !pool.is_equal(other) && !other.is_equal(pool));
+        my_assert(!pool.is_equal(local) && !local.is_equal(arena) && !arena.is_equal(pool));
+        my_assert(!pool.is_equal(*std::pmr::new_delete_resource()));
+        my_assert(arena.is_equal(arena) && local.is_equal(local));
+
+        // release() hands the arena out again from its first chunk, without giving back its chunks
+        arena.release();
+        void *first = arena.allocate(64, 16);
+        void *spilled = arena.allocate(3000, 16);
+        my_assert(arena.allocate(3000, 16) != spilled);
+        mem_stats(&stats);
+        size_t used = stats.used_bytes;
+        arena.release();
+        my_assert(arena.allocate(64, 16) == first);
+        my_assert(arena.allocate(3000, 16) == spilled);
+        mem_stats(&stats);
+        my_assert(stats.used_bytes == used);
+
+        // A request that wraps with its alignment slack is refused
+        bool refused = false;
+        volatile std::size_t huge = SIZE_MAX - 8;
+        try
+        {
+            (void)arena.allocate(huge, 64);
+        }
+        catch (const std::bad_alloc &)
+        {
+            refused = true;
+        }
+        my_assert(refused);
+
+        pool.release();
+        local.release();
+    }
+
+    // The resources leave nothing behind in the pool
+    mem_stats(&stats);
+    my_assert(stats.used_bytes == 0 && stats.num_blocks == 0);
+    mem_deinit();
+
+    printf_green("[PASS].\n");
+}
+
+// Pools in static storage, as the pool is meant to be used
+static mm::static_pool<24, 8> small_pool;
+static mm::static_pool<100, 4, 64> aligned_pool;
+
+void test_static_pool()
+{
+    printf_yellow("  Testing mm::static_pool ---> ");
+
+    static_assert(decltype(small_pool)::block_size == 32 && decltype(small_pool)::capacity == 8, "");
+    static_assert(decltype(aligned_pool)::block_size == 128, "");
+
+    // Every block is handed out once, aligned and apart from the others, then the pool is exhausted
+    void *blocks[8];
+    for (int i = 0; i < 8; i++)
+    {
+        my_assert(small_pool.available() == (std::size_t)(8 - i));
+        blocks[i] = small_pool.allocate();
+        my_assert(blocks[i] != nullptr && aligned(blocks[i], alignof(std::max_align_t)));
+        my_assert(small_pool.owns(blocks[i]));
+        std::memset(blocks[i], i, 24);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        for (int j = 0; j < i; j++)
+            my_assert(blocks[i] != blocks[j]);
+        my_assert(static_cast<unsigned char *>(blocks[i])[23] == i);
+    }
+    my_assert(small_pool.available() == 0);
+    my_assert(small_pool.allocate() == nullptr);
+    my_assert(small_pool.allocate() == nullptr);
+
+    // Freed blocks come back, the last freed first, and the pool fills up again
+    small_pool.deallocate(blocks[2]);
+    small_pool.deallocate(blocks[5]);
+    my_assert(small_pool.available() == 2);
+    my_assert(small_pool.allocate() == blocks[5]);
+    my_assert(small_pool.allocate() == blocks[2]);
+    my_assert(small_pool.allocate() == nullptr);
+    for (int i = 0; i < 8; i++)
+        small_pool.deallocate(blocks[i]);
+    my_assert(small_pool.available() == 8);
+
+    // Blocks of another pool, the stack and the memory manager are not owned
+    void *other[4];
+    for (int i = 0; i < 4; i++)
+    {
+        other[i] = aligned_pool.allocate();
+        my_assert(other[i] != nullptr && aligned(other[i], 64));
+        my_assert(aligned_pool.owns(other[i]) && !small_pool.owns(other[i]));
+    }
+    my_assert(aligned_pool.allocate() == nullptr);
+    int local = 0;
+    my_assert(!small_pool.owns(&local) && !small_pool.owns(nullptr));
+    my_assert(!small_pool.owns(static_cast<unsigned char *>(blocks[0]) + 8 * 32));
+    for (int i = 0; i < 8; i++)
+        my_assert(!aligned_pool.owns(blocks[i]));
+
+    mem_init(4096);
+    void *heap = mem_alloc(32);
+    my_assert(heap != nullptr && !small_pool.owns(heap) && !aligned_pool.owns(heap));
+    mem_free(heap);
+    mem_deinit();
+
+    for (int i = 0; i < 4; i++)
+        aligned_pool.deallocate(other[i]);
+    my_assert(aligned_pool.available() == 4);
+
+    printf_green("[PASS].\n");
+}
+
+int main()
+{
+    printf("\n*** Testing the C++ interfaces: ***\n");
+    test_pool_allocator();
+    test_pmr_resources();
+    test_static_pool();
+    return 0;
+}